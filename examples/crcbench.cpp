@@ -0,0 +1,76 @@
+// Compares the CRC-32 speed of miniz' table implementation and ttvfs' own ones at different buffer sizes
+
+#include <VFSZipCrc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
+#include "miniz.h"
+
+using namespace ttvfs;
+
+static double wallTime()
+{
+#if _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return double(c.QuadPart) / double(f.QuadPart);
+#else
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static unsigned int minizCrc32(unsigned int crc, const void *data, size_t len)
+{
+    return (unsigned int)mz_crc32(crc, (const mz_uint8*)data, len);
+}
+
+typedef unsigned int (*CrcFunc)(unsigned int crc, const void *data, size_t len);
+
+// Returns GB/s
+static double run(CrcFunc f, const std::vector<unsigned char>& data, size_t blockSize, size_t total, unsigned int& result)
+{
+    result = 0;
+    const size_t blocks = data.size() / blockSize;
+    const double start = wallTime();
+    for(size_t done = 0, i = 0; done < total; done += blockSize, i = (i + 1) % blocks)
+        result ^= f(0, &data[i * blockSize], blockSize);
+    const double secs = wallTime() - start;
+    return secs > 0 ? double(total) / secs / (1024.0 * 1024.0 * 1024.0) : 0.0;
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t megs = argc > 1 ? atoi(argv[1]) : 256;
+    const size_t total = megs * 1024 * 1024;
+
+    std::vector<unsigned char> data(16 * 1024 * 1024);
+    srand(42);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = (unsigned char)rand();
+
+    printf("zipCrc32() uses: %s\n", zipCrc32Impl());
+    printf("%10s %10s %10s %10s\n", "block", "miniz", "scalar", "zipCrc32");
+    static const size_t sizes[] = { 64, 1024, 16 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    int mismatches = 0;
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        unsigned int a, b, c;
+        const double ga = run(minizCrc32, data, sizes[i], total, a);
+        const double gb = run(zipCrc32Scalar, data, sizes[i], total, b);
+        const double gc = run(zipCrc32, data, sizes[i], total, c);
+        const bool same = a == b && a == c;
+        if(!same)
+            ++mismatches;
+        printf("%10u %7.2f GB/s %7.2f GB/s %7.2f GB/s%s\n", (unsigned int)sizes[i], ga, gb, gc, same ? "" : " (MISMATCH)");
+    }
+    return mismatches;
+}
@@ -21,9 +21,12 @@ int main(int argc, char *argv[])
     ttvfs::CountedPtr<ttvfs::MemFile> mf = new ttvfs::MemFile("memdata.zip",
         ResourceData, ResourceSize);
 
+    // ttvfs_gen -i also embedded the archive's index, so it doesn't have to be built at startup.
+    ttvfs::VFSZipIndexParams params(ResourceIndex, ResourceIndexSize);
+
     // Make all files from the archive available in the root.
     // The MemFile itself can NOT be accessed from the vfs root.
-    if(!vfs.AddArchive(mf, ""))
+    if(!vfs.AddArchive(mf, "", &params))
     {
         puts("ERROR adding embedded archive");
         return 1;
@@ -0,0 +1,67 @@
+/* ttvfs example #12 - Files inside other files, e.g. an archive embedded in a larger file */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <ttvfs.h>
+#include <ttvfs_zip.h>
+
+int main(int argc, char *argv[])
+{
+    ttvfs::Root vfs;
+    vfs.AddLoader(new ttvfs::DiskLoader);
+    vfs.AddArchiveLoader(new ttvfs::VFSZipArchiveLoader);
+
+    // Any byte range of a file can be used as a file of its own.
+    ttvfs::File *disk = vfs.GetFile("myfile.txt");
+    if(!disk)
+    {
+        puts("ERROR: myfile.txt not found");
+        return 1;
+    }
+    ttvfs::CountedPtr<ttvfs::File> part = new ttvfs::SubrangeFile("part.txt", disk, 8, 10);
+    char buf[513];
+    if(!part->open("rb"))
+    {
+        puts("ERROR: can't open subrange");
+        return 2;
+    }
+    size_t bytes = part->read(buf, 512);
+    buf[bytes] = 0;
+    printf("Bytes 8-17 of myfile.txt: [%s]\n", buf);
+
+    // Build a "pak file" in memory: some header, then a zip file
+    FILE *fh = fopen("test.zip", "rb");
+    if(!fh)
+    {
+        puts("ERROR: test.zip not found");
+        return 3;
+    }
+    static const char header[] = "PAKHEADER";
+    std::vector<char> pak(header, header + sizeof(header));
+    for(size_t n; (n = fread(buf, 1, sizeof(buf), fh)); )
+        pak.insert(pak.end(), buf, buf + n);
+    fclose(fh);
+
+    // Mount the zip part. The pak is in memory, so the archive is read in place without copying.
+    ttvfs::File *mem = new ttvfs::MemFile("game.pak", &pak[0], (unsigned int)pak.size());
+    ttvfs::File *zip = new ttvfs::SubrangeFile("game.pak/data.zip", mem, sizeof(header), pak.size() - sizeof(header));
+    printf("Embedded zip is in memory: %s\n", zip->getMemory() ? "yes" : "no");
+    if(!vfs.AddArchive(zip, "data"))
+    {
+        puts("ERROR: can't mount embedded zip");
+        return 4;
+    }
+
+    ttvfs::File *vf = vfs.GetFile("data/zipped.txt");
+    if(!vf || !vf->open("r"))
+    {
+        puts("ERROR: data/zipped.txt not found");
+        return 5;
+    }
+    bytes = vf->read(buf, 512);
+    buf[bytes] = 0;
+    puts(buf);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Compares the inflate speed of miniz' tinfl and ttvfs' own decoder on all deflated entries of a zip file,
+// then shows how decompressing the largest entry scales with the number of threads
+
+#include <ttvfs.h>
+#include <VFSZipArchiveRef.h>
+#include <VFSZipFormat.h>
+#include <VFSZipInflate.h>
+#include <VFSThreads.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
+
+using namespace ttvfs;
+
+struct Entry
+{
+    const unsigned char *src;
+    size_t srcLen, dstLen;
+};
+
+static double wallTime()
+{
+#if _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return double(c.QuadPart) / double(f.QuadPart);
+#else
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+typedef bool (*InflateFunc)(const void *src, size_t srcLen, void *dst, size_t dstLen);
+
+static double run(InflateFunc f, const std::vector<Entry>& entries, std::vector<char>& out, unsigned int rounds, bool& ok)
+{
+    ok = true;
+    clock_t c = clock();
+    for(unsigned int r = 0; r < rounds; ++r)
+        for(size_t i = 0; i < entries.size(); ++i)
+            ok = f(entries[i].src, entries[i].srcLen, &out[0], entries[i].dstLen) && ok;
+    return double(clock() - c) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2 || !*argv[1])
+    {
+        puts("Specify a zip file!");
+        return 1;
+    }
+    const unsigned int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    FILE *fh = fopen(argv[1], "rb");
+    if(!fh)
+    {
+        puts("Can't open file!");
+        return 1;
+    }
+    std::vector<unsigned char> data;
+    unsigned char block[64 * 1024];
+    for(size_t n; (n = fread(block, 1, sizeof(block), fh)); )
+        data.insert(data.end(), block, block + n);
+    fclose(fh);
+    if(data.empty())
+    {
+        puts("FAIL!");
+        return 1;
+    }
+
+    CountedPtr<ZipArchiveRef> zref = new ZipArchiveRef(new MemFile(argv[1], &data[0], (unsigned int)data.size()));
+    if(!zref->init())
+    {
+        puts("FAIL!");
+        return 1;
+    }
+
+    std::vector<Entry> entries;
+    size_t total = 0, maxLen = 1, largest = 0;
+    for(size_t i = 0; i < zref->entries(); ++i)
+    {
+        const ZipEntryStat& st = zref->entryStat(i);
+        const vfspos hofs = st.headerOfs();
+        if(st.method != ZIP_METHOD_DEFLATED || !st.compSize || hofs + ZIP_LDH_SIZE > (vfspos)data.size())
+            continue;
+        const unsigned char *hdr = &data[(size_t)hofs];
+        const size_t ofs = (size_t)hofs + ZIP_LDH_SIZE + zipRead16(hdr + ZIP_LDH_NAME_LEN_OFS) + zipRead16(hdr + ZIP_LDH_EXTRA_LEN_OFS);
+        if(ofs + st.compSize > data.size())
+            continue;
+        Entry e = { &data[ofs], st.compSize, st.uncompSize };
+        entries.push_back(e);
+        total += st.uncompSize;
+        if(maxLen < st.uncompSize)
+        {
+            maxLen = st.uncompSize;
+            largest = entries.size() - 1;
+        }
+    }
+    printf("Deflated entries: %u, %u bytes uncompressed\n", (unsigned int)entries.size(), (unsigned int)total);
+
+    // Both decoders must produce the same bytes
+    std::vector<char> a(maxLen), b(maxLen);
+    size_t mismatches = 0;
+    for(size_t i = 0; i < entries.size(); ++i)
+    {
+        const Entry& e = entries[i];
+        const bool oka = zipInflateTinfl(e.src, e.srcLen, &a[0], e.dstLen);
+        const bool okb = zipInflate(e.src, e.srcLen, &b[0], e.dstLen);
+        if(oka != okb || (oka && memcmp(&a[0], &b[0], e.dstLen)))
+            ++mismatches;
+    }
+    printf("Mismatches: %u\n", (unsigned int)mismatches);
+
+    bool ok1, ok2;
+    const double t1 = run(zipInflateTinfl, entries, a, rounds, ok1);
+    const double t2 = run(zipInflate, entries, b, rounds, ok2);
+    const double mb = double(total) * rounds / (1024.0 * 1024.0);
+    printf("tinfl:      %.3f s, %.1f MB/s%s\n", t1, t1 > 0 ? mb / t1 : 0.0, ok1 ? "" : " (errors)");
+    printf("zipInflate: %.3f s, %.1f MB/s%s\n", t2, t2 > 0 ? mb / t2 : 0.0, ok2 ? "" : " (errors)");
+
+    if(entries.empty())
+        return mismatches ? 1 : 0;
+
+    // Threads: compare wall clock time instead of CPU time
+    const Entry& big = entries[largest];
+    printf("Largest entry: %u bytes, %u compressed\n", (unsigned int)big.dstLen, (unsigned int)big.srcLen);
+    zipInflate(big.src, big.srcLen, &a[0], big.dstLen);
+    const unsigned int cpus = argc > 3 ? std::max(atoi(argv[3]), 1) : Thread::HardwareConcurrency();
+    double base = 0;
+    for(unsigned int t = 1; ; t = std::min(t * 2, cpus))
+    {
+        bool okp = true;
+        const double start = wallTime();
+        for(unsigned int r = 0; r < rounds; ++r)
+            okp = zipInflateParallel(big.src, big.srcLen, &b[0], big.dstLen, t) && okp;
+        const double secs = wallTime() - start;
+        if(t == 1)
+            base = secs;
+        const bool same = okp && !memcmp(&a[0], &b[0], big.dstLen);
+        if(!same)
+            ++mismatches;
+        printf("%2u threads: %.3f s, %.1f MB/s, speedup %.2f%s\n", t, secs,
+            secs > 0 ? double(big.dstLen) * rounds / (1024.0 * 1024.0) / secs : 0.0,
+            secs > 0 ? base / secs : 0.0, same ? "" : " (MISMATCH)");
+        if(t == cpus)
+            break;
+    }
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+// Compares the speed of the byte-wise and vectorized newline conversion used for files opened in text mode
+
+#include <ttvfs.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
+
+using namespace ttvfs;
+
+static double wallTime()
+{
+#if _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return double(c.QuadPart) / double(f.QuadPart);
+#else
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// Lines of random length between 1 and 2*avgLine
+static void makeText(std::vector<char>& text, size_t size, size_t avgLine, const char *eol)
+{
+    text.clear();
+    while(text.size() < size)
+    {
+        const size_t len = rand() % (2 * avgLine) + 1;
+        for(size_t i = 0; i < len; ++i)
+            text.push_back('a' + rand() % 26);
+        text.insert(text.end(), eol, eol + strlen(eol));
+    }
+    text.push_back(0);
+}
+
+typedef size_t (*NLFunc)(char *dst, const char *src, unsigned int n);
+
+// Converts in place, like ZipFile does. Returns MB/s.
+static double run(NLFunc f, const std::vector<char>& text, std::vector<char>& buf, unsigned int rounds, size_t& result)
+{
+    double secs = 0;
+    result = 0;
+    for(unsigned int r = 0; r < rounds; ++r)
+    {
+        buf = text;
+        const double start = wallTime();
+        result = f(&buf[0], &buf[0], (unsigned int)-1);
+        secs += wallTime() - start;
+    }
+    return secs > 0 ? double(text.size()) * rounds / (1024.0 * 1024.0) / secs : 0.0;
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned int rounds = argc > 1 ? std::max(atoi(argv[1]), 1) : 20;
+    const size_t size = 8 * 1024 * 1024;
+
+    struct Case { const char *name; size_t avgLine; const char *eol; };
+    static const Case cases[] =
+    {
+        { "LF, short lines", 20, "\n" },
+        { "LF, long lines", 80, "\n" },
+        { "CRLF, short lines", 20, "\r\n" },
+        { "CRLF, long lines", 80, "\r\n" },
+        { "no newlines", size, "" },
+    };
+
+    std::vector<char> text, a, b;
+    int mismatches = 0;
+    printf("%-20s %12s %12s\n", "", "scalar", "strnNLcpy");
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        srand(42);
+        makeText(text, size, cases[i].avgLine, cases[i].eol);
+        size_t ra, rb;
+        const double sa = run(strnNLcpyScalar, text, a, rounds, ra);
+        const double sb = run(strnNLcpy, text, b, rounds, rb);
+        const bool same = ra == rb && !memcmp(&a[0], &b[0], ra);
+        if(!same)
+            ++mismatches;
+        printf("%-20s %7.0f MB/s %7.0f MB/s%s\n", cases[i].name, sa, sb, same ? "" : " (MISMATCH)");
+    }
+    return mismatches;
+}
@@ -0,0 +1,150 @@
+// Reads all files of a zip file, first one by one, then with Root::ReadMany() and different numbers of threads
+
+#include <ttvfs.h>
+#include <ttvfs_zip.h>
+#include <VFSThreads.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
+
+using namespace ttvfs;
+
+static double wallTime()
+{
+#if _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return double(c.QuadPart) / double(f.QuadPart);
+#else
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static unsigned int hashData(const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    unsigned int h = 2166136261u;
+    for(size_t i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static Root vfs;
+static std::vector<std::string> files;
+static std::vector<std::string> dirs;
+
+static void fileCallback(File *vf, void *)
+{
+    files.push_back(vf->fullname());
+}
+
+static void dirCallback(DirBase *vd, void *)
+{
+    dirs.push_back(vd->fullname());
+}
+
+struct BatchResult
+{
+    ReadRequest *reqs;
+    unsigned int *hashes;
+};
+
+static void readCallback(ReadRequest& req, const void *data, void *user)
+{
+    BatchResult& res = *(BatchResult*)user;
+    res.hashes[&req - res.reqs] = data ? hashData(data, req.size) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2 || !*argv[1])
+    {
+        puts("Specify a zip file!");
+        return 1;
+    }
+    const unsigned int rounds = argc > 2 ? atoi(argv[2]) : 3;
+
+    vfs.AddLoader(new DiskLoader);
+    vfs.AddArchiveLoader(new VFSZipArchiveLoader);
+    if(!vfs.AddArchive(argv[1]))
+    {
+        puts("Can't open archive!");
+        return 1;
+    }
+
+    dirs.push_back(argv[1]);
+    for(size_t i = 0; i < dirs.size(); ++i)
+    {
+        const std::string d = dirs[i];
+        vfs.ForEach(d.c_str(), fileCallback, dirCallback);
+    }
+    const size_t n = files.size();
+    printf("Files: %u\n", (unsigned int)n);
+    if(!n)
+        return 0;
+
+    // One by one
+    std::vector<unsigned int> serial(n), batch(n);
+    std::vector<char> buf;
+    double total = 0;
+    const double start = wallTime();
+    for(unsigned int r = 0; r < rounds; ++r)
+        for(size_t i = 0; i < n; ++i)
+        {
+            File *vf = vfs.GetFile(files[i].c_str());
+            serial[i] = 0;
+            if(!vf || !vf->open("rb"))
+                continue;
+            const size_t size = (size_t)vf->size();
+            buf.resize(size + 1);
+            if(vf->read(&buf[0], size) == size)
+                serial[i] = hashData(&buf[0], size);
+            vf->close();
+            if(!r)
+                total += size;
+        }
+    const double secs = wallTime() - start;
+    const double mb = total * rounds / (1024.0 * 1024.0);
+    printf("Serial:     %.3f s, %.1f MB/s\n", secs, secs > 0 ? mb / secs : 0.0);
+
+    // All at once; the data is only looked at in the callback
+    std::vector<ReadRequest> reqs(n);
+    BatchResult res = { &reqs[0], &batch[0] };
+    const unsigned int cpus = argc > 3 ? std::max(atoi(argv[3]), 1) : Thread::HardwareConcurrency();
+    int mismatches = 0;
+    for(unsigned int t = 1; ; t = std::min(t * 2, cpus))
+    {
+        const double start = wallTime();
+        size_t ok = 0;
+        for(unsigned int r = 0; r < rounds; ++r)
+        {
+            for(size_t i = 0; i < n; ++i)
+            {
+                reqs[i].path = files[i].c_str();
+                reqs[i].dst = NULL;
+                reqs[i].capacity = 0;
+            }
+            ok = vfs.ReadMany(&reqs[0], n, readCallback, &res, t);
+        }
+        const double secs = wallTime() - start;
+        const bool same = serial == batch;
+        if(!same)
+            ++mismatches;
+        printf("ReadMany, %2u threads: %.3f s, %.1f MB/s, %u files ok%s\n", t, secs,
+            secs > 0 ? mb / secs : 0.0, (unsigned int)ok, same ? "" : " (MISMATCH)");
+        if(t == cpus)
+            break;
+    }
+    return mismatches;
+}
@@ -0,0 +1,271 @@
+// Replays an access trace against two archives of the same directory, one in the order of the file list
+// and one laid out by AccessTrace::layout() as ttvfs_gen -t does, and counts the seeks in the archive.
+// If the trace file doesn't exist, a made-up workload is run on the first archive and its trace is written there.
+
+#include <ttvfs.h>
+#include <ttvfs_zip.h>
+#include <VFSZipWriter.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using namespace ttvfs;
+
+static const vfspos READAHEAD = 64 * 1024; // reads that start less than this behind the last one are no seek
+
+// An archive in memory that counts how it is read, as if it was on disk
+class CountingFile : public MemFile
+{
+public:
+    CountingFile(const char *name, std::vector<char>& data)
+        : MemFile(name, &data[0], (unsigned int)data.size()), seeks(0), distance(0), bytes(0), _end(0) {}
+
+    virtual const void *getMemory() const { return NULL; } // the archive must use readAt()
+
+    virtual size_t readAt(vfspos offset, void *dst, size_t n)
+    {
+        if(offset < _end || offset > _end + READAHEAD)
+        {
+            ++seeks;
+            distance += offset < _end ? _end - offset : offset - _end;
+        }
+        _end = offset + n;
+        bytes += n;
+        return MemFile::readAt(offset, dst, n);
+    }
+
+    void reset() { seeks = 0; distance = 0; bytes = 0; }
+
+    size_t seeks;
+    vfspos distance;
+    vfspos bytes;
+
+private:
+    vfspos _end;
+};
+
+static std::vector<std::string> files;
+static std::vector<std::string> dirs;
+
+static void fileCallback(File *vf, void *)
+{
+    files.push_back(vf->fullname());
+}
+
+static void dirCallback(DirBase *vd, void *)
+{
+    dirs.push_back(vd->fullname());
+}
+
+static bool readFile(Root& vfs, const char *path, std::vector<char>& data)
+{
+    File *vf = vfs.GetFile(path);
+    if(!vf)
+        return false;
+    const vfspos sz = vf->size();
+    if(sz == npos)
+        return false;
+    data.resize((size_t)sz + 1);
+    const vfspos got = vf->readAll(&data[0], (size_t)sz);
+    data.resize((size_t)sz);
+    return got == sz;
+}
+
+static bool pack(const std::vector<std::string>& names, const std::map<std::string, std::vector<char> >& contents,
+    std::vector<char>& out)
+{
+    ZipWriter zw;
+    for(size_t i = 0; i < names.size(); ++i)
+    {
+        const std::vector<char>& data = contents.find(names[i])->second;
+        zw.add(names[i].c_str(), data.empty() ? NULL : &data[0], data.size());
+    }
+    return zw.write(out);
+}
+
+// Files belong to one of a few sets, like the assets of a level. One set is used all the time,
+// every phase loads two more, shared with the next phase, in no particular order.
+static void madeUpWorkload(std::vector<std::vector<std::string> >& phases)
+{
+    const unsigned int sets = 8;
+    unsigned int seed = 12345;
+    std::vector<unsigned int> setOf(files.size());
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        setOf[i] = (seed >> 16) % sets;
+    }
+    phases.resize(sets - 2);
+    for(size_t p = 0; p < phases.size(); ++p)
+    {
+        std::vector<std::string>& use = phases[p];
+        for(size_t i = 0; i < files.size(); ++i)
+            if(!setOf[i] || setOf[i] == p + 1 || setOf[i] == p + 2)
+                use.push_back(files[i]);
+        for(size_t i = use.size(); i > 1; --i)
+        {
+            seed = seed * 1103515245 + 12345;
+            std::swap(use[i - 1], use[(seed >> 16) % i]);
+        }
+    }
+}
+
+struct Result
+{
+    size_t seeks;
+    vfspos distance;
+    vfspos bytes;
+    size_t failed;
+};
+
+// Each phase either reads its files one by one, in the order they were used, or all at once with ReadMany()
+static Result replay(std::vector<char>& archive, const std::vector<std::vector<std::string> >& phases, bool batched,
+    AccessTrace *record)
+{
+    Root vfs;
+    vfs.AddArchiveLoader(new VFSZipArchiveLoader);
+    CountedPtr<CountingFile> cf = new CountingFile("archive.zip", archive);
+    Result r = { 0, 0, 0, 0 };
+    if(!vfs.AddArchive(cf, ""))
+    {
+        r.failed = 1;
+        return r;
+    }
+    cf->reset(); // only count reading the files
+    vfs.SetTrace(record);
+
+    std::vector<char> buf;
+    for(size_t p = 0; p < phases.size(); ++p)
+    {
+        const std::vector<std::string>& use = phases[p];
+        if(record && p)
+            record->mark();
+        if(batched)
+        {
+            std::vector<ReadRequest> reqs(use.size());
+            for(size_t i = 0; i < use.size(); ++i)
+            {
+                reqs[i].path = use[i].c_str();
+                reqs[i].dst = NULL;
+                reqs[i].capacity = 0;
+            }
+            if(!reqs.empty()) // on several threads, which take the files in archive order
+                r.failed += reqs.size() - vfs.ReadMany(&reqs[0], reqs.size(), NULL, NULL, 4);
+        }
+        else
+            for(size_t i = 0; i < use.size(); ++i)
+                r.failed += !readFile(vfs, use[i].c_str(), buf);
+    }
+    r.seeks = cf->seeks;
+    r.distance = cf->distance;
+    r.bytes = cf->bytes;
+    return r;
+}
+
+static void print(const char *what, const Result& r)
+{
+    printf("  %-22s %7u seeks, %9.1f MB seek distance, %8.1f MB read%s\n", what, (unsigned int)r.seeks,
+        r.distance / (1024.0 * 1024.0), r.bytes / (1024.0 * 1024.0), r.failed ? ", FAILED reads!" : "");
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2 || !*argv[1])
+    {
+        puts("Usage: tracereplay <dir> [trace]");
+        return 1;
+    }
+
+    Root vfs;
+    vfs.AddLoader(new DiskLoader);
+
+    const std::string base = argv[1];
+    dirs.push_back(base);
+    for(size_t i = 0; i < dirs.size(); ++i)
+    {
+        const std::string d = dirs[i];
+        vfs.ForEach(d.c_str(), fileCallback, dirCallback);
+    }
+    std::sort(files.begin(), files.end());
+
+    const size_t skip = base.length() + (base[base.length() - 1] == '/' ? 0 : 1);
+    std::map<std::string, std::vector<char> > contents;
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        std::vector<char>& data = contents[files[i].c_str() + skip];
+        if(!readFile(vfs, files[i].c_str(), data))
+        {
+            printf("Can't read %s\n", files[i].c_str());
+            return 1;
+        }
+        files[i].erase(0, skip);
+    }
+
+    std::vector<char> listed;
+    if(!pack(files, contents, listed))
+    {
+        puts("Packing failed!");
+        return 1;
+    }
+
+    // The trace, recorded now if there is none
+    CountedPtr<AccessTrace> trace = new AccessTrace;
+    if(argc > 2 && FileExists(argv[2]))
+    {
+        if(!trace->load(argv[2]))
+        {
+            printf("Can't read %s\n", argv[2]);
+            return 1;
+        }
+        printf("Trace: %s\n", argv[2]);
+    }
+    else
+    {
+        std::vector<std::vector<std::string> > workload;
+        madeUpWorkload(workload);
+        replay(listed, workload, false, trace);
+        if(argc > 2 && !trace->save(argv[2]))
+        {
+            printf("Can't write %s\n", argv[2]);
+            return 1;
+        }
+        printf("Trace: made-up workload%s%s\n", argc > 2 ? ", written to " : "", argc > 2 ? argv[2] : "");
+    }
+
+    std::vector<std::vector<std::string> > phases;
+    const std::vector<AccessTrace::Event>& events = trace->events();
+    for(size_t i = 0; i < events.size(); ++i)
+    {
+        if(!i || events[i].phase != events[i - 1].phase)
+            phases.push_back(std::vector<std::string>());
+        phases.back().push_back(events[i].path);
+    }
+
+    std::vector<std::string> order = files;
+    trace->layout(order);
+    std::vector<char> laidOut;
+    if(!pack(order, contents, laidOut))
+    {
+        puts("Packing failed!");
+        return 1;
+    }
+    printf("Files: %u, phases: %u, files read: %u, archive: %u bytes\n", (unsigned int)files.size(),
+        (unsigned int)phases.size(), (unsigned int)events.size(), (unsigned int)listed.size());
+
+    const Result r[4] = {
+        replay(listed, phases, false, NULL), replay(laidOut, phases, false, NULL),
+        replay(listed, phases, true, NULL), replay(laidOut, phases, true, NULL) };
+    puts("One by one, in the order of use:");
+    print("file list order", r[0]);
+    print("trace layout", r[1]);
+    puts("Each phase with ReadMany():");
+    print("file list order", r[2]);
+    print("trace layout", r[3]);
+    for(int i = 0; i < 4; ++i)
+        if(r[i].failed)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,165 @@
+// Packs all files of a directory into a zip file without compression, with the data of every entry aligned,
+// then uses the entries in place from memory and checks that they are aligned and read back the same,
+// also with alignments 2 and 4, where the padding needs more than one step to fit its extra field header
+
+#include <ttvfs.h>
+#include <ttvfs_zip.h>
+#include <VFSZipWriter.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using namespace ttvfs;
+
+static std::vector<std::string> files;
+static std::vector<std::string> dirs;
+
+static void fileCallback(File *vf, void *)
+{
+    files.push_back(vf->fullname());
+}
+
+static void dirCallback(DirBase *vd, void *)
+{
+    dirs.push_back(vd->fullname());
+}
+
+static bool readFile(Root& vfs, const char *path, std::vector<char>& data)
+{
+    File *vf = vfs.GetFile(path);
+    if(!vf)
+        return false;
+    const vfspos sz = vf->size();
+    if(sz == npos)
+        return false;
+    data.resize((size_t)sz + 1);
+    const vfspos got = vf->readAll(&data[0], (size_t)sz);
+    data.resize((size_t)sz);
+    return got == sz;
+}
+
+static bool pack(const std::vector<std::vector<char> >& contents, size_t skip, unsigned int align, std::vector<char>& out)
+{
+    ZipWriter zw(0);
+    if(!zw.setAlignment(align))
+        return false;
+    for(size_t i = 0; i < files.size(); ++i)
+        zw.add(files[i].c_str() + skip, contents[i].empty() ? NULL : &contents[i][0], contents[i].size());
+    return zw.write(out);
+}
+
+// The offsets are aligned in the file; in memory, the archive itself must be aligned as well
+static bool check(const std::vector<char>& aligned, unsigned int align, const std::vector<std::vector<char> >& contents,
+    const std::map<std::string, size_t>& byName)
+{
+    std::vector<char> buf(aligned.size() + align);
+    char *mem = &buf[0] + (align - (size_t)&buf[0] % align) % align;
+    memcpy(mem, &aligned[0], aligned.size());
+    CountedPtr<ZipArchiveRef> zref = new ZipArchiveRef(new MemFile("aligned.zip", mem, (unsigned int)aligned.size()));
+    if(!zref->init())
+    {
+        puts("Can't open the archive!");
+        return false;
+    }
+
+    size_t inPlace = 0, misaligned = 0, mismatches = 0;
+    for(size_t i = 0; i < zref->entries(); ++i)
+    {
+        const ZipEntryStat& st = zref->entryStat(i);
+        std::map<std::string, size_t>::const_iterator it = byName.find(zref->entryName(i));
+        if(it == byName.end() || !st.uncompSize)
+            continue;
+        const std::vector<char>& data = contents[it->second];
+        const char *p = (const char*)zref->getStoredEntryPtr(st);
+        vfspos ofs;
+        if(!p || !zref->dataOffset(st, ofs))
+        {
+            ++mismatches;
+            continue;
+        }
+        ++inPlace;
+        if(ofs % align || (size_t)p % align)
+            ++misaligned;
+        if(st.uncompSize != data.size() || memcmp(p, &data[0], data.size()))
+            ++mismatches;
+    }
+    printf("Used in place: %u, misaligned: %u, mismatches: %u\n", (unsigned int)inPlace, (unsigned int)misaligned,
+        (unsigned int)mismatches);
+    return !misaligned && !mismatches;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2 || !*argv[1])
+    {
+        puts("Usage: zipalign <dir> [alignment] [out.zip]");
+        return 1;
+    }
+    const unsigned int align = argc > 2 ? atoi(argv[2]) : 4096;
+
+    Root vfs;
+    vfs.AddLoader(new DiskLoader);
+
+    const std::string base = argv[1];
+    dirs.push_back(base);
+    for(size_t i = 0; i < dirs.size(); ++i)
+    {
+        const std::string d = dirs[i];
+        vfs.ForEach(d.c_str(), fileCallback, dirCallback);
+    }
+    std::sort(files.begin(), files.end());
+
+    const size_t skip = base.length() + (base[base.length() - 1] == '/' ? 0 : 1);
+    std::vector<std::vector<char> > contents(files.size());
+    std::map<std::string, size_t> byName;
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        if(!readFile(vfs, files[i].c_str(), contents[i]))
+        {
+            printf("Can't read %s\n", files[i].c_str());
+            return 1;
+        }
+        byName[files[i].c_str() + skip] = i;
+    }
+
+    std::vector<char> plain, aligned;
+    if(!pack(contents, skip, 0, plain) || !pack(contents, skip, align, aligned))
+    {
+        puts("Packing failed!");
+        return 1;
+    }
+    printf("Files: %u, alignment %u: %u bytes, unaligned: %u bytes (+%.2f%%)\n", (unsigned int)files.size(), align,
+        (unsigned int)aligned.size(), (unsigned int)plain.size(),
+        plain.empty() ? 0.0 : (aligned.size() - plain.size()) * 100.0 / plain.size());
+
+    if(argc > 3)
+    {
+        FILE *fh = fopen(argv[3], "wb");
+        if(!fh || fwrite(&aligned[0], 1, aligned.size(), fh) != aligned.size())
+        {
+            puts("Can't write output file!");
+            return 1;
+        }
+        fclose(fh);
+    }
+
+    bool ok = check(aligned, align, contents, byName);
+
+    // Alignments below 8 need more than one step of padding to fit the extra field
+    for(unsigned int small = 2; small < 8; small *= 2)
+    {
+        std::vector<char> out;
+        if(!pack(contents, skip, small, out))
+        {
+            puts("Packing failed!");
+            return 1;
+        }
+        printf("Alignment %u: %u bytes\n", small, (unsigned int)out.size());
+        ok = check(out, small, contents, byName) && ok;
+    }
+    return ok ? 0 : 1;
+}
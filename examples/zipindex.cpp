@@ -0,0 +1,96 @@
+// Shows how much memory the index of a zip archive takes,
+// and how long mounting it takes with an index precomputed by exportIndex(), as ttvfs_gen -i does
+
+#include <ttvfs.h>
+#include <VFSZipArchiveRef.h>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <cstring>
+
+static double msecs(clock_t start, clock_t end, unsigned int rounds)
+{
+    return ((end - start) * 1000.0) / CLOCKS_PER_SEC / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2 || !*argv[1])
+    {
+        puts("Specify a zip file!");
+        return 1;
+    }
+
+    clock_t ci = clock();
+    ttvfs::CountedPtr<ttvfs::ZipArchiveRef> zref = new ttvfs::ZipArchiveRef(new ttvfs::DiskFile(argv[1]));
+    if(!zref->init())
+    {
+        puts("FAIL!");
+        return 1;
+    }
+    clock_t ce = clock();
+
+    const size_t n = zref->entries();
+    const size_t bytes = zref->indexMemory();
+    printf("Entries: %u\n", (unsigned int)n);
+    printf("Index: %u bytes, %.1f bytes per entry\n", (unsigned int)bytes, n ? double(bytes) / n : 0.0);
+    printf("Time: %f ms\n", msecs(ci, ce, 1));
+
+    // Precomputed index, used in place by a new ZipArchiveRef over the same data
+    std::vector<char> index;
+    if(!zref->exportIndex(index))
+    {
+        puts("Export FAIL!");
+        return 1;
+    }
+    printf("Exported index: %u bytes\n", (unsigned int)index.size());
+
+    // In memory, to leave out the disk, as for an embedded archive
+    ttvfs::CountedPtr<ttvfs::DiskFile> df = new ttvfs::DiskFile(argv[1]);
+    std::vector<char> archive((size_t)df->size());
+    if(archive.empty() || !df->open("rb") || df->readAll(&archive[0], archive.size()) != (ttvfs::vfspos)archive.size())
+    {
+        puts("Read FAIL!");
+        return 1;
+    }
+    df->close();
+    std::vector<unsigned int> aligned((index.size() + 3) / 4); // usePrecomputedIndex() needs 4-byte alignment
+    memcpy(&aligned[0], &index[0], index.size());
+
+    const unsigned int rounds = 20;
+    for(int pre = 0; pre < 2; ++pre)
+    {
+        ttvfs::CountedPtr<ttvfs::ZipArchiveRef> mref;
+        clock_t start = clock();
+        for(unsigned int r = 0; r < rounds; ++r)
+        {
+            mref = new ttvfs::ZipArchiveRef(new ttvfs::MemFile("archive.zip", &archive[0], (unsigned int)archive.size()));
+            if(pre && !mref->usePrecomputedIndex(&aligned[0], index.size()))
+            {
+                puts("Index rejected!");
+                return 1;
+            }
+            if(!mref->init())
+            {
+                puts("FAIL!");
+                return 1;
+            }
+        }
+        clock_t end = clock();
+
+        size_t mismatches = mref->entries() != n;
+        for(size_t i = 0; i < n && !mismatches; ++i)
+        {
+            // With VFS_IGNORE_CASE, names differing only in case find the same entry
+            const char *name = zref->entryName(i);
+            if(mref->findEntry(name) != zref->findEntry(name) || strcmp(mref->entryName(i), name))
+                ++mismatches;
+        }
+        printf("%s: %f ms per init, precomputed index used: %s, mismatches: %u\n",
+            pre ? "Precomputed index" : "Central directory", msecs(start, end, rounds),
+            mref->hasPrecomputedIndex() ? "yes" : "no", (unsigned int)mismatches);
+        if(mismatches)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+// Packs all files of a directory into a zip file, compressing with different numbers of threads,
+// then adds a file to the new archive through the VFS and checks that everything reads back the same
+
+#include <ttvfs.h>
+#include <ttvfs_zip.h>
+#include <VFSZipWriter.h>
+#include <VFSThreads.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
+
+using namespace ttvfs;
+
+static double wallTime()
+{
+#if _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return double(c.QuadPart) / double(f.QuadPart);
+#else
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static std::vector<std::string> files;
+static std::vector<std::string> dirs;
+
+static void fileCallback(File *vf, void *)
+{
+    files.push_back(vf->fullname());
+}
+
+static void dirCallback(DirBase *vd, void *)
+{
+    dirs.push_back(vd->fullname());
+}
+
+static bool readFile(Root& vfs, const char *path, std::vector<char>& data)
+{
+    File *vf = vfs.GetFile(path);
+    if(!vf)
+        return false;
+    const vfspos sz = vf->size();
+    if(sz == npos)
+        return false;
+    data.resize((size_t)sz + 1);
+    const vfspos got = vf->readAll(&data[0], (size_t)sz);
+    data.resize((size_t)sz);
+    return got == sz;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 3 || !*argv[1] || !*argv[2])
+    {
+        puts("Usage: zipwrite <dir> <out.zip> [level] [max threads]");
+        return 1;
+    }
+    const char *outname = argv[2];
+    const int level = argc > 3 ? atoi(argv[3]) : 6;
+    const unsigned int cpus = argc > 4 ? std::max(atoi(argv[4]), 1) : Thread::HardwareConcurrency();
+
+    Root vfs;
+    vfs.AddLoader(new DiskLoader);
+    vfs.AddArchiveLoader(new VFSZipArchiveLoader);
+
+    const std::string base = argv[1];
+    dirs.push_back(base);
+    for(size_t i = 0; i < dirs.size(); ++i)
+    {
+        const std::string d = dirs[i];
+        vfs.ForEach(d.c_str(), fileCallback, dirCallback);
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<std::vector<char> > contents(files.size());
+    size_t total = 0;
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        if(!readFile(vfs, files[i].c_str(), contents[i]))
+        {
+            printf("Can't read %s\n", files[i].c_str());
+            return 1;
+        }
+        total += contents[i].size();
+    }
+    printf("Files: %u, %u bytes\n", (unsigned int)files.size(), (unsigned int)total);
+
+    // Names inside the archive are relative to the packed directory
+    const size_t skip = base.length() + (base[base.length() - 1] == '/' ? 0 : 1);
+    std::vector<char> archive;
+    double baseSecs = 0;
+    for(unsigned int t = 1; ; t = std::min(t * 2, cpus))
+    {
+        ZipWriter zw(level);
+        for(size_t i = 0; i < files.size(); ++i)
+            zw.add(files[i].c_str() + skip, contents[i].empty() ? NULL : &contents[i][0], contents[i].size());
+        const double start = wallTime();
+        zw.compress(t);
+        const double secs = wallTime() - start;
+        if(t == 1)
+            baseSecs = secs;
+        printf("%2u threads: %.3f s, %.1f MB/s, %u bytes compressed, speedup %.2f\n", t, secs,
+            secs > 0 ? total / (1024.0 * 1024.0) / secs : 0.0, (unsigned int)zw.compressedSize(),
+            secs > 0 ? baseSecs / secs : 0.0);
+        if(t == cpus)
+        {
+            if(!zw.write(archive))
+            {
+                puts("Writing failed!");
+                return 1;
+            }
+            break;
+        }
+    }
+
+    FILE *fh = fopen(outname, "wb");
+    if(!fh || fwrite(&archive[0], 1, archive.size(), fh) != archive.size())
+    {
+        puts("Can't write output file!");
+        return 1;
+    }
+    fclose(fh);
+
+    // Append one more file through the VFS; it is written when the archive is committed
+    ZipDir *zd = dynamic_cast<ZipDir*>(vfs.AddArchive(outname));
+    if(!zd)
+    {
+        puts("Can't open the new archive!");
+        return 1;
+    }
+    const char added[] = "This file was added to the archive through the VFS.\n";
+    File *vf = zd->createFile("zipwrite/added.txt");
+    if(!vf || !vf->open("wb") || vf->write(added, sizeof(added) - 1) != sizeof(added) - 1)
+    {
+        puts("Can't write to the archive!");
+        return 1;
+    }
+    vf->close();
+    if(!zd->getArchive()->commit())
+    {
+        puts("Commit failed!");
+        return 1;
+    }
+
+    size_t mismatches = 0;
+    std::vector<char> data;
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        const std::string path = std::string(outname) + "/" + (files[i].c_str() + skip);
+        if(!readFile(vfs, path.c_str(), data) || data != contents[i])
+            ++mismatches;
+    }
+    const std::string path = std::string(outname) + "/zipwrite/added.txt";
+    if(!readFile(vfs, path.c_str(), data) || data.size() != sizeof(added) - 1 || memcmp(&data[0], added, data.size()))
+        ++mismatches;
+    printf("Entries: %u, mismatches: %u\n", (unsigned int)zd->getArchive()->entries(), (unsigned int)mismatches);
+    return mismatches ? 1 : 0;
+}
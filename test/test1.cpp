@@ -1,7 +1,19 @@
 
 
 #include <ttvfs.h>
+#ifdef VFS_SUPPORT_ZIP
+#  include <VFSZipInflate.h>
+#  include <VFSZipCrc.h>
+#  include <VFSZipWriter.h>
+#  include <ttvfs_zip.h>
+#  include "miniz.h"
+#endif
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 template <typename T> static void assume(const T& what, const char *err)
 {
@@ -48,11 +60,286 @@ static bool testmount2()
     return true;
 }
 
+static bool testnlcpy()
+{
+    puts("- testnlcpy...");
+    static const char chars[] = { 'a', 'b', 10, 13, 0 };
+    std::vector<char> src, a, b;
+    srand(1);
+    for(unsigned int i = 0; i < 20000; ++i)
+    {
+        // Mostly short lines, sometimes long runs, sometimes lots of CRs
+        const size_t len = rand() % (i & 1 ? 300 : 5000);
+        const unsigned int special = rand() % 64 + 1;
+        src.resize(len + 64);
+        for(size_t k = 0; k < len; ++k)
+            src[k] = (unsigned int)rand() % special ? 'x' : chars[rand() % (i & 3 ? 4 : 5)];
+        src[len] = 0;
+        const size_t ofs = rand() % 32; // vary alignment
+        src.insert(src.begin(), ofs, 'y');
+        const unsigned int n = i & 7 ? (unsigned int)-1 : (unsigned int)(rand() % (len + 2) + 1);
+
+        a.assign(src.size(), 1);
+        b.assign(src.size(), 2);
+        const size_t ra = ttvfs::strnNLcpyScalar(&a[0], &src[ofs], n);
+        const size_t rb = ttvfs::strnNLcpy(&b[0], &src[ofs], n);
+        assume(ra == rb && !memcmp(&a[0], &b[0], ra), "strnNLcpy differs from scalar version");
+
+        // In place, as ZipFile does it
+        b.assign(src.begin() + ofs, src.end());
+        const size_t rc = ttvfs::strnNLcpy(&b[0], &b[0], n);
+        assume(ra == rc && !memcmp(&a[0], &b[0], ra), "strnNLcpy differs from scalar version in place");
+    }
+    return true;
+}
+
+static bool testsubrange()
+{
+    puts("- testsubrange...");
+    static char data[] = "0123456789";
+    ttvfs::CountedPtr<ttvfs::File> mem = new ttvfs::MemFile("mem", data, 10);
+    ttvfs::SubrangeFile part("part", mem, 2, 5);
+    assume(part.open("rb"), "Failed to open subrange");
+    char buf[16];
+    assume(!part.seek(-1, SEEK_SET) && !part.seek(-1, SEEK_CUR) && !part.seek(-1, SEEK_END), "Seeked out of the subrange");
+    assume(part.getpos() == 0, "Position changed by failed seek");
+    assume(!part.readAt(-2, buf, 2), "Read before the subrange");
+    assume(part.read(buf, sizeof(buf)) == 5 && !memcmp(buf, "23456", 5), "Wrong subrange data");
+
+    ttvfs::SubrangeFile beyond("beyond", mem, 8, 5), negative("negative", mem, -2, 5);
+    assume(!beyond.open("rb") && !beyond.getMemory() && !beyond.readAt(0, buf, 1), "Used a subrange beyond the end");
+    assume(!negative.open("rb") && !negative.getMemory(), "Used a subrange before the start");
+    return true;
+}
+
+#ifdef VFS_SUPPORT_ZIP
+
+struct MemSource
+{
+    const unsigned char *p;
+    size_t n;
+};
+
+static bool readMemSource(ttvfs::vfspos ofs, void *dst, size_t bytes, void *user)
+{
+    const MemSource& m = *(const MemSource*)user;
+    if(ofs < 0 || (size_t)ofs > m.n || bytes > m.n - (size_t)ofs)
+        return false;
+    memcpy(dst, m.p + ofs, bytes);
+    return true;
+}
+
+// Everything must decode like tinfl, including failures
+static void inflateLikeTinfl(const std::vector<unsigned char>& src, size_t dstLen, const char *what)
+{
+    std::vector<unsigned char> a(dstLen + 1), b(dstLen + 1);
+    const void *s = src.empty() ? NULL : &src[0];
+    const bool ra = ttvfs::zipInflateTinfl(s, src.size(), &a[0], dstLen);
+    const bool rb = ttvfs::zipInflate(s, src.size(), &b[0], dstLen);
+    assume(ra == rb && (!ra || !memcmp(&a[0], &b[0], dstLen)), what);
+    const bool rc = ttvfs::zipInflateParallel(s, src.size(), &b[0], dstLen, 4);
+    assume(ra == rc && (!ra || !memcmp(&a[0], &b[0], dstLen)), what);
+}
+
+static void deflateWith(const std::vector<unsigned char>& data, int flags, std::vector<unsigned char>& out)
+{
+    size_t len = 0;
+    void *p = tdefl_compress_mem_to_heap(&data[0], data.size(), &len, flags);
+    assume(p, "Deflating failed");
+    out.assign((unsigned char*)p, (unsigned char*)p + len);
+    mz_free(p);
+}
+
+// Appends 'bits' bits of v to a raw deflate stream, least significant first
+static void putBits(std::vector<unsigned char>& out, unsigned int& used, unsigned int v, unsigned int bits)
+{
+    for(unsigned int i = 0; i < bits; ++i, ++used)
+    {
+        if(!(used & 7))
+            out.push_back(0);
+        out.back() |= ((v >> i) & 1) << (used & 7);
+    }
+}
+
+// Huffman codes go most significant bit first
+static void putCode(std::vector<unsigned char>& out, unsigned int& used, unsigned int code, unsigned int bits)
+{
+    for(unsigned int i = bits; i--; )
+        putBits(out, used, code >> i, 1);
+}
+
+static bool testinflate()
+{
+    puts("- testinflate...");
+    // Text-like runs and random runs, enough to be split across threads
+    std::vector<unsigned char> data(3 * 1024 * 1024);
+    srand(2);
+    for(size_t i = 0; i < data.size(); )
+    {
+        const size_t run = std::min<size_t>(rand() % 20000 + 1, data.size() - i);
+        const bool noise = rand() % 4 != 0;
+        for(size_t k = 0; k < run; ++k, ++i)
+            data[i] = noise ? (unsigned char)rand() : "the quick brown fox\n"[(i + k / 7) % 20];
+    }
+
+    static const int modes[] = { TDEFL_FORCE_ALL_RAW_BLOCKS, TDEFL_FORCE_ALL_STATIC_BLOCKS, 0 };
+    static const char * const names[] = { "stored", "fixed", "dynamic" };
+    for(unsigned int m = 0; m < 3; ++m)
+    {
+        std::vector<unsigned char> packed;
+        deflateWith(data, 128 | modes[m], packed);
+        std::string what = std::string("Inflate differs from tinfl, ") + names[m] + " blocks";
+        std::vector<unsigned char> out(data.size());
+        assume(ttvfs::zipInflate(&packed[0], packed.size(), &out[0], out.size()) && out == data, what.c_str());
+        inflateLikeTinfl(packed, data.size(), what.c_str());
+
+        // Random access, with a checkpoint every 64K of output
+        MemSource ms = { &packed[0], packed.size() };
+        ttvfs::InflateSeeker seeker((ttvfs::vfspos)packed.size(), (ttvfs::vfspos)data.size(), readMemSource, &ms,
+            true, (unsigned int)mz_crc32(0, &data[0], data.size()), 64 * 1024);
+        for(unsigned int i = 0; i < 50; ++i)
+        {
+            const size_t ofs = ((size_t)rand() * 4099) % data.size();
+            const size_t len = std::min<size_t>(rand() % 100000, data.size() - ofs);
+            assume(seeker.read(ofs, &out[0], len) == len && !memcmp(&out[0], &data[ofs], len),
+                (what + ", InflateSeeker").c_str());
+        }
+
+        // Broken streams: cut off, flipped bits, trailing garbage. Shorter ones, to keep this fast.
+        const std::vector<unsigned char> part(data.begin(), data.begin() + 100000);
+        deflateWith(part, 128 | modes[m], packed);
+        std::vector<unsigned char> broken(packed.begin(), packed.begin() + packed.size() / 2);
+        inflateLikeTinfl(broken, part.size(), (what + ", truncated").c_str());
+        for(unsigned int i = 0; i < 50; ++i)
+        {
+            broken = packed;
+            broken[(size_t)rand() * 131 % broken.size()] ^= (unsigned char)(1 << (rand() % 8));
+            inflateLikeTinfl(broken, part.size(), (what + ", corrupt").c_str());
+        }
+        broken = packed;
+        broken.push_back(0x55);
+        inflateLikeTinfl(broken, part.size(), (what + ", trailing data").c_str());
+        inflateLikeTinfl(packed, part.size() - 1, (what + ", too little room").c_str());
+    }
+
+    // Length codes 286 and 287 are invalid, even though fixed blocks have codes for them
+    for(unsigned int sym = 286; sym <= 287; ++sym)
+    {
+        std::vector<unsigned char> s;
+        unsigned int used = 0;
+        putBits(s, used, 1, 1); // last block
+        putBits(s, used, 1, 2); // fixed Huffman codes
+        putCode(s, used, 0x30 + 'a', 8); // literal
+        putCode(s, used, 0xC0 + sym - 280, 8);
+        putCode(s, used, 0, 5); // distance 1
+        putCode(s, used, 0, 7); // end of block
+        std::vector<unsigned char> out(64);
+        for(size_t len = 1; len < out.size(); ++len)
+            assume(!ttvfs::zipInflateTinfl(&s[0], s.size(), &out[0], len), "tinfl took an invalid length code");
+        inflateLikeTinfl(s, 1, "Inflate took an invalid length code");
+        inflateLikeTinfl(s, 4, "Inflate took an invalid length code");
+    }
+    return true;
+}
+
+static bool testcrc()
+{
+    puts("- testcrc...");
+    std::vector<unsigned char> data(70000 + 64);
+    srand(3);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = (unsigned char)rand();
+
+    // All short lengths and alignments, then some long ones, also continued from a previous CRC
+    for(size_t len = 0; len < 70000; len = len < 600 ? len + 1 : len * 3 / 2 + 17)
+        for(size_t ofs = 0; ofs < (len < 600 ? 16u : 64u); ofs += len < 600 ? 1 : 13)
+        {
+            const unsigned char *p = &data[ofs];
+            const unsigned int ref = (unsigned int)mz_crc32(0, p, len);
+            assume(ttvfs::zipCrc32(0, p, len) == ref, "zipCrc32 differs from mz_crc32");
+            assume(ttvfs::zipCrc32Scalar(0, p, len) == ref, "zipCrc32Scalar differs from mz_crc32");
+            const size_t half = len / 3;
+            assume(ttvfs::zipCrc32(ttvfs::zipCrc32(0, p, half), p + half, len - half) == ref, "zipCrc32 can't be continued");
+        }
+    return true;
+}
+
+static std::string readZipFile(ttvfs::Root& vfs, const char *path)
+{
+    ttvfs::File *vf = vfs.GetFile(path);
+    assume(vf && vf->open("rb"), "Entry not found");
+    char buf[256];
+    const size_t n = vf->read(buf, sizeof(buf));
+    vf->close();
+    return std::string(buf, n);
+}
+
+static bool testcommit()
+{
+    puts("- testcommit...");
+    static const char fn[] = "commit.zip";
+    {
+        ttvfs::ZipWriter zw;
+        zw.add("keep.txt", "kept", 4);
+        zw.add("Dir/Replace.txt", "old data", 8);
+        zw.add("append.txt", "line 1\r\n", 8);
+        std::vector<char> out;
+        FILE *fh = fopen(fn, "wb");
+        assume(zw.write(out) && fh && fwrite(&out[0], 1, out.size(), fh) == out.size(), "Can't write the archive");
+        fclose(fh);
+    }
+    {
+        ttvfs::Root vfs;
+        vfs.AddLoader(new ttvfs::DiskLoader);
+        vfs.AddArchiveLoader(new ttvfs::VFSZipArchiveLoader);
+        ttvfs::ZipDir *zd = dynamic_cast<ttvfs::ZipDir*>(vfs.AddArchive(fn));
+        assume(zd, "Can't mount the archive");
+        ttvfs::ZipArchiveRef *z = zd->getArchive();
+
+        // Replaced under a differently spelled name, appended to in text mode, added, and opened without change
+        z->addEntry("./dir\\replace.txt", "new data", 8);
+        ttvfs::File *vf = vfs.GetFile("commit.zip/append.txt");
+        assume(vf && vf->open("a") && vf->write("line 2\r\n", 8) == 8, "Can't append");
+        vf->close();
+        vf = zd->createFile("new.txt");
+        assume(vf && vf->open("wb") && vf->write("added", 5) == 5, "Can't add");
+        vf->close();
+        vf = vfs.GetFile("commit.zip/keep.txt");
+        assume(vf && vf->open("r+"), "Can't open for writing");
+        vf->close();
+        assume(z->pendingEntries() == 3, "Wrong number of pending entries");
+        assume(z->commit() && !z->pendingEntries(), "Commit failed");
+        assume(readZipFile(vfs, "commit.zip/dir/replace.txt") == "new data", "Replaced entry not read back");
+    }
+    {
+        ttvfs::Root vfs;
+        vfs.AddLoader(new ttvfs::DiskLoader);
+        vfs.AddArchiveLoader(new ttvfs::VFSZipArchiveLoader);
+        ttvfs::ZipDir *zd = dynamic_cast<ttvfs::ZipDir*>(vfs.AddArchive(fn));
+        assume(zd && zd->getArchive()->entries() == 4, "Wrong entries after reopening");
+        assume(readZipFile(vfs, "commit.zip/keep.txt") == "kept", "Kept entry changed");
+        assume(readZipFile(vfs, "commit.zip/Dir/Replace.txt") == "new data", "Old entry survived the commit");
+        assume(readZipFile(vfs, "commit.zip/append.txt") == "line 1\r\nline 2\r\n", "Appended entry wrong");
+        assume(readZipFile(vfs, "commit.zip/new.txt") == "added", "Added entry missing");
+    }
+    remove(fn);
+    return true;
+}
+
+#endif // VFS_SUPPORT_ZIP
+
 
 int main(int argc, char *argv[])
 {
     if (testmount1()
      && testmount2()
+     && testnlcpy()
+     && testsubrange()
+#ifdef VFS_SUPPORT_ZIP
+     && testinflate()
+     && testcrc()
+     && testcommit()
+#endif
     ){
         puts("Tests passed!");
         return 0;
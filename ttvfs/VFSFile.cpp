@@ -7,6 +7,9 @@
 #include "VFSFile.h"
 #include "VFSTools.h"
 #include "VFSFileFuncs.h"
+#include "VFSThreads.h"
+#include <errno.h>
+#include <string.h>
 
 
 VFS_NAMESPACE_START
@@ -20,8 +23,193 @@ File::~File()
 {
 }
 
+size_t File::readAt(vfspos offset, void *dst, size_t bytes)
+{
+    const vfspos oldpos = getpos();
+    if(oldpos == npos || !seek(offset, SEEK_SET))
+        return 0;
+    size_t done = read(dst, bytes);
+    seek(oldpos, SEEK_SET);
+    return done;
+}
+
+vfspos File::readAll(void *dst, size_t cap)
+{
+    const vfspos sz = size();
+    if(sz == npos || sz > (vfspos)cap)
+        return npos;
+    const bool wasOpen = isopen();
+    if(!wasOpen && !open())
+        return npos;
+    const size_t done = readAt(0, dst, (size_t)sz);
+    if(!wasOpen)
+        close();
+    return (vfspos)done == sz ? sz : npos;
+}
+
+vfspos File::prepareBatch(const void *& container, vfspos& offset)
+{
+    container = NULL;
+    offset = 0;
+    return size();
+}
+
+bool File::readBatch(void *dst, size_t size)
+{
+    return readAt(0, dst, size) == size;
+}
+
+// ------------- DiskFile handle pool -----------------------
+
+// DiskFiles holding an OS handle, most recently used first.
+// All of this is protected by s_poolMutex.
+static DiskFile *s_lruHead = NULL;
+static DiskFile *s_lruTail = NULL;
+static unsigned int s_handles = 0;
+static unsigned int s_maxHandles = 0;
+
+static Mutex s_poolMutex;
+
+// A parked file must be reopened without truncating it
+static std::string getReopenMode(const char *mode)
+{
+    const bool write = !!strchr(mode, 'w');
+    const bool update = !!strchr(mode, '+');
+    std::string m;
+    for( ; *mode; ++mode)
+        if(*mode != 'x')
+            m += *mode == 'w' ? 'r' : *mode;
+    if(write && !update)
+        m.insert(1, "+");
+    return m;
+}
+
+// Keeps the handle of a DiskFile from being parked during one operation,
+// and reopens it first if necessary
+class DiskFileUse
+{
+public:
+    DiskFileUse(const DiskFile *df) : _df(const_cast<DiskFile*>(df)), _pinned(false)
+    {
+        _ok = _df->_acquire(_pinned);
+    }
+    ~DiskFileUse()
+    {
+        if(_pinned)
+            _df->_unpin();
+    }
+    inline FILE *fp() const { return _ok ? (FILE*)_df->_fh : NULL; }
+
+private:
+    DiskFile *_df;
+    bool _pinned;
+    bool _ok;
+};
+
+void DiskFile::SetMaxHandles(unsigned int n)
+{
+    MutexLock lock(s_poolMutex);
+    s_maxHandles = n;
+    while(n && s_handles > n && _evictOne()) {}
+}
+
+unsigned int DiskFile::GetMaxHandles()
+{
+    return s_maxHandles;
+}
+
+unsigned int DiskFile::GetOpenHandles()
+{
+    return s_handles;
+}
+
+void DiskFile::_lruRemove()
+{
+    (_lruPrev ? _lruPrev->_lruNext : s_lruHead) = _lruNext;
+    (_lruNext ? _lruNext->_lruPrev : s_lruTail) = _lruPrev;
+    _lruPrev = _lruNext = NULL;
+}
+
+void DiskFile::_lruPushFront()
+{
+    _lruPrev = NULL;
+    _lruNext = s_lruHead;
+    (s_lruHead ? s_lruHead->_lruPrev : s_lruTail) = this;
+    s_lruHead = this;
+}
+
+// Closes the least recently used handle that is not in use right now
+bool DiskFile::_evictOne()
+{
+    for(DiskFile *df = s_lruTail; df; df = df->_lruPrev)
+        if(!df->_pins)
+        {
+            df->_park();
+            return true;
+        }
+    return false;
+}
+
+void DiskFile::_park()
+{
+    _parkedPos = real_ftell(_fh);
+    real_fclose(_fh);
+    _fh = NULL;
+    --s_handles;
+    _lruRemove();
+}
+
+bool DiskFile::_openHandle(const char *mode)
+{
+    if(s_maxHandles)
+        while(s_handles >= s_maxHandles && _evictOne()) {}
+
+    _fh = real_fopen(fullname(), mode);
+    // Handles may have run out before reaching our limit; make room and try once more
+    if(!_fh && (errno == EMFILE || errno == ENFILE) && _evictOne())
+        _fh = real_fopen(fullname(), mode);
+    if(!_fh)
+        return false;
+
+    ++s_handles;
+    _lruPushFront();
+    return true;
+}
+
+bool DiskFile::_acquire(bool& pinned)
+{
+    // Without a limit, handles are never parked and there is nothing to track
+    if(_fh && !s_maxHandles)
+        return true;
+
+    MutexLock lock(s_poolMutex);
+    if(_fh)
+    {
+        _lruRemove();
+        _lruPushFront();
+    }
+    else
+    {
+        if(!_open || !_openHandle(_reopenMode.c_str()))
+            return false;
+        if(_parkedPos && real_fseek(_fh, _parkedPos, SEEK_SET))
+            return false;
+    }
+    ++_pins;
+    pinned = true;
+    return true;
+}
+
+void DiskFile::_unpin()
+{
+    MutexLock lock(s_poolMutex);
+    --_pins;
+}
+
+// ------------- DiskFile -----------------------
+
 DiskFile::DiskFile(const char *name /* = NULL */)
-: File(name), _fh(NULL)
+: File(name), _fh(NULL), _open(false), _pins(0), _parkedPos(0), _lruPrev(NULL), _lruNext(NULL)
 {
 }
 
@@ -35,54 +223,146 @@ bool DiskFile::open(const char *mode /* = NULL */)
     if(isopen())
         close();
 
-    _fh = real_fopen(fullname(), mode ? mode : "rb");
+    if(!mode)
+        mode = "rb";
 
-    return !!_fh;
+    MutexLock lock(s_poolMutex);
+    _open = _openHandle(mode);
+    if(_open)
+    {
+        _reopenMode = getReopenMode(mode);
+        _parkedPos = 0;
+    }
+    return _open;
 }
 
 bool DiskFile::isopen() const
 {
-    return !!_fh;
+    return _open;
 }
 
 bool DiskFile::iseof() const
 {
-    return !_fh || real_feof((FILE*)_fh);
+    if(!_open)
+        return true;
+    if(_fh && !s_maxHandles)
+        return !!real_feof((FILE*)_fh);
+    MutexLock lock(s_poolMutex);
+    if(_fh)
+        return !!real_feof((FILE*)_fh);
+    // The eof flag is lost when parking, but the position is still known
+    vfspos sz;
+    return GetFileSize(fullname(), sz) && _parkedPos >= sz;
 }
 
 void DiskFile::close()
 {
+    MutexLock lock(s_poolMutex);
     if(_fh)
     {
         real_fclose((FILE*)_fh);
         _fh = NULL;
+        --s_handles;
+        _lruRemove();
     }
+    _open = false;
+}
+
+void *DiskFile::getFP()
+{
+    DiskFileUse use(this);
+    return use.fp();
+}
+
+void *DiskFile::pinFP()
+{
+    bool pinned = false;
+    if(!_acquire(pinned))
+        return NULL;
+    if(!pinned)
+    {
+        MutexLock lock(s_poolMutex);
+        ++_pins;
+    }
+    return _fh;
+}
+
+void DiskFile::unpinFP()
+{
+    _unpin();
+}
+
+bool DiskFile::truncate(vfspos size)
+{
+    DiskFileUse use(this);
+    return use.fp() && real_fflush(use.fp()) == 0 && !real_ftruncate(use.fp(), size);
 }
 
 bool DiskFile::seek(vfspos pos, int whence)
 {
-    return _fh && real_fseek((FILE*)_fh, pos, whence) == 0;
+    DiskFileUse use(this);
+    return use.fp() && real_fseek(use.fp(), pos, whence) == 0;
 }
 
 
 bool DiskFile::flush()
 {
-    return _fh && real_fflush((FILE*)_fh) == 0;
+    DiskFileUse use(this);
+    return use.fp() && real_fflush(use.fp()) == 0;
 }
 
 vfspos DiskFile::getpos() const
 {
-    return _fh ? real_ftell((FILE*)_fh) : npos;
+    if(!_open)
+        return npos;
+    if(_fh && !s_maxHandles)
+        return real_ftell((FILE*)_fh);
+    MutexLock lock(s_poolMutex);
+    return _fh ? real_ftell((FILE*)_fh) : _parkedPos;
 }
 
 size_t DiskFile::read(void *dst, size_t bytes)
 {
-    return _fh ? real_fread(dst, 1, bytes, (FILE*)_fh) : 0;
+    DiskFileUse use(this);
+    return use.fp() ? real_fread(dst, 1, bytes, use.fp()) : 0;
 }
 
 size_t DiskFile::write(const void *src, size_t bytes)
 {
-    return _fh ? real_fwrite(src, 1, bytes, (FILE*)_fh) : 0;
+    DiskFileUse use(this);
+    return use.fp() ? real_fwrite(src, 1, bytes, use.fp()) : 0;
+}
+
+size_t DiskFile::readAt(vfspos offset, void *dst, size_t bytes)
+{
+    DiskFileUse use(this);
+    return use.fp() ? real_pread(use.fp(), dst, bytes, offset) : 0;
+}
+
+bool DiskFile::readBatch(void *dst, size_t size)
+{
+    if(_open)
+        return readAt(0, dst, size) == size;
+
+    // Not open; use a handle of our own for the time being. It counts against the limit,
+    // but isn't in the pool, so nobody else can park it.
+    void *fh;
+    {
+        MutexLock lock(s_poolMutex);
+        if(s_maxHandles)
+            while(s_handles >= s_maxHandles && _evictOne()) {}
+        fh = real_fopen(fullname(), "rb");
+        if(!fh && (errno == EMFILE || errno == ENFILE) && _evictOne())
+            fh = real_fopen(fullname(), "rb");
+        if(!fh)
+            return false;
+        ++s_handles;
+    }
+    const bool ok = real_fread(dst, 1, size, fh) == size;
+    real_fclose(fh);
+    MutexLock lock(s_poolMutex);
+    --s_handles;
+    return ok;
 }
 
 vfspos DiskFile::size()
@@ -161,6 +441,16 @@ size_t MemFile::read(void *dst, size_t bytes)
     return rem;
 }
 
+size_t MemFile::readAt(vfspos offset, void *dst, size_t bytes)
+{
+    if(offset < 0 || offset >= _size)
+        return 0;
+    size_t rem = std::min((size_t)(_size - offset), bytes);
+
+    memcpy(dst, (char*)_buf + offset, rem);
+    return rem;
+}
+
 size_t MemFile::write(const void *src, size_t bytes)
 {
     if(iseof())
@@ -171,4 +461,104 @@ size_t MemFile::write(const void *src, size_t bytes)
     return rem;
 }
 
+// ------------- SubrangeFile -----------------------
+
+// Whether the parent covers the range, checked once when the subrange is created
+static bool subrangeFits(File *parent, vfspos offset, vfspos length)
+{
+    const vfspos sz = parent ? parent->size() : npos;
+    return sz != npos && offset >= 0 && length >= 0 && offset <= sz && length <= sz - offset;
+}
+
+SubrangeFile::SubrangeFile(const char *name, File *parent, vfspos offset, vfspos length)
+: File(name), _parent(parent), _offset(offset), _length(length), _fits(subrangeFits(parent, offset, length)), _pos(0)
+{
+}
+
+SubrangeFile::~SubrangeFile()
+{
+}
+
+bool SubrangeFile::open(const char *mode /* = NULL */)
+{
+    if(mode && (strchr(mode, 'w') || strchr(mode, 'a') || strchr(mode, '+')))
+        return false;
+    _pos = 0;
+    return _fits && (_parent->isopen() || _parent->open("rb"));
+}
+
+bool SubrangeFile::isopen() const
+{
+    return _parent->isopen();
+}
+
+bool SubrangeFile::seek(vfspos pos, int whence)
+{
+    switch(whence)
+    {
+        case SEEK_SET:
+            if(pos >= 0 && pos <= _length)
+            {
+                _pos = pos;
+                return true;
+            }
+            break;
+
+        case SEEK_CUR:
+            if(_pos + pos >= 0 && _pos + pos <= _length)
+            {
+                _pos += pos;
+                return true;
+            }
+            break;
+
+        case SEEK_END:
+            if(pos >= 0 && pos <= _length)
+            {
+                _pos = _length - pos;
+                return true;
+            }
+    }
+    return false;
+}
+
+size_t SubrangeFile::read(void *dst, size_t bytes)
+{
+    const size_t done = readAt(_pos, dst, bytes);
+    _pos += done;
+    return done;
+}
+
+size_t SubrangeFile::readAt(vfspos offset, void *dst, size_t bytes)
+{
+    if(!_fits || offset < 0 || offset >= _length)
+        return 0;
+    bytes = (size_t)std::min<vfspos>(bytes, _length - offset);
+    return _parent->readAt(_offset + offset, dst, bytes); // opened by open() or prepareBatch()
+}
+
+const void *SubrangeFile::getMemory() const
+{
+    const void *p = _fits ? _parent->getMemory() : NULL;
+    return p ? (const char*)p + _offset : NULL;
+}
+
+// Subranges of the same parent are read in order. The parent is opened here, on the calling thread,
+// because readBatch() may run for several subranges of it at the same time.
+vfspos SubrangeFile::prepareBatch(const void *& container, vfspos& offset)
+{
+    if(!_fits || (!_parent->isopen() && !_parent->open("rb")))
+        return npos;
+    if(_parent->prepareBatch(container, offset) == npos)
+        return npos;
+    if(container)
+        offset += _offset;
+    else
+    {
+        container = _parent.content();
+        offset = _offset;
+    }
+    return _length;
+}
+
 VFS_NAMESPACE_END
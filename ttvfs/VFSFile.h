@@ -14,7 +14,7 @@ VFS_NAMESPACE_START
   * If an operation is not necessary or irrelevant (for example, files in memory can't be closed),
   *    it is useful to return true anyways, because this operation did not fail, technically.
   *    (Common sense here!)
-  * An int/vfspos value of 0 indicates failure, except the size/seek/getpos functions, where npos means failure.
+  * An int/vfspos value of 0 indicates failure, except the size/seek/getpos/readAll functions, where npos means failure.
   * Only the functions required or applicable need to be implemented, for unsupported operations
   *    the default implementation should be sufficient.
   **/
@@ -43,6 +43,33 @@ public:
     virtual size_t read(void *dst, size_t bytes) = 0;
     virtual size_t write(const void *src, size_t bytes) = 0;
 
+    /** Read from an absolute offset without using or changing the current position.
+        Subclasses should override this if they can do it without seeking;
+        then it is safe to call from multiple threads as long as nobody modifies the file.
+        The default implementation seeks back and forth and is not. */
+    virtual size_t readAt(vfspos offset, void *dst, size_t bytes);
+
+    /** Read the whole file into dst, which has room for cap bytes. Returns the number of bytes read,
+        or npos if the file can't be read or is larger than cap (then dst may have been written to).
+        Does not use or change the current position; opens and closes the file if it is not open.
+        Subclasses that have to decode the data should override this to decode straight into dst. */
+    virtual vfspos readAll(void *dst, size_t cap);
+
+    /** If the whole file is in memory and stays there until the file is closed,
+        return a pointer to it. Archive loaders can use this to access files in place.
+        Otherwise, return NULL (the default). */
+    virtual const void *getMemory() const { return NULL; }
+
+    /** For reading many files at once, see Root::ReadMany().
+        prepareBatch() is called on the calling thread. It returns the file size (npos if the file
+        can't be read), and where the data is stored: something that identifies the container
+        it is in (NULL if none), and the offset there, to read files in storage order.
+        readBatch() is called later from any thread, possibly while other files are read.
+        It reads the whole file into dst without changing the file's state.
+        The defaults use size() and readAt(). */
+    virtual vfspos prepareBatch(const void *& container, vfspos& offset);
+    virtual bool readBatch(void *dst, size_t size);
+
     /** Return file size. If NA, return npos. If size is not yet known,
         open() and close() may be called (with default args) to find out the size.
         The file is supposed to be in its old state when the function returns,
@@ -70,14 +97,49 @@ public:
     virtual vfspos getpos() const;
     virtual size_t read(void *dst, size_t bytes);
     virtual size_t write(const void *src, size_t bytes);
+    virtual size_t readAt(vfspos offset, void *dst, size_t bytes);
+    virtual bool readBatch(void *dst, size_t size);
     virtual vfspos size();
     virtual const char *getType() const { return "DiskFile"; }
 
-    inline void *getFP() { return _fh; }
+    /** The underlying FILE*, reopened if necessary. Use it right away,
+        it may be closed again by the handle pool when other files are accessed. */
+    void *getFP();
+
+    /** Like getFP(), but the handle stays open until unpinFP() is called, once for each pinFP(). */
+    void *pinFP();
+    void unpinFP();
+
+    /** Cuts the file off at 'size', after flushing it */
+    bool truncate(vfspos size);
+
+    /** Limit the number of OS file handles held by all DiskFiles together. 0 means no limit (the default).
+        When the limit is reached, the handle of the least recently used file is closed.
+        That file stays open as far as its users are concerned and reopens at the same position when accessed again.
+        Set this before accessing files from multiple threads. */
+    static void SetMaxHandles(unsigned int n);
+    static unsigned int GetMaxHandles();
+    static unsigned int GetOpenHandles(); // currently held by all DiskFiles
 
 protected:
-    
-    void *_fh; // FILE*
+
+    friend class DiskFileUse;
+
+    // All of these require the handle pool lock, except _acquire() and _unpin()
+    bool _acquire(bool& pinned);
+    void _unpin();
+    bool _openHandle(const char *mode);
+    void _park();
+    void _lruRemove();
+    void _lruPushFront();
+    static bool _evictOne();
+
+    void *_fh; // FILE*, NULL if closed or parked by the handle pool
+    bool _open; // as seen from outside
+    unsigned int _pins; // accesses in progress, don't park while > 0
+    vfspos _parkedPos;
+    std::string _reopenMode;
+    DiskFile *_lruPrev, *_lruNext; // in the handle pool while _fh is set
 };
 
 class MemFile : public File
@@ -104,6 +166,8 @@ public:
     virtual vfspos getpos() const { return _pos; }
     virtual size_t read(void *dst, size_t bytes);
     virtual size_t write(const void *src, size_t bytes);
+    virtual size_t readAt(vfspos offset, void *dst, size_t bytes);
+    virtual const void *getMemory() const { return _buf; }
     virtual vfspos size() { return _size; }
     virtual const char *getType() const { return "MemFile"; }
 
@@ -118,6 +182,45 @@ protected:
     DeleteMode _delmode;
 };
 
+/** A byte range of another file, as a file of its own. For example, an archive embedded in a larger file,
+    or entries of a simple pak format. Read-only.
+    Reads are forwarded to the parent's readAt(), so each SubrangeFile has its own position
+    and many of them can share a parent. They are as thread-safe as the parent's readAt().
+    If the parent is in memory, so is the subrange, and getMemory() points into the parent's memory.
+    The parent is opened by open() and prepareBatch(), but not closed, because it may be shared.
+    A range that the parent doesn't cover can't be opened or read. */
+class SubrangeFile : public File
+{
+public:
+    SubrangeFile(const char *name, File *parent, vfspos offset, vfspos length);
+    virtual ~SubrangeFile();
+    virtual bool open(const char *mode = NULL);
+    virtual bool isopen() const;
+    virtual bool iseof() const { return _pos >= _length; }
+    virtual void close() { _pos = 0; }
+    virtual bool seek(vfspos pos, int whence);
+    virtual bool flush() { return true; }
+    virtual vfspos getpos() const { return _pos; }
+    virtual size_t read(void *dst, size_t bytes);
+    virtual size_t write(const void *src, size_t bytes) { return 0; }
+    virtual size_t readAt(vfspos offset, void *dst, size_t bytes);
+    virtual const void *getMemory() const;
+    virtual vfspos prepareBatch(const void *& container, vfspos& offset);
+    virtual vfspos size() { return _length; }
+    virtual const char *getType() const { return "SubrangeFile"; }
+
+    inline File *getParent() { return _parent.content(); }
+    inline vfspos getOffset() const { return _offset; }
+
+protected:
+
+    CountedPtr<File> _parent;
+    const vfspos _offset;
+    const vfspos _length;
+    const bool _fits; // the parent covers the range
+    vfspos _pos;
+};
+
 VFS_NAMESPACE_END
 
 #endif
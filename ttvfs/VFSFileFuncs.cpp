@@ -3,6 +3,15 @@
 #include "VFSFileFuncs.h"
 
 #include <stdio.h>
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#  include <io.h>
+#else
+#  include <unistd.h>
+#  include <errno.h>
+#  include <sys/mman.h>
+#endif
 
 VFS_NAMESPACE_START
 
@@ -76,5 +85,92 @@ int real_fflush(void *fh)
     return fflush((FILE*)fh);
 }
 
+// Bypasses the FILE buffer, so this sees only data that was already flushed.
+size_t real_pread(void *fh, void *ptr, size_t bytes, vfspos offset)
+{
+#if !_WIN32
+    const int fd = fileno((FILE*)fh);
+    char *dst = (char*)ptr;
+    size_t done = 0;
+    while(done < bytes)
+    {
+        ssize_t r = pread(fd, dst + done, bytes - done, (off_t)(offset + done));
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            break;
+        done += r;
+    }
+    return done;
+#else
+    // Positional ReadFile() moves the handle's file pointer under the CRT's feet,
+    // so fall back to seeking, which is not thread safe.
+    const vfspos oldpos = real_ftell(fh);
+    if(oldpos < 0 || real_fseek(fh, offset, SEEK_SET))
+        return 0;
+    size_t done = real_fread(ptr, 1, bytes, fh);
+    real_fseek(fh, oldpos, SEEK_SET);
+    return done;
+#endif
+}
+
+int real_ftruncate(void *fh, vfspos size)
+{
+#if _WIN32
+    return _chsize_s(_fileno((FILE*)fh), size);
+#else
+    return ftruncate(fileno((FILE*)fh), (off_t)size);
+#endif
+}
+
+void *real_mmap(void *fh, size_t size)
+{
+    if(!size)
+        return NULL;
+#if _WIN32
+    HANDLE hf = (HANDLE)_get_osfhandle(_fileno((FILE*)fh));
+    if(hf == INVALID_HANDLE_VALUE)
+        return NULL;
+    HANDLE hmap = CreateFileMappingA(hf, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!hmap)
+        return NULL;
+    void *p = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, size);
+    CloseHandle(hmap); // the view keeps the mapping alive
+    return p;
+#else
+    void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno((FILE*)fh), 0);
+    return p != MAP_FAILED ? p : NULL;
+#endif
+}
+
+void real_munmap(void *ptr, size_t size)
+{
+#if _WIN32
+    UnmapViewOfFile(ptr);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+void real_madvise(const void *ptr, size_t size, MemAdvice advice)
+{
+#if !_WIN32 && defined(MADV_WILLNEED)
+    // madvise() wants a page-aligned start address
+    const size_t pagemask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    const size_t misalign = (size_t)ptr & pagemask;
+    void *start = (char*)ptr - misalign;
+    size += misalign;
+    switch(advice)
+    {
+        case MEM_ADVICE_NORMAL:     madvise(start, size, MADV_NORMAL); break;
+        case MEM_ADVICE_RANDOM:     madvise(start, size, MADV_RANDOM); break;
+        case MEM_ADVICE_SEQUENTIAL: madvise(start, size, MADV_SEQUENTIAL); break;
+        case MEM_ADVICE_WILLNEED:   madvise(start, size, MADV_WILLNEED); break;
+    }
+#else
+    (void)ptr; (void)size; (void)advice; // just a hint, fine to ignore
+#endif
+}
+
 
 VFS_NAMESPACE_END
@@ -14,6 +14,22 @@ size_t real_fread(void *ptr, size_t size, size_t count, void *fh);
 size_t real_fwrite(const void *ptr, size_t size, size_t count, void *fh);
 int real_feof(void *fh);
 int real_fflush(void *fh);
+size_t real_pread(void *fh, void *ptr, size_t bytes, vfspos offset);
+int real_ftruncate(void *fh, vfspos size); // flush first
+
+enum MemAdvice
+{
+    MEM_ADVICE_NORMAL,
+    MEM_ADVICE_RANDOM,
+    MEM_ADVICE_SEQUENTIAL,
+    MEM_ADVICE_WILLNEED
+};
+
+// Read-only mapping of a whole file opened with real_fopen(). Returns NULL if not possible.
+// The mapping stays valid after the file is closed.
+void *real_mmap(void *fh, size_t size);
+void real_munmap(void *ptr, size_t size);
+void real_madvise(const void *ptr, size_t size, MemAdvice advice);
 
 VFS_NAMESPACE_END
 
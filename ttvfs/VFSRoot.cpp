@@ -10,6 +10,10 @@
 #include "VFSLoader.h"
 #include "VFSArchiveLoader.h"
 #include "VFSDirView.h"
+#include "VFSThreads.h"
+#include "VFSTrace.h"
+#include <vector>
+#include <algorithm>
 
 #ifdef _DEBUG
 #  include <cassert>
@@ -60,6 +64,7 @@ void Root::Clear()
     loaders.clear();
     archLdrs.clear();
     loadersInfo.clear();
+    trace = NULL;
 }
 
 void Root::Mount(const char *src, const char *dest)
@@ -181,6 +186,9 @@ File *Root::GetFile(const char *fn)
 
     //printf("VFS: GetFile '%s' -> '%s' (%s:%p)\n", fn, vf ? vf->fullname() : "NULL", vf ? vf->getType() : "?", vf);
 
+    if(vf && trace)
+        trace->record(fn);
+
     return vf;
 }
 
@@ -224,6 +232,16 @@ DirBase *Root::GetDir(const char* dn, bool create /* = false */)
     return vd;
 }
 
+void Root::SetTrace(AccessTrace *t)
+{
+    trace = t;
+}
+
+AccessTrace *Root::GetTrace()
+{
+    return trace;
+}
+
 DirBase *Root::GetDirRoot()
 {
     return merged;
@@ -256,6 +274,111 @@ bool Root::ForEach(const char *path, FileEnumCallback fileCallback /* = NULL */,
     return true;
 }
 
+namespace {
+
+struct BatchItem
+{
+    CountedPtr<File> file;
+    const void *container;
+    vfspos offset;
+    size_t req;
+
+    bool operator<(const BatchItem& o) const
+    {
+        if(container != o.container)
+            return std::less<const void*>()(container, o.container);
+        if(offset != o.offset)
+            return offset < o.offset;
+        return req < o.req;
+    }
+};
+
+struct BatchState
+{
+    ReadRequest *reqs;
+    ReadCallback cb;
+    void *user;
+    std::vector<BatchItem> items;
+    std::vector<std::vector<char> > bufs; // per worker, for requests without dst
+    std::vector<size_t> done; // per worker
+};
+
+} // end anonymous namespace
+
+static void readBatchItem(size_t i, unsigned int worker, void *arg)
+{
+    BatchState& s = *(BatchState*)arg;
+    BatchItem& item = s.items[i];
+    ReadRequest& req = s.reqs[item.req];
+
+    void *dst = req.dst;
+    if(!dst)
+    {
+        std::vector<char>& buf = s.bufs[worker];
+        if(buf.size() <= req.size)
+            buf.resize(req.size + 1);
+        dst = &buf[0];
+    }
+    req.ok = item.file->readBatch(dst, req.size);
+    if(req.ok)
+        ++s.done[worker];
+    if(s.cb)
+        s.cb(req, req.ok ? dst : NULL, s.user);
+}
+
+size_t Root::ReadMany(ReadRequest *reqs, size_t n, ReadCallback cb /* = NULL */, void *user /* = NULL */, unsigned int threads /* = 0 */)
+{
+    BatchState s;
+    s.reqs = reqs;
+    s.cb = cb;
+    s.user = user;
+    s.items.reserve(n);
+
+    // Lookups touch the tree, so do them here
+    for(size_t i = 0; i < n; ++i)
+    {
+        ReadRequest& req = reqs[i];
+        req.size = 0;
+        req.ok = false;
+        BatchItem item;
+        item.file = GetFile(req.path);
+        item.container = NULL;
+        item.offset = 0;
+        item.req = i;
+        const vfspos sz = item.file ? item.file->prepareBatch(item.container, item.offset) : npos;
+        if(sz != npos && (vfspos)(size_t)sz == sz)
+        {
+            req.size = (size_t)sz;
+            if(!req.dst || req.size <= req.capacity)
+            {
+                s.items.push_back(item);
+                continue;
+            }
+        }
+        if(cb)
+            cb(req, NULL, user);
+    }
+    std::sort(s.items.begin(), s.items.end());
+
+    if(!threads)
+        threads = Thread::HardwareConcurrency();
+    if(threads > s.items.size())
+        threads = (unsigned int)s.items.size();
+    if(!threads)
+        return 0;
+    s.bufs.resize(threads);
+    s.done.resize(threads, 0);
+
+    // Handed out in sorted order to whichever thread is free, so that reads from one archive,
+    // which are serialized there, still go through it front to back
+    ParallelForOrdered(s.items.size(), readBatchItem, &s, threads);
+
+    size_t total = 0;
+    for(unsigned int i = 0; i < threads; ++i)
+        total += s.done[i];
+    return total;
+}
+
 
 
 VFS_NAMESPACE_END
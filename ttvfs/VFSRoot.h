@@ -20,6 +20,24 @@ class File;
 class VFSLoader;
 class VFSArchiveLoader;
 class DirView;
+class AccessTrace;
+
+/** One file to read with Root::ReadMany() */
+struct ReadRequest
+{
+    const char *path;
+    void *dst; // where to put the data, or NULL to only pass it to the callback
+    size_t capacity; // of dst
+
+    // Set by ReadMany()
+    size_t size; // file size, if the file was found
+    bool ok;
+};
+
+/** Called by Root::ReadMany() for each request when it is done. data is NULL if the file could not be read.
+    Unless the request had its own buffer, data is only valid during the call.
+    Called from the worker threads, possibly several at the same time. Failed lookups are reported first, from the calling thread. */
+typedef void (*ReadCallback)(ReadRequest& req, const void *data, void *user);
 
 
 /** Root - simplify working with the VFS tree.
@@ -105,6 +123,19 @@ public:
         Set safe = true if the file tree is modified by a callback function. */
     bool ForEach(const char *path, FileEnumCallback fileCallback = NULL, DirEnumCallback dirCallback = NULL, void *user = NULL, bool safe = false);
 
+    /** Reads many files at once, on a pool of threads (0: one per CPU).
+        All paths are looked up first. Files in the same archive are then read in the order
+        they are stored there, so that archive reads stay sequential, and decompressed in parallel.
+        The callback (optional) gets each file as soon as it is done.
+        Returns the number of files read successfully.
+        Don't modify the tree or use the requested files otherwise until this returns. */
+    size_t ReadMany(ReadRequest *reqs, size_t n, ReadCallback cb = NULL, void *user = NULL, unsigned int threads = 0);
+
+    /** Records every file found by GetFile() (and ReadMany()) in the trace, until it is set to NULL.
+        The trace can be shared by several roots. */
+    void SetTrace(AccessTrace *trace);
+    AccessTrace *GetTrace();
+
     /** Remove a file or directory from the tree */
     //bool Remove(File *vf);
     //bool Remove(Dir *dir);
@@ -156,6 +187,7 @@ protected:
     CountedPtr<InternalDir> merged; // contains the merged virtual/actual file system tree
     ArchiveLoaderArray archLdrs;
     ArchiveLoaderInfoArray loadersInfo;
+    CountedPtr<AccessTrace> trace; // optional
 };
 
 VFS_NAMESPACE_END
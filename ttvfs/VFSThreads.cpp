@@ -0,0 +1,463 @@
+// VFSThreads.cpp - minimal platform wrappers for threads and thread synchronization
+// For conditions of distribution and use, see copyright notice in VFS.h
+
+#include "VFSInternal.h"
+#include "VFSThreads.h"
+
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#  include <process.h>
+#else
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+VFS_NAMESPACE_START
+
+struct ThreadStarter
+{
+    static void run(Thread *t) { t->_f(t->_arg); }
+};
+
+Thread::Thread()
+: _t(NULL), _f(NULL), _arg(NULL)
+{
+}
+
+Thread::~Thread()
+{
+    join();
+}
+
+#if _WIN32
+
+static unsigned __stdcall threadEntry(void *p)
+{
+    ThreadStarter::run((Thread*)p);
+    return 0;
+}
+
+bool Thread::start(Func f, void *arg)
+{
+    join();
+    _f = f;
+    _arg = arg;
+    _t = (void*)_beginthreadex(NULL, 0, threadEntry, this, 0, NULL);
+    return _t != NULL;
+}
+
+void Thread::join()
+{
+    if(!_t)
+        return;
+    WaitForSingleObject((HANDLE)_t, INFINITE);
+    CloseHandle((HANDLE)_t);
+    _t = NULL;
+}
+
+unsigned int Thread::HardwareConcurrency()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors ? (unsigned int)si.dwNumberOfProcessors : 1;
+}
+
+Mutex::Mutex()
+{
+    CRITICAL_SECTION *cs = new CRITICAL_SECTION;
+    InitializeCriticalSection(cs);
+    _m = cs;
+}
+
+Mutex::~Mutex()
+{
+    CRITICAL_SECTION *cs = (CRITICAL_SECTION*)_m;
+    DeleteCriticalSection(cs);
+    delete cs;
+}
+
+void Mutex::lock()
+{
+    EnterCriticalSection((CRITICAL_SECTION*)_m);
+}
+
+void Mutex::unlock()
+{
+    LeaveCriticalSection((CRITICAL_SECTION*)_m);
+}
+
+Condition::Condition()
+{
+    CONDITION_VARIABLE *c = new CONDITION_VARIABLE;
+    InitializeConditionVariable(c);
+    _c = c;
+}
+
+Condition::~Condition()
+{
+    delete (CONDITION_VARIABLE*)_c;
+}
+
+void Condition::wait(Mutex& m)
+{
+    SleepConditionVariableCS((CONDITION_VARIABLE*)_c, (CRITICAL_SECTION*)m._m, INFINITE);
+}
+
+void Condition::broadcast()
+{
+    WakeAllConditionVariable((CONDITION_VARIABLE*)_c);
+}
+
+#else
+
+static void *threadEntry(void *p)
+{
+    ThreadStarter::run((Thread*)p);
+    return NULL;
+}
+
+bool Thread::start(Func f, void *arg)
+{
+    join();
+    _f = f;
+    _arg = arg;
+    pthread_t *t = new pthread_t;
+    if(pthread_create(t, NULL, threadEntry, this))
+    {
+        delete t;
+        return false;
+    }
+    _t = t;
+    return true;
+}
+
+void Thread::join()
+{
+    if(!_t)
+        return;
+    pthread_t *t = (pthread_t*)_t;
+    pthread_join(*t, NULL);
+    delete t;
+    _t = NULL;
+}
+
+unsigned int Thread::HardwareConcurrency()
+{
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned int)n : 1;
+}
+
+Mutex::Mutex()
+{
+    pthread_mutex_t *m = new pthread_mutex_t;
+    pthread_mutex_init(m, NULL);
+    _m = m;
+}
+
+Mutex::~Mutex()
+{
+    pthread_mutex_t *m = (pthread_mutex_t*)_m;
+    pthread_mutex_destroy(m);
+    delete m;
+}
+
+void Mutex::lock()
+{
+    pthread_mutex_lock((pthread_mutex_t*)_m);
+}
+
+void Mutex::unlock()
+{
+    pthread_mutex_unlock((pthread_mutex_t*)_m);
+}
+
+Condition::Condition()
+{
+    pthread_cond_t *c = new pthread_cond_t;
+    pthread_cond_init(c, NULL);
+    _c = c;
+}
+
+Condition::~Condition()
+{
+    pthread_cond_t *c = (pthread_cond_t*)_c;
+    pthread_cond_destroy(c);
+    delete c;
+}
+
+void Condition::wait(Mutex& m)
+{
+    pthread_cond_wait((pthread_cond_t*)_c, (pthread_mutex_t*)m._m);
+}
+
+void Condition::broadcast()
+{
+    pthread_cond_broadcast((pthread_cond_t*)_c);
+}
+
+#endif
+
+// ---- Worker pool ----
+
+// Starting threads for every ParallelFor() costs more than small batches take to process,
+// so the threads stay around. Tasks that no thread has taken when the caller is done
+// are taken back, the caller does their work itself.
+
+enum { MAX_POOL_THREADS = 256 };
+
+struct PoolTask
+{
+    enum State { QUEUED, RUNNING, DONE };
+
+    Thread::Func func;
+    void *arg;
+    State state;
+};
+
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+    void submit(PoolTask *tasks, unsigned int n);
+    void finish(PoolTask *tasks, unsigned int n); // takes back queued tasks, waits for running ones
+
+private:
+    static void _threadMain(void *p);
+    void _run();
+
+    Mutex _mtx; // for everything below
+    Condition _work, _done;
+    std::deque<PoolTask*> _queue;
+    std::vector<Thread*> _threads;
+    unsigned int _idle; // threads not running a task
+    bool _stop;
+};
+
+WorkerPool::WorkerPool()
+: _idle(0), _stop(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        MutexLock lock(_mtx);
+        _stop = true;
+        _work.broadcast();
+    }
+    for(size_t i = 0; i < _threads.size(); ++i)
+        delete _threads[i]; // joins
+}
+
+void WorkerPool::_threadMain(void *p)
+{
+    ((WorkerPool*)p)->_run();
+}
+
+void WorkerPool::_run()
+{
+    MutexLock lock(_mtx);
+    for(;;)
+    {
+        while(!_stop && _queue.empty())
+            _work.wait(_mtx);
+        if(_stop)
+            return;
+        PoolTask *t = _queue.front();
+        _queue.pop_front();
+        t->state = PoolTask::RUNNING;
+        --_idle;
+
+        _mtx.unlock();
+        t->func(t->arg);
+        _mtx.lock();
+
+        t->state = PoolTask::DONE;
+        ++_idle;
+        _done.broadcast();
+    }
+}
+
+void WorkerPool::submit(PoolTask *tasks, unsigned int n)
+{
+    MutexLock lock(_mtx);
+    for(unsigned int k = 0; k < n; ++k)
+    {
+        tasks[k].state = PoolTask::QUEUED;
+        _queue.push_back(&tasks[k]);
+    }
+    // A thread that fails to start leaves its task to the caller
+    while(_queue.size() > _idle && _threads.size() < MAX_POOL_THREADS)
+    {
+        Thread *th = new Thread;
+        if(!th->start(_threadMain, this))
+        {
+            delete th;
+            break;
+        }
+        _threads.push_back(th);
+        ++_idle;
+    }
+    _work.broadcast();
+}
+
+void WorkerPool::finish(PoolTask *tasks, unsigned int n)
+{
+    MutexLock lock(_mtx);
+    for(unsigned int k = 0; k < n; ++k)
+        if(tasks[k].state == PoolTask::QUEUED)
+        {
+            _queue.erase(std::find(_queue.begin(), _queue.end(), &tasks[k]));
+            tasks[k].state = PoolTask::DONE;
+        }
+    for(unsigned int k = 0; k < n; ++k)
+        while(tasks[k].state != PoolTask::DONE)
+            _done.wait(_mtx);
+}
+
+static WorkerPool s_pool;
+
+// ---- ParallelFor ----
+
+struct WorkRange
+{
+    Mutex mtx;
+    size_t begin, end;
+};
+
+struct ParallelForState
+{
+    ParallelForFunc func;
+    void *arg;
+    WorkRange *ranges;
+    unsigned int threads;
+    bool shared; // everyone takes from ranges[0]
+};
+
+struct ParallelForWorker
+{
+    ParallelForState *state;
+    unsigned int index;
+};
+
+static bool takeWork(WorkRange& r, size_t& i)
+{
+    MutexLock lock(r.mtx);
+    if(r.begin >= r.end)
+        return false;
+    i = r.begin++;
+    return true;
+}
+
+// Moves the upper half of the largest other range to our own, which is empty
+static bool stealWork(ParallelForState& s, unsigned int self)
+{
+    for(;;)
+    {
+        unsigned int victim = self;
+        size_t most = 0;
+        for(unsigned int k = 0; k < s.threads; ++k)
+        {
+            if(k == self)
+                continue;
+            MutexLock lock(s.ranges[k].mtx);
+            const size_t left = s.ranges[k].end - s.ranges[k].begin;
+            if(left > most)
+            {
+                most = left;
+                victim = k;
+            }
+        }
+        if(victim == self)
+            return false;
+
+        size_t from, to;
+        {
+            WorkRange& v = s.ranges[victim];
+            MutexLock lock(v.mtx);
+            if(v.begin >= v.end)
+                continue; // got there first, try again
+            from = v.begin + (v.end - v.begin) / 2;
+            to = v.end;
+            v.end = from;
+        }
+        WorkRange& own = s.ranges[self];
+        MutexLock lock(own.mtx);
+        own.begin = from;
+        own.end = to;
+        return true;
+    }
+}
+
+static void parallelForWorker(void *p)
+{
+    ParallelForWorker& w = *(ParallelForWorker*)p;
+    ParallelForState& s = *w.state;
+    WorkRange& own = s.ranges[s.shared ? 0 : w.index];
+    size_t i;
+    do
+        while(takeWork(own, i))
+            s.func(i, w.index, s.arg);
+    while(!s.shared && stealWork(s, w.index));
+}
+
+static void parallelFor(size_t n, ParallelForFunc func, void *arg, unsigned int threads, bool shared)
+{
+    if(!threads)
+        threads = Thread::HardwareConcurrency();
+    if(threads > n)
+        threads = (unsigned int)n;
+    if(threads <= 1)
+    {
+        for(size_t i = 0; i < n; ++i)
+            func(i, 0, arg);
+        return;
+    }
+
+    ParallelForState s;
+    s.func = func;
+    s.arg = arg;
+    s.ranges = new WorkRange[threads];
+    s.threads = threads;
+    s.shared = shared;
+    ParallelForWorker *workers = new ParallelForWorker[threads];
+    for(unsigned int k = 0; k < threads; ++k)
+    {
+        s.ranges[k].begin = shared ? 0 : n * k / threads;
+        s.ranges[k].end = shared ? (k ? 0 : n) : n * (k + 1) / threads;
+        workers[k].state = &s;
+        workers[k].index = k;
+    }
+
+    // Workers that never get a thread leave their ranges to the others
+    PoolTask *tasks = new PoolTask[threads - 1];
+    for(unsigned int k = 1; k < threads; ++k)
+    {
+        tasks[k - 1].func = parallelForWorker;
+        tasks[k - 1].arg = &workers[k];
+    }
+    s_pool.submit(tasks, threads - 1);
+    parallelForWorker(&workers[0]);
+    s_pool.finish(tasks, threads - 1);
+
+    delete [] tasks;
+    delete [] workers;
+    delete [] s.ranges;
+}
+
+void ParallelFor(size_t n, ParallelForFunc func, void *arg, unsigned int threads /* = 0 */)
+{
+    parallelFor(n, func, arg, threads, false);
+}
+
+void ParallelForOrdered(size_t n, ParallelForFunc func, void *arg, unsigned int threads /* = 0 */)
+{
+    parallelFor(n, func, arg, threads, true);
+}
+
+VFS_NAMESPACE_END
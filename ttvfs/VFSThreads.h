@@ -0,0 +1,98 @@
+// VFSThreads.h - minimal platform wrappers for threads and thread synchronization
+// For conditions of distribution and use, see copyright notice in VFS.h
+
+#ifndef VFS_THREADS_H
+#define VFS_THREADS_H
+
+#include "VFSDefines.h"
+#include <stddef.h>
+
+VFS_NAMESPACE_START
+
+class Mutex
+{
+public:
+    Mutex();
+    ~Mutex();
+    void lock();
+    void unlock();
+
+private:
+    Mutex(const Mutex&); // non-copyable
+    Mutex& operator=(const Mutex&);
+
+    void *_m; // opaque, to keep system headers out of here
+
+    friend class Condition;
+};
+
+// Lets threads wait for a change of something protected by a Mutex
+class Condition
+{
+public:
+    Condition();
+    ~Condition();
+    void wait(Mutex& m); // m must be locked; it is unlocked while waiting
+    void broadcast();
+
+private:
+    Condition(const Condition&); // non-copyable
+    Condition& operator=(const Condition&);
+
+    void *_c; // opaque
+};
+
+// Locks a mutex for the lifetime of the object
+class MutexLock
+{
+public:
+    MutexLock(Mutex& m) : _m(m) { _m.lock(); }
+    ~MutexLock() { _m.unlock(); }
+
+private:
+    MutexLock(const MutexLock&);
+    MutexLock& operator=(const MutexLock&);
+
+    Mutex& _m;
+};
+
+// Runs a function on a thread of its own
+class Thread
+{
+public:
+    typedef void (*Func)(void *arg);
+
+    Thread();
+    ~Thread(); // joins if still running
+    bool start(Func f, void *arg);
+    void join();
+
+    static unsigned int HardwareConcurrency(); // number of CPUs, at least 1
+
+private:
+    Thread(const Thread&); // non-copyable
+    Thread& operator=(const Thread&);
+
+    void *_t; // opaque; NULL when not running
+    Func _f;
+    void *_arg;
+
+    friend struct ThreadStarter;
+};
+
+// Calls func(i, worker, arg) for all i in [0, n), on 'threads' threads (0: one per CPU).
+// 'worker' is in [0, threads); worker 0 is the calling thread. The others come from a pool of threads
+// that are kept around for later calls. If none of them are free, e.g. in nested calls,
+// the calling thread does the work itself.
+// Each worker goes through a contiguous range of indices in ascending order.
+// Workers that run out of work steal the upper half of the largest remaining range.
+typedef void (*ParallelForFunc)(size_t i, unsigned int worker, void *arg);
+void ParallelFor(size_t n, ParallelForFunc func, void *arg, unsigned int threads = 0);
+
+// Like ParallelFor(), but all workers take the next index from one shared counter,
+// so indices are started in ascending order across all threads, e.g. for reads from one file.
+void ParallelForOrdered(size_t n, ParallelForFunc func, void *arg, unsigned int threads = 0);
+
+VFS_NAMESPACE_END
+
+#endif
@@ -23,6 +23,28 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define VFS_NL_VECTOR 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#  define VFS_NL_VECTOR 16
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define VFS_NL_VECTOR 16
+#  define VFS_NL_NEON 1
+#endif
+
+// Vector loads may read past the end of a string, but never into the next page
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))
+#  define VFS_NO_ASAN __attribute__((no_sanitize_address))
+#else
+#  define VFS_NO_ASAN
+#endif
+
 VFS_NAMESPACE_START
 
 
@@ -288,6 +310,29 @@ bool GetFileSize(const char* fn, vfspos& size)
     return true;
 }
 
+bool GetFileModTime(const char* fn, vfspos& t)
+{
+#if defined(VFS_LARGEFILE_SUPPORT) && defined(_MSC_VER)
+    struct _stat64 st;
+    if(_stat64(fn, &st))
+        return false;
+    t = st.st_mtime;
+#else
+    struct stat st;
+    if(stat(fn, &st))
+        return false;
+    // Whole seconds miss quick successive rewrites, use a finer resolution where available
+#  if defined(__linux__)
+    t = (vfspos)st.st_mtime * 1000000000 + st.st_mtim.tv_nsec;
+#  elif defined(__APPLE__)
+    t = (vfspos)st.st_mtime * 1000000000 + st.st_mtimespec.tv_nsec;
+#  else
+    t = st.st_mtime;
+#  endif
+#endif
+    return true;
+}
+
 void FixSlashes(std::string& s)
 {
     char last = 0, cur;
@@ -444,6 +489,84 @@ bool WildcardMatch(const char *str, const char *pattern)
 // windows has 13+10
 // *nix has 10
 // exotic systems may have 10+13
+size_t strnNLcpyScalar(char *dst, const char *src, unsigned int n /* = -1 */)
+{
+    char *olddst = dst;
+    bool had10 = false, had13 = false;
+
+    --n; // reserve 1 for \0 at end
+
+    while(*src && n)
+    {
+        if((had13 && *src == 10) || (had10 && *src == 13))
+        {
+            ++src; // last was already mangled
+            had13 = had10 = false; // processed one CRLF pair
+            continue;
+        }
+        had10 = *src == 10;
+        had13 = *src == 13;
+
+        if(had10 || had13)
+        {
+            *dst++ = '\n';
+            ++src;
+        }
+        else
+            *dst++ = *src++;
+
+        --n;
+    }
+
+    *dst++ = 0;
+
+    return dst - olddst;
+}
+
+#ifdef VFS_NL_VECTOR
+
+// Number of leading bytes that are neither 13 nor 0, up to VFS_NL_VECTOR
+#ifdef VFS_NL_NEON
+
+VFS_NO_ASAN static inline unsigned int nlPlainPrefix(const char *p)
+{
+    const uint8x16_t v = vld1q_u8((const uint8_t*)p);
+    const uint8x16_t eq = vorrq_u8(vceqq_u8(v, vdupq_n_u8(13)), vceqzq_u8(v));
+    // NEON has no movemask; narrowing leaves 4 bits per byte
+    const uint64_t m = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    return m ? (unsigned int)__builtin_ctzll(m) >> 2 : 16;
+}
+
+#else
+
+VFS_NO_ASAN static inline unsigned int nlPlainPrefix(const char *p)
+{
+#if VFS_NL_VECTOR == 32
+    const __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    const unsigned int m = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(13)), _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+#else
+    const __m128i v = _mm_loadu_si128((const __m128i*)p);
+    const unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(13)), _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+#endif
+    if(!m)
+        return VFS_NL_VECTOR;
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, m);
+    return idx;
+#else
+    return __builtin_ctz(m);
+#endif
+}
+
+#endif
+
+#endif
+
+// Same as strnNLcpyScalar(), but copies runs without 13 in bulk.
+// Newlines that are already 10 stay as they are, so only CRs need the byte-wise treatment.
 size_t strnNLcpy(char *dst, const char *src, unsigned int n /* = -1 */)
 {
     char *olddst = dst;
@@ -453,6 +576,28 @@ size_t strnNLcpy(char *dst, const char *src, unsigned int n /* = -1 */)
 
     while(*src && n)
     {
+#ifdef VFS_NL_VECTOR
+        // Find the end of the run first, then move it in one go.
+        // Don't read across a page boundary, the string might end before it.
+        if(n >= VFS_NL_VECTOR && ((size_t)src & 4095) <= 4096 - VFS_NL_VECTOR && !(had13 && *src == 10))
+        {
+            unsigned int k = 0, w;
+            do
+                k += (w = nlPlainPrefix(src + k));
+            while(w == VFS_NL_VECTOR && n - k >= VFS_NL_VECTOR && ((size_t)(src + k) & 4095) <= 4096 - VFS_NL_VECTOR);
+            if(k)
+            {
+                memmove(dst, src, k);
+                dst += k;
+                src += k;
+                n -= k;
+                had10 = src[-1] == 10;
+                had13 = false;
+                continue;
+            }
+        }
+#endif
+
         if((had13 && *src == 10) || (had10 && *src == 13))
         {
             ++src; // last was already mangled
@@ -26,6 +26,7 @@ bool IsDirectory(const char *);
 bool CreateDir(const char*);
 bool CreateDirRec(const char*);
 bool GetFileSize(const char*, vfspos&);
+bool GetFileModTime(const char*, vfspos&); // unspecified unit, only good to detect changes
 void FixSlashes(std::string& s);
 void FixPath(std::string& s);
 const char *GetBaseNameFromPath(const char *str);
@@ -34,6 +35,7 @@ void StripFileExtension(std::string& s);
 void StripLastPath(std::string& s);
 bool WildcardMatch(const char *str, const char *pattern);
 size_t strnNLcpy(char *dst, const char *src, unsigned int n = -1);
+size_t strnNLcpyScalar(char *dst, const char *src, unsigned int n = -1); // same results, for comparison
 
 template <class T> void StrSplit(const std::string &src, const std::string &sep, T& container, bool keepEmpty = false)
 {
@@ -0,0 +1,207 @@
+// VFSTrace.cpp - records which files are used, to lay out archives in that order
+// For conditions of distribution and use, see copyright notice in VFS.h
+
+#include "VFSInternal.h"
+#include "VFSTrace.h"
+#include "VFSTools.h"
+#include "VFSDir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <algorithm>
+
+VFS_NAMESPACE_START
+
+AccessTrace::AccessTrace()
+: _phase(0)
+{
+}
+
+bool AccessTrace::PathLess::operator()(const std::string& a, const std::string& b) const
+{
+    return casecmp(a.c_str(), b.c_str()) < 0;
+}
+
+void AccessTrace::mark()
+{
+    MutexLock lock(_mutex);
+    ++_phase;
+    _inPhase.clear();
+}
+
+void AccessTrace::record(const char *path)
+{
+    MutexLock lock(_mutex);
+    _record(path);
+}
+
+void AccessTrace::_record(const char *path)
+{
+    if(!_inPhase.insert(path).second)
+        return;
+    Event e;
+    e.phase = _phase;
+    e.path = path;
+    _events.push_back(e);
+}
+
+void AccessTrace::clear()
+{
+    MutexLock lock(_mutex);
+    _clear();
+}
+
+void AccessTrace::_clear()
+{
+    _events.clear();
+    _inPhase.clear();
+    _phase = 0;
+}
+
+bool AccessTrace::save(const char *fn) const
+{
+    FILE *fh = fopen(fn, "w");
+    if(!fh)
+        return false;
+    MutexLock lock(_mutex);
+    bool ok = true;
+    for(size_t i = 0; i < _events.size() && ok; ++i)
+        ok = fprintf(fh, "%u %s\n", _events[i].phase, _events[i].path.c_str()) > 0;
+    return !fclose(fh) && ok;
+}
+
+bool AccessTrace::load(const char *fn)
+{
+    FILE *fh = fopen(fn, "r");
+    if(!fh)
+        return false;
+    MutexLock lock(_mutex);
+    _clear();
+    std::string line;
+    bool ok = true;
+    for(int c; ok; )
+    {
+        c = fgetc(fh);
+        if(c != '\n' && c != EOF)
+        {
+            line += (char)c;
+            continue;
+        }
+        if(!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if(!line.empty())
+        {
+            const size_t sp = line.find(' ');
+            char *end = NULL;
+            const unsigned long phase = strtoul(line.c_str(), &end, 10);
+            ok = sp != std::string::npos && sp && end == line.c_str() + sp && sp + 1 < line.length();
+            if(ok)
+            {
+                if(_events.empty() || phase != _phase)
+                    _inPhase.clear();
+                _phase = (unsigned int)phase;
+                _record(line.c_str() + sp + 1);
+            }
+        }
+        line.clear();
+        if(c == EOF)
+            break;
+    }
+    ok = ok && !ferror(fh);
+    fclose(fh);
+    if(!ok)
+        _clear();
+    else if(!_events.empty())
+    {
+        ++_phase; // anything recorded from now on is a new phase
+        _inPhase.clear();
+    }
+    return ok;
+}
+
+namespace {
+
+struct TraceUse
+{
+    size_t first; // event index
+    std::vector<unsigned int> phases;
+};
+
+struct LayoutKey
+{
+    size_t group; // first use of any file in the group
+    size_t first;
+    size_t name;
+
+    bool operator<(const LayoutKey& o) const
+    {
+        if(group != o.group)
+            return group < o.group;
+        return first < o.first;
+    }
+};
+
+} // end anonymous namespace
+
+size_t AccessTrace::layout(std::vector<std::string>& names, const char *prefix /* = NULL */) const
+{
+    std::string dir = prefix ? prefix : "";
+    FixPath(dir);
+    MakeSlashTerminated(dir);
+
+    MutexLock lock(_mutex);
+    typedef std::map<std::string, TraceUse, PathLess> Uses;
+    Uses uses;
+    for(size_t i = 0; i < _events.size(); ++i)
+    {
+        const Event& e = _events[i];
+        if(casecmp(e.path.substr(0, dir.length()).c_str(), dir.c_str()))
+            continue;
+        std::pair<Uses::iterator, bool> ins = uses.insert(std::make_pair(e.path.substr(dir.length()), TraceUse()));
+        TraceUse& u = ins.first->second;
+        if(ins.second)
+            u.first = i;
+        u.phases.push_back(e.phase);
+    }
+
+    // Each group is a set of phases, ranked by the first use of any of its files
+    std::map<std::vector<unsigned int>, size_t> groups;
+    for(Uses::iterator it = uses.begin(); it != uses.end(); ++it)
+    {
+        std::vector<unsigned int>& p = it->second.phases;
+        std::sort(p.begin(), p.end());
+        p.erase(std::unique(p.begin(), p.end()), p.end());
+        std::pair<std::map<std::vector<unsigned int>, size_t>::iterator, bool> g =
+            groups.insert(std::make_pair(p, it->second.first));
+        if(!g.second)
+            g.first->second = std::min(g.first->second, it->second.first);
+    }
+
+    std::vector<LayoutKey> used;
+    std::vector<std::string> unused;
+    for(size_t i = 0; i < names.size(); ++i)
+    {
+        Uses::const_iterator it = uses.find(names[i]);
+        if(it == uses.end())
+        {
+            unused.push_back(names[i]);
+            continue;
+        }
+        LayoutKey k;
+        k.group = groups[it->second.phases];
+        k.first = it->second.first;
+        k.name = i;
+        used.push_back(k);
+    }
+    std::stable_sort(used.begin(), used.end());
+
+    std::vector<std::string> out;
+    out.reserve(names.size());
+    for(size_t i = 0; i < used.size(); ++i)
+        out.push_back(names[used[i].name]);
+    out.insert(out.end(), unused.begin(), unused.end());
+    names.swap(out);
+    return used.size();
+}
+
+VFS_NAMESPACE_END
@@ -0,0 +1,72 @@
+// VFSTrace.h - records which files are used, to lay out archives in that order
+// For conditions of distribution and use, see copyright notice in VFS.h
+
+#ifndef VFS_TRACE_H
+#define VFS_TRACE_H
+
+#include "VFSDefines.h"
+#include "VFSRefcounted.h"
+#include "VFSThreads.h"
+#include <string>
+#include <vector>
+#include <set>
+
+VFS_NAMESPACE_START
+
+/** Records the files looked up through a Root, see Root::SetTrace().
+    The program is split into phases with mark(), e.g. one per level it loads;
+    files used in the same phases are then put next to each other by layout().
+    An archive built in that order (ttvfs_gen -t) is read mostly sequentially when the program runs again.
+    Thread-safe, so it can be shared by several roots and used while ReadMany() runs.
+    Paths are compared like everywhere else in the tree, ignoring case with VFS_IGNORE_CASE. */
+class AccessTrace : public Refcounted
+{
+public:
+    struct Event
+    {
+        unsigned int phase;
+        std::string path; // as looked up, after FixPath()
+    };
+
+    AccessTrace();
+
+    /** Starts the next phase */
+    void mark();
+
+    /** Called by Root for every file it finds. Only the first use of a file in a phase is kept. */
+    void record(const char *path);
+
+    void clear();
+
+    inline const std::vector<Event>& events() const { return _events; } // only while nothing is recorded
+
+    /** Text file with one line per event: phase, a space, the path */
+    bool save(const char *fn) const;
+    bool load(const char *fn); // replaces what was recorded
+
+    /** Reorders 'names', e.g. the entries of an archive to be built: files used in exactly the same phases
+        form a group, groups follow each other in the order of their first use, as do the files in a group.
+        Names that were never used keep their order and come last.
+        Recorded paths are full VFS paths; if the archive is mounted somewhere else than the root,
+        pass that directory as 'prefix': it is stripped, and paths outside of it are ignored.
+        Returns how many of the names were found in the trace. */
+    size_t layout(std::vector<std::string>& names, const char *prefix = NULL) const;
+
+    struct PathLess
+    {
+        bool operator()(const std::string& a, const std::string& b) const;
+    };
+
+private:
+    void _record(const char *path);
+    void _clear();
+
+    mutable Mutex _mutex; // for everything below
+    std::vector<Event> _events;
+    std::set<std::string, PathLess> _inPhase; // paths recorded in the current phase
+    unsigned int _phase;
+};
+
+VFS_NAMESPACE_END
+
+#endif
@@ -70,6 +70,7 @@ VFS_NAMESPACE_END
 #include "VFSSystemPaths.h"
 #include "VFSTools.h"
 #include "VFSLoader.h"
+#include "VFSTrace.h"
 
 
 // Check to enforce correct including.
@@ -1,11 +1,28 @@
 #include <iostream>
-#include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <cstdlib>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <vector>
+#include <set>
+#include <map>
+#include <sys/stat.h>
+#if _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
 
 #include <VFSTools.h>
+#include <VFSThreads.h>
+#include <VFSTrace.h>
+#include <VFSZipWriter.h>
+#include <VFSZipArchiveRef.h>
+#include <VFSZipCrc.h>
 #include <miniz.h>
 
 ttvfs::StringList GetRecursiveFileList(const std::string& dirPath)
@@ -43,74 +60,876 @@ ttvfs::StringList GetRecursiveFileList(const std::string& dirPath)
     return allFiles;
 }
 
+// Compressed data of the files of an earlier run, so that unchanged files don't have to be compressed again.
+// A file is taken from the cache if its size and modification time are the same, or if it has the same
+// content hashes. The file holds the settings that affect compression, then one record per written entry:
+// key, hashes and compression method, followed by the compressed data or the name of an earlier record
+// with the same data. All numbers are little endian.
+class BuildCache
+{
+public:
+    struct Record
+    {
+        ttvfs::vfspos size;
+        long long mtime;
+        unsigned int crc;
+        unsigned long long hash;
+        unsigned short method;
+        bool store;
+        unsigned int packedSize;
+        std::streamoff dataOfs;
+    };
+
+    BuildCache() : _created(0), _outOk(false) {}
+
+    bool load(const std::string& path, const std::string& settings);
+    const Record *find(const std::string& name) const;
+    bool readData(const Record& r, std::vector<char>& data);
+    inline long long created() const { return _created; }
+
+    // The new cache is written next to the old one, which it replaces in commit()
+    bool begin(const std::string& path, const std::string& settings, long long created);
+    void add(const std::string& name, const Record& r, const void *data, const char *dupOf);
+    bool commit();
+
+private:
+    static const char s_magic[8];
+    std::string _path;
+    std::ifstream _in;
+    std::ofstream _out;
+    std::map<std::string, Record> _records;
+    long long _created; // of the loaded cache
+    bool _outOk;
+};
+
+const char BuildCache::s_magic[8] = { 'T', 'T', 'V', 'F', 'S', 'G', 'C', '1' };
+
+static void PutLE(std::string& buf, unsigned long long v, unsigned int bytes)
+{
+    for(unsigned int i = 0; i < bytes; ++i)
+        buf += (char)(unsigned char)(v >> (8 * i));
+}
+
+static bool GetLE(std::istream& in, unsigned long long& v, unsigned int bytes)
+{
+    unsigned char b[8];
+    if(!in.read((char*)b, bytes))
+        return false;
+    v = 0;
+    for(unsigned int i = 0; i < bytes; ++i)
+        v |= (unsigned long long)b[i] << (8 * i);
+    return true;
+}
+
+bool BuildCache::load(const std::string& path, const std::string& settings)
+{
+    _in.open(path.c_str(), std::ifstream::in | std::ifstream::binary);
+    char magic[sizeof(s_magic)];
+    unsigned long long len, created;
+    if(!_in.read(magic, sizeof(magic)) || memcmp(magic, s_magic, sizeof(magic))
+        || !GetLE(_in, len, 4) || len != settings.length())
+        return false;
+    std::string stored(settings.length(), 0);
+    if(!_in.read(&stored[0], len) || stored != settings || !GetLE(_in, created, 8))
+        return false;
+
+    // Only the records are read now, the data when it is needed
+    std::map<std::string, Record> records;
+    for(;;)
+    {
+        unsigned long long nameLen, dupLen, v[7];
+        if(!GetLE(_in, nameLen, 2))
+            break;
+        std::string name((size_t)nameLen, 0);
+        if(!_in.read(&name[0], nameLen) || !GetLE(_in, v[0], 8) || !GetLE(_in, v[1], 8) || !GetLE(_in, v[2], 4)
+            || !GetLE(_in, v[3], 8) || !GetLE(_in, v[4], 2) || !GetLE(_in, v[5], 1) || !GetLE(_in, v[6], 4)
+            || !GetLE(_in, dupLen, 2))
+            return false;
+        std::string dupOf((size_t)dupLen, 0);
+        if(dupLen && !_in.read(&dupOf[0], dupLen))
+            return false;
+        std::streamoff dataOfs = _in.tellg();
+        if(dupLen)
+        {
+            std::map<std::string, Record>::const_iterator it = records.find(dupOf);
+            if(it == records.end() || it->second.packedSize != v[6])
+                return false;
+            dataOfs = it->second.dataOfs;
+        }
+        else if(!_in.seekg(v[6], std::ios_base::cur))
+            return false;
+        Record& r = records[name];
+        r.size = v[0];
+        r.mtime = (long long)v[1];
+        r.crc = (unsigned int)v[2];
+        r.hash = v[3];
+        r.method = (unsigned short)v[4];
+        r.store = v[5] != 0;
+        r.packedSize = (unsigned int)v[6];
+        r.dataOfs = dataOfs;
+    }
+    _in.clear();
+    _records.swap(records);
+    _created = (long long)created;
+    return true;
+}
+
+const BuildCache::Record *BuildCache::find(const std::string& name) const
+{
+    std::map<std::string, Record>::const_iterator it = _records.find(name);
+    return it != _records.end() ? &it->second : NULL;
+}
+
+bool BuildCache::readData(const Record& r, std::vector<char>& data)
+{
+    data.resize(r.packedSize);
+    return _in.seekg(r.dataOfs).good() && (data.empty() || _in.read(&data[0], data.size()).good());
+}
+
+bool BuildCache::begin(const std::string& path, const std::string& settings, long long created)
+{
+    _path = path;
+    _out.open((path + ".tmp").c_str(), std::ofstream::out | std::ofstream::binary);
+    std::string buf(s_magic, sizeof(s_magic));
+    PutLE(buf, settings.length(), 4);
+    buf += settings;
+    PutLE(buf, created, 8);
+    _outOk = _out.write(buf.data(), buf.length()).good();
+    return _outOk;
+}
+
+void BuildCache::add(const std::string& name, const Record& r, const void *data, const char *dupOf)
+{
+    const size_t dupLen = dupOf ? strlen(dupOf) : 0;
+    std::string buf;
+    PutLE(buf, name.length(), 2);
+    buf += name;
+    PutLE(buf, r.size, 8);
+    PutLE(buf, r.mtime, 8);
+    PutLE(buf, r.crc, 4);
+    PutLE(buf, r.hash, 8);
+    PutLE(buf, r.method, 2);
+    PutLE(buf, r.store, 1);
+    PutLE(buf, r.packedSize, 4);
+    PutLE(buf, dupLen, 2);
+    buf.append(dupOf ? dupOf : "", dupLen);
+    _outOk = _outOk && name.length() <= 0xFFFF && dupLen <= 0xFFFF && _out.write(buf.data(), buf.length()).good()
+        && (dupLen || !r.packedSize || _out.write((const char*)data, r.packedSize).good());
+}
+
+bool BuildCache::commit()
+{
+    _in.close();
+    _out.close();
+    const std::string tmp = _path + ".tmp";
+    if(!_outOk || _out.fail())
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    remove(_path.c_str());
+    return !rename(tmp.c_str(), _path.c_str());
+}
+
+// 64-bit FNV-1a, to tell files apart together with the CRC
+static unsigned long long HashData(const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    unsigned long long h = 14695981039346656037ULL;
+    for(size_t i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+struct InputFile
+{
+    std::string externalPath;
+    std::vector<char> data;
+    ttvfs::vfspos size; // before reading
+    time_t mtime;
+    bool store;
+    const BuildCache::Record *cached; // take it from there, if set before reading the file isn't read
+    bool hashIt; // for the cache
+    unsigned int crc;
+    unsigned long long hash;
+    bool ok;
+};
+
+// Files that are read together, see ReadInputFile()
+struct InputBatch
+{
+    std::vector<InputFile> *inputs;
+    size_t first;
+};
+
+static void StatInputFile(size_t i, unsigned int, void *arg)
+{
+    InputFile& f = (*(std::vector<InputFile>*)arg)[i];
+    struct stat st;
+    const bool ok = !stat(f.externalPath.c_str(), &st);
+    f.size = ok ? st.st_size : 0;
+    f.mtime = ok ? st.st_mtime : 0;
+}
+
+// Files are read on all threads, too
+static void ReadInputFile(size_t i, unsigned int, void *arg)
+{
+    const InputBatch& batch = *(const InputBatch*)arg;
+    InputFile& f = (*batch.inputs)[batch.first + i];
+    struct stat st;
+    f.ok = f.cached != NULL;
+    if(f.ok || stat(f.externalPath.c_str(), &st))
+        return;
+    f.mtime = st.st_mtime;
+    std::ifstream in(f.externalPath.c_str(), std::ifstream::in | std::ifstream::binary);
+    f.data.resize((size_t)st.st_size);
+    if(!f.data.empty())
+        in.read(&f.data[0], f.data.size());
+    f.ok = in.good() || (f.data.empty() && !in.bad());
+    if(f.ok && f.hashIt)
+    {
+        f.crc = ttvfs::zipCrc32(0, f.data.empty() ? NULL : &f.data[0], f.data.size());
+        f.hash = HashData(f.data.empty() ? NULL : &f.data[0], f.data.size());
+    }
+}
+
+// Formats that are compressed already; deflating them again hardly saves anything
+static const char *s_defaultStoredExtensions = "png,jpg,jpeg,gif,webp,ogg,oga,opus,mp3,flac,mp4,webm,"
+    "zip,gz,tgz,bz2,xz,7z,zst,lz4";
+
+typedef std::set<std::string> ExtensionSet;
+
+static void AddExtensions(const std::string& list, ExtensionSet& exts)
+{
+    std::vector<std::string> parts;
+    ttvfs::StrSplit(list, ",", parts);
+    for(size_t i = 0; i < parts.size(); ++i)
+    {
+        std::string ext = parts[i];
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        exts.insert(ext);
+    }
+}
+
+static bool HasExtension(const std::string& path, const ExtensionSet& exts)
+{
+    const size_t dot = path.find_last_of('.');
+    if(exts.empty() || dot == std::string::npos || path.find('/', dot) != std::string::npos)
+        return false;
+    std::string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return exts.count(ext) != 0;
+}
+
+static bool ReadWholeFile(const std::string& path, void *dst, size_t bytes)
+{
+    std::ifstream in(path.c_str(), std::ifstream::in | std::ifstream::binary);
+    return in.read((char*)dst, bytes).good() && in.gcount() == (std::streamsize)bytes;
+}
+
+// For deduplication against files that were written already, see ZipWriter::setDedup()
+static bool ReadBackFile(const char *name, void *dst, size_t bytes, void *user)
+{
+    std::string path = *(const std::string*)user + std::string("/") + name;
+    ttvfs::FixPath(path);
+    return ReadWholeFile(path, dst, bytes);
+}
+
+// The archive goes to a file as it is made
+struct ArchiveOutput
+{
+    std::ofstream file;
+    ttvfs::vfspos size;
+};
+
+static bool WriteArchiveData(const void *data, size_t bytes, void *user)
+{
+    ArchiveOutput& out = *(ArchiveOutput*)user;
+    out.size += bytes;
+    return out.file.write((const char*)data, bytes).good();
+}
+
+// Records what was written, for the next run
+struct CacheWriter
+{
+    BuildCache *cache;
+    std::vector<InputFile> *inputs;
+    std::map<std::string, size_t> byName;
+};
+
+static void CacheWrittenEntry(const ttvfs::ZipPackedEntry& e, void *user)
+{
+    CacheWriter& cw = *(CacheWriter*)user;
+    std::map<std::string, size_t>::const_iterator it = cw.byName.find(e.name);
+    if(it == cw.byName.end())
+        return;
+    const InputFile& f = (*cw.inputs)[it->second];
+    // A duplicate's data was compressed the way its original is, which may be stored by extension
+    std::map<std::string, size_t>::const_iterator orig = e.dupOf ? cw.byName.find(e.dupOf) : it;
+    if(orig == cw.byName.end())
+        return;
+    BuildCache::Record r;
+    r.size = e.size;
+    r.mtime = f.mtime;
+    r.crc = e.crc;
+    r.hash = f.hash;
+    r.method = e.method;
+    r.store = (*cw.inputs)[orig->second].store;
+    r.packedSize = e.packedSize;
+    cw.cache->add(e.name, r, e.data, e.dupOf);
+}
+
+static double WallTime()
+{
+#if _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return double(c.QuadPart) / double(f.QuadPart);
+#else
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// One array in the generated source
+struct Blob
+{
+    std::string arrayName;
+    std::string sizeName;
+    std::string description;
+    std::string fileSuffix; // of the data file in assembler mode
+    const unsigned char *data;
+    std::string dataFile; // instead of 'data'; in assembler mode, the data file already
+    size_t size;
+    unsigned int align; // 0 if it doesn't matter; at least 16 bytes in assembler mode
+};
+
+// One "0x.., " per byte, 8 per line. Formatted by hand, which is a lot faster than iostream manipulators.
+static bool WriteCArray(std::ofstream& source, const Blob& blob)
+{
+    if(blob.align)
+        source << "TTVFS_ALIGNED(" << blob.align << ") ";
+    source << "unsigned char " << blob.arrayName << "[" << blob.size
+        << "] = {\n";
+
+    std::ifstream dataFile;
+    std::vector<unsigned char> chunk;
+    if(!blob.dataFile.empty())
+    {
+        dataFile.open(blob.dataFile.c_str(), std::ifstream::in | std::ifstream::binary);
+        chunk.resize(1024 * 1024);
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    const size_t size = blob.size;
+    std::vector<char> buf;
+    buf.reserve(64 * 1024 + 64);
+    for(size_t base = 0; base < size; )
+    {
+        const unsigned char *pBuf = blob.data + base;
+        size_t n = size - base;
+        if(!blob.dataFile.empty())
+        {
+            n = std::min(n, chunk.size());
+            if(!dataFile.read((char*)&chunk[0], n).good())
+            {
+                std::cerr << "Failed to read data file " << blob.dataFile << std::endl;
+
+                return false;
+            }
+            pBuf = &chunk[0];
+        }
+
+        for(size_t k = 0; k < n; ++k)
+        {
+            const size_t i = base + k;
+            if(0 == (i % 8))
+                buf.insert(buf.end(), 4, ' ');
+
+            const char item[] = { '0', 'x', hex[pBuf[k] >> 4], hex[pBuf[k] & 0xf], ',', ' ' };
+            buf.insert(buf.end(), item, item + (i != size - 1 ? 6 : 5));
+
+            if(7 == (i % 8))
+                buf.push_back('\n');
+
+            if(buf.size() >= 64 * 1024)
+            {
+                source.write(&buf[0], buf.size());
+                buf.clear();
+            }
+        }
+        base += n;
+    }
+
+    if(0 != (size % 8))
+        buf.push_back('\n');
+
+    if(!buf.empty())
+        source.write(&buf[0], buf.size());
+
+    source << "};\n";
+    source << "\n";
+    source << "size_t " << blob.sizeName << " = " << size << ";\n";
+    return true;
+}
+
+static bool WriteCSource(const std::string& sourcePath, const std::vector<Blob>& blobs)
+{
+    std::ofstream source;
+    source.open(sourcePath.c_str(), std::ofstream::out);
+
+    if(!source.good())
+    {
+        std::cerr << "Failed to open source file " << sourcePath << std::endl;
+
+        return false;
+    }
+
+    source << "/* THIS FILE IS GENERATED. DO NOT EDIT. "
+        "DO NOT ADD TO CODE REPOSITORY. */\n";
+    source << "\n";
+    source << "#include <stdio.h>\n";
+    source << "\n";
+
+    for(size_t i = 0; i < blobs.size(); ++i)
+    {
+        if(blobs[i].align)
+        {
+            source << "#if defined(_MSC_VER)\n"
+                "#  define TTVFS_ALIGNED(n) __declspec(align(n))\n"
+                "#elif defined(__GNUC__)\n"
+                "#  define TTVFS_ALIGNED(n) __attribute__((aligned(n)))\n"
+                "#else\n"
+                "#  define TTVFS_ALIGNED(n)\n"
+                "#endif\n"
+                "\n";
+            break;
+        }
+    }
+
+    for(size_t i = 0; i < blobs.size(); ++i)
+    {
+        if(i)
+            source << "\n";
+        if(!WriteCArray(source, blobs[i]))
+            return false;
+    }
+
+    return source.good();
+}
+
+// SOURCE with its extension replaced by 'suffix'
+static std::string DataFilePath(const std::string& sourcePath, const std::string& suffix)
+{
+    std::string basePath = sourcePath;
+    const size_t dot = basePath.find_last_of('.');
+    if(dot != std::string::npos && basePath.find_first_of("/\\", dot) == std::string::npos)
+        basePath.resize(dot);
+    return basePath + suffix;
+}
+
+// The data goes into files of their own next to the source, which only pulls them in with .incbin.
+// That is a lot faster to generate and to compile than a C array.
+// For GCC and Clang (all targets), and other assemblers understanding GNU syntax.
+static bool WriteAsmSource(const std::string& sourcePath, const std::vector<Blob>& blobs)
+{
+    std::ofstream source;
+    source.open(sourcePath.c_str(), std::ofstream::out);
+
+    if(!source.good())
+    {
+        std::cerr << "Failed to open source file " << sourcePath << std::endl;
+
+        return false;
+    }
+
+    // Goes through the C preprocessor, for the platform differences
+    source << "/* THIS FILE IS GENERATED. DO NOT EDIT. "
+        "DO NOT ADD TO CODE REPOSITORY. */\n"
+        "\n"
+        "#if defined(__APPLE__) || (defined(_WIN32) && !defined(_WIN64))\n"
+        "#  define TTVFS_SYM(x) _##x\n"
+        "#else\n"
+        "#  define TTVFS_SYM(x) x\n"
+        "#endif\n"
+        "#if defined(__APPLE__)\n"
+        "    .const_data\n"
+        "#elif defined(_WIN32)\n"
+        "    .section .rdata,\"dr\"\n"
+        "#else\n"
+        "    .section .rodata\n"
+        "#endif\n";
+
+    for(size_t b = 0; b < blobs.size(); ++b)
+    {
+        const Blob& blob = blobs[b];
+        const std::string blobPath = DataFilePath(sourcePath, blob.fileSuffix);
+
+        if(blob.dataFile.empty())
+        {
+            std::ofstream data;
+            data.open(blobPath.c_str(), std::ofstream::out | std::ofstream::binary);
+            if(!data.good() || !data.write((const char*)blob.data, blob.size).good())
+            {
+                std::cerr << "Failed to write data file " << blobPath << std::endl;
+
+                return false;
+            }
+        }
+
+        std::string incPath;
+        for(size_t i = 0; i < blobPath.length(); ++i)
+        {
+            if(blobPath[i] == '"' || blobPath[i] == '\\')
+                incPath += '\\';
+            incPath += blobPath[i];
+        }
+
+        source << "\n"
+            "    .globl TTVFS_SYM(" << blob.arrayName << ")\n"
+            "    .balign " << std::max(blob.align, 16u) << "\n"
+            "TTVFS_SYM(" << blob.arrayName << "):\n"
+            "    .incbin \"" << incPath << "\"\n"
+            "\n"
+            "    .globl TTVFS_SYM(" << blob.sizeName << ")\n"
+            "    .balign 8\n"
+            "TTVFS_SYM(" << blob.sizeName << "):\n"
+            "#if defined(__LP64__) || defined(_WIN64)\n"
+            "    .quad " << blob.size << "\n"
+            "#else\n"
+            "    .long " << blob.size << "\n"
+            "#endif\n";
+    }
+
+    source << "\n"
+        "#if defined(__ELF__)\n"
+        "    .section .note.GNU-stack,\"\",%progbits\n"
+        "#endif\n";
+
+    return source.good();
+}
+
 int main(int argc, char *argv[])
 {
-    if(6 != argc)
+    unsigned int threads = 0;
+    bool verbose = false;
+    bool asmOutput = false;
+    std::string indexName, indexSizeName;
+    unsigned int align = 0;
+    int minSavings = -1;
+    bool dedup = false;
+    bool policy = false;
+    ExtensionSet storedExts;
+    ttvfs::vfspos memoryLimit = 256;
+    std::string cachePath;
+    std::string tracePath;
+    std::string tracePrefix;
+    int argi = 1;
+    for( ; argi < argc && argv[argi][0] == '-'; ++argi)
+    {
+        if(!strcmp(argv[argi], "-j") && argi + 1 < argc)
+            threads = atoi(argv[++argi]);
+        else if(!strcmp(argv[argi], "-v"))
+            verbose = true;
+        else if(!strcmp(argv[argi], "-S"))
+            asmOutput = true;
+        else if(!strcmp(argv[argi], "-a") && argi + 1 < argc)
+            align = atoi(argv[++argi]);
+        else if(!strcmp(argv[argi], "-p"))
+            policy = true;
+        else if(!strcmp(argv[argi], "-s") && argi + 1 < argc)
+            minSavings = std::max(atoi(argv[++argi]), 0);
+        else if(!strcmp(argv[argi], "-x") && argi + 1 < argc)
+            AddExtensions(argv[++argi], storedExts);
+        else if(!strcmp(argv[argi], "-d"))
+            dedup = true;
+        else if(!strcmp(argv[argi], "-m") && argi + 1 < argc)
+            memoryLimit = std::max(atoi(argv[++argi]), 0);
+        else if(!strcmp(argv[argi], "-c") && argi + 1 < argc)
+            cachePath = argv[++argi];
+        else if(!strcmp(argv[argi], "-t") && argi + 1 < argc)
+            tracePath = argv[++argi];
+        else if(!strcmp(argv[argi], "-T") && argi + 1 < argc)
+            tracePrefix = argv[++argi];
+        else if(!strcmp(argv[argi], "-i") && argi + 2 < argc)
+        {
+            indexName = argv[++argi];
+            indexSizeName = argv[++argi];
+        }
+        else
+            break;
+    }
+
+    if(5 != argc - argi)
     {
-        std::cerr << "USAGE: " << argv[0] << " ARRAY_NAME SIZE_NAME "
+        std::cerr << "USAGE: " << argv[0] << " [-j THREADS] [-v] [-S] [-a ALIGN] "
+            "[-p] [-s PERCENT] [-x EXT,...] [-d] [-m MB] [-c CACHEFILE] [-t TRACEFILE [-T DIR]] "
+            "[-i INDEX_NAME INDEX_SIZE_NAME] ARRAY_NAME SIZE_NAME "
             "DIR SOURCE HEADER" << std::endl;
+        std::cerr << "  -S: SOURCE is an assembler file (.S) that includes the archive "
+            "from a .bin file next to it" << std::endl;
+        std::cerr << "  -a: align the data of stored entries, and the archive, to ALIGN bytes, "
+            "so it can be used in place (power of 2, up to 32768; MSVC allows up to 8192)" << std::endl;
+        std::cerr << "  -s: store files that deflate doesn't make at least PERCENT smaller" << std::endl;
+        std::cerr << "  -x: store files with these extensions without trying to compress them" << std::endl;
+        std::cerr << "  -d: store files with the same content only once "
+            "(other tools, e.g. unzip, may refuse the archive then)" << std::endl;
+        std::cerr << "  -p: all of the above, with -s 5 and -x " << s_defaultStoredExtensions
+            << " unless given" << std::endl;
+        std::cerr << "  -m: read at most about MB megabytes of files at once (default 256, 0: all); "
+            "the archive is the same either way" << std::endl;
+        std::cerr << "  -c: keep the compressed files in CACHEFILE, and take those that didn't change "
+            "from there next time; the archive is the same as without" << std::endl;
+        std::cerr << "  -t: put the files in the order they were used, as recorded by an AccessTrace "
+            "and saved to TRACEFILE; files used together are put next to each other" << std::endl;
+        std::cerr << "  -T: the archive was mounted at DIR when the trace was recorded; "
+            "only paths in DIR are used, relative to it" << std::endl;
+        std::cerr << "  -i: also embed a precomputed index, to be passed to "
+            "AddArchive() in a VFSZipIndexParams" << std::endl;
 
         return EXIT_FAILURE;
     }
 
-    std::string arrayName = argv[1];
-    std::string sizeName = argv[2];
-    std::string dirPath = argv[3];
-    std::string sourcePath = argv[4];
-    std::string headerPath = argv[5];
+    std::string arrayName = argv[argi];
+    std::string sizeName = argv[argi + 1];
+    std::string dirPath = argv[argi + 2];
+    std::string sourcePath = argv[argi + 3];
+    std::string headerPath = argv[argi + 4];
     std::string arrayNameUpper = arrayName;
 
     std::transform(arrayNameUpper.begin(), arrayNameUpper.end(),
         arrayNameUpper.begin(), ::toupper);
 
+    if(policy)
+    {
+        if(minSavings < 0)
+            minSavings = 5;
+        if(storedExts.empty())
+            AddExtensions(s_defaultStoredExtensions, storedExts);
+        dedup = true;
+    }
+
     ttvfs::StringList files = GetRecursiveFileList(dirPath);
 
-    mz_zip_archive zip;
-    memset(&zip, 0, sizeof(zip));
+    if(!tracePath.empty())
+    {
+        ttvfs::AccessTrace trace;
+        if(!trace.load(tracePath.c_str()))
+        {
+            std::cerr << "Failed to read trace file " << tracePath << std::endl;
+
+            return EXIT_FAILURE;
+        }
+        std::vector<std::string> order(files.begin(), files.end());
+        if(!trace.layout(order, tracePrefix.c_str()))
+            std::cerr << "Warning: none of the files are in the trace " << tracePath
+                << (tracePrefix.empty() ? ", use -T if the archive wasn't mounted at the root" : "")
+                << std::endl;
+        files.assign(order.begin(), order.end());
+    }
+
+    const double startTime = WallTime();
+
+    std::vector<InputFile> inputs(files.size());
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        inputs[i].externalPath = dirPath + std::string("/") + files[i];
+        ttvfs::FixPath(inputs[i].externalPath);
+    }
+    ttvfs::ParallelFor(inputs.size(), StatInputFile, &inputs, threads);
 
-    if(MZ_FALSE == mz_zip_writer_init_heap(&zip, 0, 128 * 1024))
+    // Every entry is deflated on its own, and the archive is assembled in the order of the file list,
+    // so the output is the same for any number of threads.
+    ttvfs::ZipWriter zip(-1);
+    if(!zip.setAlignment(align))
     {
-        std::cerr << "mz_zip_writer_init_heap failed" << std::endl;
+        std::cerr << "Unsupported alignment " << align << std::endl;
 
         return EXIT_FAILURE;
     }
+    if(minSavings > 0)
+        zip.setMinSavings(minSavings);
+    zip.setDedup(dedup, ReadBackFile, &dirPath);
+
+    // Anything that changes how a file is compressed must be part of the settings, so that a cache
+    // made with others is not used
+    BuildCache cache;
+    CacheWriter cacheWriter;
+    bool cacheLoaded = false;
+    if(!cachePath.empty())
+    {
+        std::ostringstream settings;
+        settings << "miniz " << MZ_VERSION << ", level -1, min savings " << std::max(minSavings, 0);
+        cacheLoaded = cache.load(cachePath, settings.str());
+        if(!cache.begin(cachePath, settings.str(), (long long)time(NULL)))
+        {
+            std::cerr << "Failed to open cache file " << cachePath << ".tmp" << std::endl;
 
-    for(std::deque<std::string>::const_iterator it = files.begin();
-        it != files.end(); ++it)
+            return EXIT_FAILURE;
+        }
+        cacheWriter.cache = &cache;
+        cacheWriter.inputs = &inputs;
+        for(size_t i = 0; i < files.size(); ++i)
+            cacheWriter.byName[files[i]] = i;
+        zip.setWrittenCallback(CacheWrittenEntry, &cacheWriter);
+    }
+    for(size_t i = 0; i < inputs.size(); ++i)
     {
-        std::string externalPath = dirPath + std::string("/") + (*it);
-        std::string internalPath = *it;
+        InputFile& f = inputs[i];
+        f.store = HasExtension(files[i], storedExts);
+        f.cached = NULL;
+        f.hashIt = !cachePath.empty();
+    }
 
-        ttvfs::FixPath(externalPath);
+    // The archive goes straight to the data file in assembler mode, otherwise to a temporary file
+    // that is turned into the C source afterwards. Either way it never is in memory as a whole.
+    const std::string archivePath = asmOutput ? DataFilePath(sourcePath, ".bin") : sourcePath + ".zip.tmp";
+    ArchiveOutput out;
+    out.size = 0;
+    out.file.open(archivePath.c_str(), std::ofstream::out | std::ofstream::binary);
+    if(!out.file.good())
+    {
+        std::cerr << "Failed to open data file " << archivePath << std::endl;
+
+        return EXIT_FAILURE;
+    }
+
+    // Files are read in batches of about 'memoryLimit', which are compressed and written
+    // before the next one is read. A file larger than that is a batch of its own.
+    const ttvfs::vfspos batchBytes = memoryLimit * 1024 * 1024;
+    double readSecs = 0, compressSecs = 0;
+    size_t batches = 0, fromCache = 0;
+    std::vector<char> packed;
+    for(size_t first = 0; first < inputs.size(); ++batches)
+    {
+        size_t end = first;
+        ttvfs::vfspos bytes = 0;
+        do
+            bytes += inputs[end++].size;
+        while(end < inputs.size() && (!batchBytes || bytes + inputs[end].size <= batchBytes));
+
+        // Files with the same size and time as in the cache are not read at all.
+        // Unless they were changed in the same second the cache was made, then the time doesn't tell.
+        const double batchStart = WallTime();
+        for(size_t i = first; i < end && cacheLoaded; ++i)
+        {
+            InputFile& f = inputs[i];
+            const BuildCache::Record *r = cache.find(files[i]);
+            if(r && r->size == f.size && r->mtime == (long long)f.mtime && r->store == f.store
+                && r->mtime < cache.created())
+                f.cached = r;
+        }
+        InputBatch batch = { &inputs, first };
+        ttvfs::ParallelFor(end - first, ReadInputFile, &batch, threads);
+        for(size_t i = first; i < end; ++i)
+        {
+            InputFile& f = inputs[i];
+            if(!f.ok)
+            {
+                std::cerr << "Failed to read file " << f.externalPath
+                    << std::endl;
+
+                return EXIT_FAILURE;
+            }
+            // Otherwise, the content decides
+            const BuildCache::Record *r = f.cached ? f.cached : cacheLoaded ? cache.find(files[i]) : NULL;
+            if(r && !f.cached && r->size == (ttvfs::vfspos)f.data.size() && r->crc == f.crc && r->hash == f.hash
+                && r->store == f.store)
+                f.cached = r;
+            zip.setTime(f.mtime);
+            if(f.cached && cache.readData(*r, packed))
+            {
+                f.hash = r->hash;
+                std::vector<char>().swap(f.data);
+                zip.addPacked(files[i].c_str(), packed, (unsigned int)r->size, r->crc, r->method);
+                ++fromCache;
+            }
+            else if(f.cached)
+            {
+                std::cerr << "Failed to read cache file " << cachePath << std::endl;
+
+                return EXIT_FAILURE;
+            }
+            else
+                zip.take(files[i].c_str(), f.data, f.store);
+        }
+        const double readTime = WallTime();
+        readSecs += readTime - batchStart;
 
-        if(MZ_FALSE == mz_zip_writer_add_file(&zip, internalPath.c_str(),
-            externalPath.c_str(), NULL, 0, MZ_DEFAULT_COMPRESSION))
+        if(!zip.writeEntries(WriteArchiveData, &out, threads))
         {
-            std::cerr << "mz_zip_writer_add_file failed on file "
-                << internalPath << std::endl;
+            std::cerr << "Failed to build the archive" << std::endl;
 
             return EXIT_FAILURE;
         }
+        compressSecs += WallTime() - readTime;
+        first = end;
     }
 
-    unsigned char *pBuf;
-    size_t size;
-
-    if(MZ_FALSE == mz_zip_writer_finalize_heap_archive(&zip,
-        (void**)&pBuf, &size))
+    const bool written = zip.finish(WriteArchiveData, &out, threads);
+    out.file.close();
+    if(!written || out.file.fail())
     {
-        std::cerr << "mz_zip_writer_finalize_heap_archive failed" << std::endl;
+        std::cerr << "Failed to build the archive" << std::endl;
 
         return EXIT_FAILURE;
     }
 
-    if(MZ_FALSE == mz_zip_writer_end(&zip))
+    if(!cachePath.empty() && !cache.commit())
     {
-        std::cerr << "mz_zip_writer_end failed" << std::endl;
+        std::cerr << "Failed to write cache file " << cachePath << std::endl;
 
         return EXIT_FAILURE;
     }
 
+    const size_t size = (size_t)out.size;
+
+    std::vector<Blob> blobs(1);
+    blobs[0].arrayName = arrayName;
+    blobs[0].sizeName = sizeName;
+    blobs[0].description = "Embedded resource zip file";
+    blobs[0].fileSuffix = ".bin";
+    blobs[0].data = NULL;
+    blobs[0].dataFile = archivePath;
+    blobs[0].size = size;
+    blobs[0].align = align > 1 ? align : 0;
+
+    // The same index the archive loader would build, made by the same code
+    std::vector<char> index;
+    if(!indexName.empty())
+    {
+        ttvfs::CountedPtr<ttvfs::ZipArchiveRef> zref = new ttvfs::ZipArchiveRef(
+            new ttvfs::DiskFile(archivePath.c_str()));
+        if(!zref->init() || !zref->exportIndex(index))
+        {
+            std::cerr << "Failed to build the index" << std::endl;
+
+            return EXIT_FAILURE;
+        }
+
+        Blob b;
+        b.arrayName = indexName;
+        b.sizeName = indexSizeName;
+        b.description = "Precomputed index of the embedded resource zip file";
+        b.fileSuffix = ".index.bin";
+        b.data = (const unsigned char*)&index[0];
+        b.size = index.size();
+        b.align = 16;
+        blobs.push_back(b);
+    }
+
+    if(verbose)
+    {
+        std::cerr << files.size() << " files, " << zip.uncompressedSize()
+            << " bytes, " << size << " bytes archive, " << zip.storedCount() << " stored, "
+            << zip.dupCount() << " duplicates, " << zip.paddingSize() << " bytes alignment padding, "
+            << (threads ? threads : ttvfs::Thread::HardwareConcurrency())
+            << " threads, " << batches << " batches, " << fromCache << " files from the cache: read "
+            << readSecs << " s, compressed " << compressSecs << " s, total " << (WallTime() - startTime) << " s" << std::endl;
+    }
+
     std::ofstream header;
     header.open(headerPath.c_str(), std::ofstream::out);
 
@@ -133,67 +952,27 @@ int main(int argc, char *argv[])
     header << "extern \"C\" {" << std::endl;
     header << "#endif" << std::endl;
     header << std::endl;
-    header << "/** Embedded resource zip file. */" << std::endl;
-    header << "extern unsigned char " << arrayName << "[" << size
-        << "];" << std::endl;
-    header << std::endl;
-    header << "/** Embedded resource zip file size. */" << std::endl;
-    header << "extern size_t " << sizeName << ";" << std::endl;
-    header << std::endl;
+    for(size_t i = 0; i < blobs.size(); ++i)
+    {
+        header << "/** " << blobs[i].description << ". */" << std::endl;
+        header << "extern unsigned char " << blobs[i].arrayName << "[" << blobs[i].size
+            << "];" << std::endl;
+        header << std::endl;
+        header << "/** " << blobs[i].description << " size. */" << std::endl;
+        header << "extern size_t " << blobs[i].sizeName << ";" << std::endl;
+        header << std::endl;
+    }
     header << "#ifdef __cplusplus" << std::endl;
     header << "}" << std::endl;
     header << "#endif" << std::endl;
     header << std::endl;
     header << "#endif /* " << arrayNameUpper << "_H */" << std::endl;
 
-    std::ofstream source;
-    source.open(sourcePath.c_str(), std::ofstream::out);
-
-    if(!source.good())
-    {
-        std::cerr << "Failed to open header file " << sourcePath << std::endl;
-
-        return EXIT_FAILURE;
-    }
-
-    source << "/* THIS FILE IS GENERATED. DO NOT EDIT. "
-        "DO NOT ADD TO CODE REPOSITORY. */" << std::endl;
-    source << std::endl;
-    source << "#include <stdio.h>" << std::endl;
-    source << std::endl;
-    source << "unsigned char " << arrayName << "[" << size
-        << "] = {" << std::endl;
-
-    for(size_t i = 0; i < size; ++i)
-    {
-        if(0 == (i % 8))
-        {
-            source << "    ";
-        }
-
-        source << "0x" << std::hex << std::setw(2) << std::setfill('0')
-            << ((unsigned int)pBuf[i]) << ",";
-
-        if(i != (size - 1))
-        {
-            source << " ";
-        }
-
-        if(7 == (i % 8))
-        {
-            source << std::endl;
-        }
-    }
-
-    if(0 != (size % 8))
-    {
-        source << std::endl;
-    }
-
-    source << "};" << std::endl;
-    source << std::endl;
-    source << "size_t " << sizeName << " = " << std::dec
-        << size << ";" << std::endl;
+    const bool ok = asmOutput
+        ? WriteAsmSource(sourcePath, blobs)
+        : WriteCSource(sourcePath, blobs);
+    if(!asmOutput)
+        remove(archivePath.c_str());
 
-    return EXIT_SUCCESS;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -4,18 +4,22 @@
 
 #include "VFSInternal.h"
 
-#include "miniz.h"
-
 VFS_NAMESPACE_START
 
 
 
-ZipDir::ZipDir(ZipArchiveRef *handle, const char *fullpath, bool canLoad)
+ZipDir::ZipDir(ZipArchiveRef *handle, const char *fullpath)
 : Dir(fullpath, NULL)
 , _archiveHandle(handle)
-, _canLoad(canLoad)
-, _couldLoad(canLoad)
+, _canLoad(true)
 {
+    // fullpath is the archive's name, optionally followed by a path inside the archive
+    const size_t archLen = strlen(handle->fullname());
+    if(fullnameLen() > archLen)
+    {
+        _prefix = fullname() + archLen + 1;
+        _prefix += '/';
+    }
 }
 
 ZipDir::~ZipDir()
@@ -27,45 +31,125 @@ ZipDir::~ZipDir()
 void ZipDir::close()
 {
     _archiveHandle->close();
-    _canLoad = _couldLoad; // allow loading again after re-opening (in case archive was replaced)
+    _canLoad = true; // allow loading again after re-opening (in case archive was replaced)
 }
 
 DirBase *ZipDir::createNew(const char *fullpath) const
 {
     const ZipArchiveRef *czref = _archiveHandle;
     ZipArchiveRef *zref = const_cast<ZipArchiveRef*>(czref);
-    return new ZipDir(zref, fullpath, false);
+    return new ZipDir(zref, fullpath);
+}
+
+File *ZipDir::_createFile(size_t entry)
+{
+    ZipFile *vf = new ZipFile(_archiveHandle->entryName(entry), _archiveHandle, entry);
+    _addSingle(vf);
+    return vf;
+}
+
+File *ZipDir::createFile(const char *fn)
+{
+    if(File *vf = getFile(fn))
+        return vf;
+    const std::string path = _prefix + fn;
+    ZipFile *vf = new ZipFile(path.c_str(), _archiveHandle, _archiveHandle->entries());
+    _addRecursiveSkip(vf, fullnameLen() + 1);
+    return vf;
+}
+
+// len is the length of the subdir's name in the entry's name, without the prefix
+DirBase *ZipDir::_createSubdir(size_t entry, size_t len)
+{
+    char * const name = (char*)VFS_STACK_ALLOC(len + 1);
+    memcpy(name, _archiveHandle->entryName(entry) + _prefix.length(), len);
+    name[len] = 0;
+    DirBase *sub = _createAndInsertSubtree(name);
+    VFS_STACK_FREE(name);
+    return sub;
 }
 
-#define MZ ((mz_zip_archive*)_archiveHandle->mz)
+File *ZipDir::getFileByName(const char *fn, bool lazyLoad /* = true */)
+{
+    Files::iterator it = _files.find(fn);
+    if(it != _files.end())
+        return it->second;
+
+    if(!_canLoad) // already enumerated, so it's not there
+        return NULL;
+
+    const size_t plen = _prefix.length();
+    const size_t fnlen = strlen(fn);
+    char * const path = (char*)VFS_STACK_ALLOC(plen + fnlen + 1);
+    memcpy(path, _prefix.c_str(), plen);
+    memcpy(path + plen, fn, fnlen + 1);
+    const size_t entry = _archiveHandle->findEntry(path);
+    VFS_STACK_FREE(path);
+
+    return entry < _archiveHandle->entries() ? _createFile(entry) : NULL;
+}
+
+DirBase *ZipDir::getDirByName(const char *dn, bool lazyLoad /* = true */, bool useSubtrees /* = true */)
+{
+    if(DirBase *sub = DirBase::getDirByName(dn, lazyLoad, useSubtrees))
+        return sub;
+
+    if(!_canLoad || dn[0] == '/')
+        return NULL;
+
+    // The dir exists if any entry starts with "prefix/dn/"
+    const size_t plen = _prefix.length();
+    const size_t dnlen = strlen(dn);
+    const size_t len = plen + dnlen + 1;
+    char * const path = (char*)VFS_STACK_ALLOC(len + 1);
+    memcpy(path, _prefix.c_str(), plen);
+    memcpy(path + plen, dn, dnlen);
+    path[len - 1] = '/';
+    path[len] = 0;
+    const size_t entry = _archiveHandle->lowerBound(path, len);
+    const bool found = entry < _archiveHandle->prefixEnd(entry, path, len);
+    VFS_STACK_FREE(path);
+
+    return found ? _createSubdir(entry, dnlen) : NULL;
+}
 
 void ZipDir::load()
 {
     if(!_canLoad)
         return;
 
-    _archiveHandle->openRead();
-
-    const unsigned int files = mz_zip_reader_get_num_files(MZ);
-    const size_t len = fullnameLen() + 1; // +1 for trailing '/' when used as path name in addRecursive()
+    const char *prefix = _prefix.c_str();
+    const size_t plen = _prefix.length();
+    size_t i = _archiveHandle->lowerBound(prefix, plen);
+    const size_t end = _archiveHandle->prefixEnd(i, prefix, plen);
 
-    mz_zip_archive_file_stat fs;
-    for (unsigned int i = 0; i < files; ++i)
+    while(i < end)
     {
-        if(mz_zip_reader_is_file_encrypted(MZ, i))
-            continue;
-        if(!mz_zip_reader_file_stat(MZ, i, &fs))
-            continue;
-        if(mz_zip_reader_is_file_a_directory(MZ, i))
+        const char *name = _archiveHandle->entryName(i);
+        const char *rel = name + plen;
+        const char *slashpos = strchr(rel, '/');
+        if(!slashpos)
         {
-            _createAndInsertSubtree(fs.m_filename);
+            // rel is empty for this dir's own entry
+            if(*rel && _files.find(rel) == _files.end())
+                _createFile(i);
+            ++i;
             continue;
         }
-        if(getFile(fs.m_filename))
-            continue;
 
-        ZipFile *vf = new ZipFile(fs.m_filename, _archiveHandle, fs.m_file_index);
-        _addRecursiveSkip(vf, len);
+        const size_t sublen = slashpos - rel;
+        if(sublen)
+        {
+            char * const subname = (char*)VFS_STACK_ALLOC(sublen + 1);
+            memcpy(subname, rel, sublen);
+            subname[sublen] = 0;
+            if(!DirBase::getDirByName(subname, false, false))
+                _createSubdir(i, sublen);
+            VFS_STACK_FREE(subname);
+        }
+
+        // Skip everything in that subdir, it will be loaded by the subdir itself
+        i = _archiveHandle->prefixEnd(i, name, plen + sublen + 1);
     }
 
     _canLoad = false;
@@ -7,20 +7,35 @@
 VFS_NAMESPACE_START
 
 
+// Files and subdirs are created on demand from the archive's index,
+// either when looked up by name or when the dir is enumerated (load()).
 class ZipDir : public Dir
 {
 public:
-    ZipDir(ZipArchiveRef *handle, const char *subpath, bool canLoad);
+    ZipDir(ZipArchiveRef *handle, const char *fullpath);
     virtual ~ZipDir();
     virtual void load();
     virtual const char *getType() const { return "ZipDir"; }
     virtual void close();
     virtual DirBase *createNew(const char *dir) const;
+    virtual File *getFileByName(const char *fn, bool lazyLoad = true);
+    virtual DirBase *getDirByName(const char *dn, bool lazyLoad = true, bool useSubtrees = true);
+
+    // For new entries: returns the file if it exists, otherwise a file that is not in the archive yet,
+    // to be opened for writing. fn may contain subdirs, which are created as needed.
+    // The entry is added to the archive when the file is closed, see ZipArchiveRef::addEntry().
+    File *createFile(const char *fn);
+
+    // For settings and statistics of the archive
+    inline ZipArchiveRef *getArchive() { return _archiveHandle.content(); }
 
 protected:
+    File *_createFile(size_t entry);
+    DirBase *_createSubdir(size_t entry, size_t len);
+
     CountedPtr<ZipArchiveRef> _archiveHandle;
+    std::string _prefix; // path inside the archive, '/'-terminated unless empty
     bool _canLoad;
-    const bool _couldLoad;
 };
 
 
@@ -2,43 +2,79 @@
 #include "VFSInternal.h"
 #include "VFSTools.h"
 #include "VFSDir.h"
+#include "VFSZipFormat.h"
+#include "VFSThreads.h"
 #include <stdio.h>
-#include "miniz.h"
 
 VFS_NAMESPACE_START
 
 
-ZipFile::ZipFile(const char *name, ZipArchiveRef *zref, unsigned int fileIdx)
+ZipFile::ZipFile(const char *name, ZipArchiveRef *zref, size_t entry)
 : File(joinPath(zref->fullname(), name).c_str())
 , _buf(NULL)
+, _data(NULL)
 , _pos(0)
 , _archiveHandle(zref)
 , _bufSize(0)
-, _fileIdx(fileIdx)
-, _mode("rb") // binary mode by default
+, _entry((unsigned int)entry)
+, _generation(entry < zref->entries() ? zref->generation() : 0) // new entries are looked up after committing
+, _seeker(NULL)
+, _dataOfs(0)
+, _writing(false)
+, _append(false)
+, _dirty(false)
+, _binary(true) // binary mode by default
 {
 }
 
 ZipFile::~ZipFile()
 {
     close();
+    delete _seeker;
 }
 
+// Smaller deflated entries are cheaper to unpack whole than to read piecewise
+static const vfspos SEEKER_MIN_SIZE = 1024 * 1024;
+
+static Mutex s_seekerMutex; // for creating ZipFile::_seeker
+
 
 bool ZipFile::open(const char *mode /* = NULL */)
 {
     _pos = 0;
     if(!mode)
         mode = "rb";
-    else if(strchr(mode, 'w') || strchr(mode, 'a'))
-        return false; // writing not yet supported
-    if(_mode != mode)
+    const bool binary = !!strchr(mode, 'b');
+    const bool writing = strchr(mode, 'w') || strchr(mode, 'a') || strchr(mode, '+');
+    if(_binary != binary || writing || _writing)
     {
-        delete [] _buf;
-        _buf = NULL;
-        _mode = mode;
+        close();
+        _binary = binary;
+    }
+    if(!writing)
+        return true; // does not have to be opened
+
+    // Except for "w", start with the current data, if there is any. Always as stored, even in text mode,
+    // because written data isn't converted either.
+    const bool exists = size() != npos;
+    if(exists && !strchr(mode, 'w'))
+    {
+        if(!_archiveHandle->openRead() || !_updateEntry())
+            return false;
+        _wbuf.resize(_archiveHandle->entryStat(_entry).uncompSize);
+        if(!_wbuf.empty() && !_archiveHandle->extract(_entry, &_wbuf[0]))
+        {
+            _wbuf.clear();
+            return false;
+        }
     }
-    return true; // does not have to be opened
+    _writing = true;
+    _dirty = !exists || strchr(mode, 'w'); // like fopen(), that creates or truncates the file
+    _append = !!strchr(mode, 'a');
+    _bufSize = _wbuf.size();
+    if(_append)
+        _pos = _bufSize;
+    return true;
 }
 
 bool ZipFile::isopen() const
@@ -53,10 +89,17 @@ bool ZipFile::iseof() const
 
 void ZipFile::close()
 {
-    //flush(); // TODO: write to zip file on close
+    if(_writing)
+    {
+        _writing = false;
+        if(_dirty)
+            _archiveHandle->addEntry(_entryName(), _wbuf);
+        _wbuf.clear();
+    }
 
     delete [] _buf;
     _buf = NULL;
+    _data = NULL;
     _bufSize = 0;
 }
 
@@ -90,10 +133,12 @@ bool ZipFile::seek(vfspos pos, int whence)
     return true;
 }
 
+// Hands a copy of the data written so far to the archive, to be written by the next commit
 bool ZipFile::flush()
 {
-    // FIXME: use this to actually write to zip file?
-    return false;
+    if(_writing && !_dirty)
+        return true; // nothing changed
+    return _writing && _archiveHandle->addEntry(_entryName(), _wbuf.empty() ? NULL : &_wbuf[0], _wbuf.size());
 }
 
 vfspos ZipFile::getpos() const
@@ -103,11 +148,35 @@ vfspos ZipFile::getpos() const
 
 size_t ZipFile::read(void *dst, size_t bytes)
 {
-    if(!_buf && !unpack())
+    if(_writing)
+    {
+        const size_t done = _readWritten(_pos, dst, bytes);
+        _pos += done;
+        return done;
+    }
+
+    // Reading everything at once needs no buffer of our own
+    if(!_data && _binary)
+    {
+        const vfspos sz = size();
+        if(sz != npos && _pos >= sz)
+            return 0; // read that way already, don't unpack just to find the end
+        if(sz != npos && !_pos && sz <= (vfspos)bytes)
+        {
+            const vfspos done = readAll(dst, bytes);
+            if(done == npos)
+                return 0;
+            _pos = done;
+            _bufSize = done; // for iseof() and seek()
+            return (size_t)done;
+        }
+    }
+
+    if(!_data && !unpack())
         return 0;
 
-    char *startptr = _buf + _pos;
-    char *endptr = _buf + size();
+    const char *startptr = _data + _pos;
+    const char *endptr = _data + size();
     bytes = std::min<size_t>(endptr - startptr, bytes); // limit in case reading over buffer size
     memcpy(dst, startptr, bytes); //  binary copy
     _pos += bytes;
@@ -116,55 +185,220 @@ size_t ZipFile::read(void *dst, size_t bytes)
 
 size_t ZipFile::write(const void *src, size_t bytes)
 {
-    // TODO: implement actually writing to the underlying Zip file.
-    //printf("NYI: ZipFile::write()");
+    if(!_writing)
+        return 0;
+    if(_append)
+        _pos = _wbuf.size();
+    if(_pos + bytes >= 0xFFFFFFFF) // zip files have uint32 range only
+        return 0;
+    const size_t end = (size_t)_pos + bytes;
+    if(_wbuf.size() < end)
+        _wbuf.resize(end);
+    if(bytes)
+        memcpy(&_wbuf[(size_t)_pos], src, bytes);
+    _pos = end;
+    _dirty = _dirty || bytes;
+    _bufSize = _wbuf.size();
+    return bytes;
+}
+
+size_t ZipFile::_readWritten(vfspos offset, void *dst, size_t bytes)
+{
+    if(offset >= (vfspos)_wbuf.size())
+        return 0;
+    bytes = (size_t)std::min<vfspos>(bytes, _wbuf.size() - offset);
+    memcpy(dst, &_wbuf[(size_t)offset], bytes);
+    return bytes;
+}
+
+// Large entries such as nested archives are read without unpacking them as a whole.
+// Stored entries come straight from the archive, deflated ones through an InflateSeeker.
+// Unlike whole-file reads, this is not verified, except that an InflateSeeker checks the CRC
+// once it has seen all of the data.
+size_t ZipFile::readAt(vfspos offset, void *dst, size_t bytes)
+{
+    if(_writing)
+        return _readWritten(offset, dst, bytes);
+    if(!_data && _binary)
+    {
+        if(!_archiveHandle->openRead() || !_updateEntry())
+            return 0;
+        const ZipEntryStat& st = _archiveHandle->entryStat(_entry);
+        if(offset >= st.uncompSize)
+            return 0;
+        bytes = (size_t)std::min<vfspos>(bytes, st.uncompSize - offset);
+
+        if(st.method == ZIP_METHOD_STORED && st.compSize == st.uncompSize)
+        {
+            vfspos ofs;
+            return _archiveHandle->dataOffset(st, ofs) && _archiveHandle->readRaw(ofs + offset, dst, bytes) ? bytes : 0;
+        }
+        if(st.method == ZIP_METHOD_DEFLATED && st.uncompSize >= SEEKER_MIN_SIZE)
+            if(InflateSeeker *seeker = _getSeeker())
+                return seeker->read(offset, dst, bytes);
+    }
+
+    if(!_data && !unpack())
+        return 0;
+    if(offset >= _bufSize)
+        return 0;
+    bytes = (size_t)std::min<vfspos>(bytes, _bufSize - offset);
+    memcpy(dst, _data + offset, bytes);
+    return bytes;
+}
+
+InflateSeeker *ZipFile::_getSeeker()
+{
+    MutexLock lock(s_seekerMutex);
+    if(!_seeker)
+    {
+        const ZipEntryStat& st = _archiveHandle->entryStat(_entry);
+        if(!_archiveHandle->dataOffset(st, _dataOfs))
+            return NULL;
+        const bool check = _archiveHandle->getVerifyPolicy() != ZipArchiveRef::VERIFY_NEVER;
+        _seeker = new InflateSeeker(st.compSize, st.uncompSize, _readCompressed, this, check, st.crc32);
+    }
+    return _seeker;
+}
+
+bool ZipFile::_readCompressed(vfspos ofs, void *dst, size_t bytes, void *user)
+{
+    ZipFile *zf = (ZipFile*)user;
+    return zf->_archiveHandle->readRaw(zf->_dataOfs + ofs, dst, bytes);
+}
 
-    return 0;
+// Stored entries of in-memory archives can be used in place, e.g. as a nested archive
+const void *ZipFile::getMemory() const
+{
+    if(!_binary || _writing || _generation != _archiveHandle->generation())
+        return NULL;
+    return _archiveHandle->getStoredEntryPtr(_archiveHandle->entryStat(_entry));
 }
 
-#define MZ ((mz_zip_archive*)_archiveHandle->mz)
+vfspos ZipFile::readAll(void *dst, size_t cap)
+{
+    if(_writing)
+        return _wbuf.size() <= cap ? (vfspos)_readWritten(0, dst, _wbuf.size()) : npos;
+
+    // Text mode needs the converted data, which is only known after unpacking
+    if(!_data && _binary)
+    {
+        if(!_archiveHandle->openRead() || !_updateEntry())
+            return npos;
+        const ZipEntryStat& st = _archiveHandle->entryStat(_entry);
+        if((vfspos)st.uncompSize > (vfspos)cap)
+            return npos;
+        _archiveHandle->prefetch(st);
+        return _archiveHandle->extract(_entry, dst) ? (vfspos)st.uncompSize : npos;
+    }
+
+    if(!_data && !unpack())
+        return npos;
+    if(_bufSize > (vfspos)cap)
+        return npos;
+    memcpy(dst, _data, (size_t)_bufSize);
+    return _bufSize;
+}
 
 vfspos ZipFile::size()
 {
-    if(_buf && _bufSize)
+    if(_writing)
+        return _wbuf.size();
+    if(_data && _bufSize)
         return _bufSize;
 
-    if(!_archiveHandle->openRead())
-        return npos;
+    if(!_updateEntry())
+        return npos; // gone from the archive
+    return (vfspos)_archiveHandle->entryStat(_entry).uncompSize;
+}
 
-    // FIXME: this is not 100% safe. The file index may change if the zip file is changed externally while closed
-    mz_zip_archive_file_stat zstat;
-    if(!mz_zip_reader_file_stat(MZ, _fileIdx, &zstat))
+// Entries of the same archive are best read in the order of their local headers
+vfspos ZipFile::prepareBatch(const void *& container, vfspos& offset)
+{
+    if(_writing)
+        return File::prepareBatch(container, offset);
+    if(!_archiveHandle->openRead() || !_updateEntry())
         return npos;
+    const ZipEntryStat& st = _archiveHandle->entryStat(_entry);
+    container = _archiveHandle.content();
+    offset = st.headerOfs();
+    return st.uncompSize;
+}
+
+// Always binary. Leaves this file's own buffer alone.
+bool ZipFile::readBatch(void *dst, size_t size)
+{
+    if(_writing)
+        return _readWritten(0, dst, size) == size;
+    const ZipEntryStat& st = _archiveHandle->entryStat(_entry);
+    return size == st.uncompSize && _archiveHandle->extract(_entry, dst);
+}
+
+// The archive may have been changed on disk while it was closed, then look up the entry again.
+// Does not reopen the archive, so this notices changes only after the next openRead().
+bool ZipFile::_updateEntry()
+{
+    if(_generation == _archiveHandle->generation())
+        return true;
+    const size_t entry = _archiveHandle->findEntry(_entryName());
+    if(entry >= _archiveHandle->entries())
+        return false;
+    _entry = (unsigned int)entry;
+    _generation = _archiveHandle->generation();
+    delete _seeker; // was for the old data
+    _seeker = NULL;
+    return true;
+}
 
-    return (vfspos)zstat.m_uncomp_size;
+const char *ZipFile::_entryName() const
+{
+    return fullname() + strlen(_archiveHandle->fullname()) + 1;
 }
 
 bool ZipFile::unpack()
 {
     close(); // delete the buffer
 
-    const vfspos sz = size(); // will reopen the file
-    if(sz == npos)
+    if(!_archiveHandle->openRead())
+        return false;
+
+    if(!_updateEntry())
         return false;
 
+    const ZipEntryStat& st = _archiveHandle->entryStat(_entry);
+    const vfspos sz = st.uncompSize;
+
+    // Stored entries of in-memory archives are used in place, unless the data must be modified
+    if(_binary)
+        if(const void *p = _archiveHandle->getStoredEntryPtr(st))
+        {
+            if(!_archiveHandle->verify(_entry, p))
+                return false;
+            _data = (const char*)p;
+            _bufSize = sz;
+            return true;
+        }
+
+    _archiveHandle->prefetch(st);
+
     _buf = new char[size_t(sz) + 1];
     if(!_buf)
         return false;
 
-    if(!mz_zip_reader_extract_to_mem(MZ, _fileIdx, _buf, (size_t)sz, 0))
+    if(!_archiveHandle->extract(_entry, _buf))
     {
         delete [] _buf;
         _buf = NULL;
         return false; // this should not happen
     }
 
+    _data = _buf;
     _bufSize = sz;
 
     // In case of text data, make sure the buffer is always terminated with '\0'.
     // Won't hurt for binary data, so just do it in all cases.
     _buf[sz] = 0;
-    if(_mode.find("b") == std::string::npos) // text mode?
+    if(!_binary)
     {
         _bufSize = (vfspos)strnNLcpy(_buf, _buf);
     }
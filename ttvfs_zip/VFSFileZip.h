@@ -3,13 +3,17 @@
 
 #include "VFSFile.h"
 #include "VFSZipArchiveRef.h"
+#include "VFSZipInflate.h"
 
 VFS_NAMESPACE_START
 
+// Opened for writing, the data is buffered and handed to the archive on close() or flush(),
+// see ZipArchiveRef::addEntry(). Reading gives the buffered data while the file is open for writing,
+// and the old data after closing it, until the archive is committed.
 class ZipFile : public File
 {
 public:
-    ZipFile(const char *name, ZipArchiveRef *zref, unsigned int fileIdx);
+    ZipFile(const char *name, ZipArchiveRef *zref, size_t entry);
     virtual ~ZipFile();
     virtual bool open(const char *mode = NULL);
     virtual bool isopen() const;
@@ -20,18 +24,36 @@ public:
     virtual vfspos getpos() const;
     virtual size_t read(void *dst, size_t bytes);
     virtual size_t write(const void *src, size_t bytes);
+    virtual size_t readAt(vfspos offset, void *dst, size_t bytes);
+    virtual vfspos readAll(void *dst, size_t cap);
+    virtual const void *getMemory() const;
     virtual vfspos size();
+    virtual vfspos prepareBatch(const void *& container, vfspos& offset);
+    virtual bool readBatch(void *dst, size_t size);
     virtual const char *getType() const { return "ZipFile"; }
 
 protected:
     bool unpack();
+    bool _updateEntry();
+    const char *_entryName() const;
+    size_t _readWritten(vfspos offset, void *dst, size_t bytes);
+    InflateSeeker *_getSeeker();
+    static bool _readCompressed(vfspos ofs, void *dst, size_t bytes, void *user);
 
-    char *_buf;
+    char *_buf; // owned; NULL if _data points into the archive
+    const char *_data;
     vfspos _pos;
     CountedPtr<ZipArchiveRef> _archiveHandle;
     vfspos _bufSize;
-    unsigned int _fileIdx;
-    std::string _mode;
+    unsigned int _entry; // in the archive's index
+    unsigned int _generation; // of _entry, see ZipArchiveRef::generation()
+    InflateSeeker *_seeker; // for large deflated entries read piecewise, e.g. nested archives
+    vfspos _dataOfs; // of the compressed data in the archive, for _seeker
+    std::vector<char> _wbuf; // while writing
+    bool _writing;
+    bool _append;
+    bool _dirty; // _wbuf differs from the entry in the archive
+    bool _binary;
 };
 
 VFS_NAMESPACE_END
@@ -3,16 +3,37 @@
 #include "VFSDirZip.h"
 #include "VFSZipArchiveRef.h"
 
+#include <string.h>
+
 VFS_NAMESPACE_START
 
-Dir *VFSZipArchiveLoader::Load(File *arch, VFSLoader ** /*unused*/, void * /*unused*/)
+static void zipIndexSetup(void *p, void *arch, const char *id)
+{
+    if(strcmp(id, "zip"))
+        return;
+    VFSZipIndexParams *params = (VFSZipIndexParams*)p;
+    ((ZipArchiveRef*)arch)->usePrecomputedIndex(params->index, params->size);
+}
+
+VFSZipIndexParams::VFSZipIndexParams(const void *index_, size_t size_)
+: callback(zipIndexSetup)
+, index(index_)
+, size(size_)
+{
+}
+
+Dir *VFSZipArchiveLoader::Load(File *arch, VFSLoader ** /*unused*/, void *opaque)
 {
-    CountedPtr<ZipArchiveRef> zref = new ZipArchiveRef(arch);
+    CountedPtr<ZipArchiveRef> zref = new ZipArchiveRef(arch, _flags);
+    if(opaque)
+    {
+        // See VFSArchiveLoader.h
+        void (*callback)(void *, void *, const char *) = *(void (**)(void *, void *, const char *))opaque;
+        callback(opaque, zref.content(), "zip");
+    }
     if(!zref->init() || !zref->openRead())
         return NULL;
-    ZipDir *vd = new ZipDir(zref, arch->fullname(), true);
-    vd->load();
-    return vd;
+    return new ZipDir(zref, arch->fullname());
 }
 
 VFS_NAMESPACE_END
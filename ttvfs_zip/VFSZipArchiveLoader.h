@@ -2,15 +2,48 @@
 #define VFS_ZIP_ARCHIVE_LOADER_H
 
 #include "VFSArchiveLoader.h"
+#include <stddef.h>
 
 VFS_NAMESPACE_START
 
+// Pass this to Root::AddArchive() as 'opaque' to mount an archive with the index that ttvfs_gen -i made for it,
+// see ZipArchiveRef::usePrecomputedIndex(). The index must stay alive as long as the archive is mounted.
+// If it doesn't fit, the archive is loaded as usual.
+struct VFSZipIndexParams
+{
+    VFSZipIndexParams(const void *index, size_t size);
+
+    void (*callback)(void *, void *, const char *);
+    const void *index;
+    size_t size;
+};
+
 
 class VFSZipArchiveLoader : public VFSArchiveLoader
 {
 public:
+    enum Flags
+    {
+        // Map archives on disk into memory instead of reading them through their File.
+        // Falls back to normal reading if that fails.
+        MMAP = 0x01,
+
+        // Decompress large deflated entries with one thread per CPU.
+        // Uses more memory while decompressing; the result is the same.
+        PARALLEL_INFLATE = 0x02,
+
+        // When to check the CRC of extracted entries; the default is every time.
+        // Can be changed per archive, see ZipArchiveRef::setVerifyPolicy().
+        VERIFY_FIRST_READ = 0x04,
+        VERIFY_NEVER = 0x08
+    };
+
+    VFSZipArchiveLoader(unsigned int flags = 0) : _flags(flags) {}
     virtual ~VFSZipArchiveLoader() {}
     virtual Dir *Load(File *arch, VFSLoader **ldr, void *opaque = NULL);
+
+protected:
+    unsigned int _flags;
 };
 
 VFS_NAMESPACE_END
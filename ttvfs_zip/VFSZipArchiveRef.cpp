@@ -1,115 +1,925 @@
 #include "VFSInternal.h"
 #include "VFSZipArchiveRef.h"
+#include "VFSZipArchiveLoader.h"
+#include "VFSZipFormat.h"
+#include "VFSZipInflate.h"
+#include "VFSZipCrc.h"
+#include "VFSZipWriter.h"
+#include "VFSFileFuncs.h"
+#include "VFSTools.h"
 #include <stdio.h>
-#include "miniz.h"
+#include <algorithm>
 
 
 VFS_NAMESPACE_START
 
+// Size of blocks read from archives that are not in memory
+static const size_t ZIP_READ_BLOCK = 64 * 1024;
 
-static size_t zip_read_func(void *pOpaque, mz_uint64 file_ofs, void *pBuf, size_t n)
+static const unsigned int NO_ENTRY = ~0u;
+
+// Deflated entries larger than this (compressed) are not read into memory at once for extraction
+static const vfspos ZIP_WHOLE_INFLATE_MAX = 16 * 1024 * 1024;
+
+
+// Compares at most n chars. Must be consistent with the ordering of the index,
+// and should match the case sensitivity of the rest of the tree.
+static int zip_namecmp(const char *a, const char *b, size_t n)
 {
-    File *vf = (File*)pOpaque;
-    mz_int64 cur_ofs = vf->getpos();
-    if((mz_int64)file_ofs < 0)
-        return 0;
-    if(cur_ofs != (mz_int64)file_ofs && !vf->seek((vfspos)file_ofs, SEEK_SET))
-        return 0;
-    return vf->read(pBuf, n);
+    for( ; n; --n, ++a, ++b)
+    {
+        int ca = zipLowerChar((unsigned char)*a), cb = zipLowerChar((unsigned char)*b);
+        if(ca != cb || !ca)
+            return ca - cb;
+    }
+    return 0;
+}
+
+// FNV-1a, consistent with zip_namecmp()
+static unsigned int zip_namehash(const char *s)
+{
+    unsigned int h = 2166136261u;
+    for( ; *s; ++s)
+        h = (h ^ (unsigned int)zipLowerChar((unsigned char)*s)) * 16777619u;
+    return h;
+}
+
+struct IndexLess
+{
+    IndexLess(const char *names) : _names(names) {}
+    template <typename T> inline bool operator() (const T& a, const T& b) const
+    {
+        return zip_namecmp(_names + a.nameOfs, _names + b.nameOfs, size_t(-1)) < 0;
+    }
+    const char * const _names;
+};
+
+// Compares the name of an index entry with a prefix of known length.
+// Names are sorted, so names sharing a prefix form one contiguous range.
+struct PrefixLess
+{
+    PrefixLess(const char *names, size_t len) : _names(names), _len(len) {}
+    template <typename T> inline bool operator() (const T& e, const char *prefix) const
+    {
+        return zip_namecmp(_names + e.nameOfs, prefix, _len) < 0;
+    }
+    template <typename T> inline bool operator() (const char *prefix, const T& e) const
+    {
+        return zip_namecmp(prefix, _names + e.nameOfs, _len) < 0;
+    }
+    const char * const _names;
+    const size_t _len;
+};
+
+
+// Layout of a precomputed index: this header, then the IndexEntry array, the hash table and the names,
+// all exactly as they are in memory, so that the index can be used in place.
+// Made for one byte order and case sensitivity; the magic number also tells the byte order.
+struct ZipIndexHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int flags;
+    unsigned int entrySize;
+    unsigned int entries;
+    unsigned int hashSlots;
+    unsigned int namesSize;
+    unsigned int cdRecords;
+    unsigned int archiveSize[2]; // low, high
+    unsigned int cdOfs[2];
+    unsigned int cdSize[2];
+    unsigned int eocdOfs[2];
+};
+
+enum
+{
+    ZIP_INDEX_MAGIC = 0x58495a54, // "TZIX"
+    ZIP_INDEX_VERSION = 1,
+    ZIP_INDEX_IGNORE_CASE = 0x01
+};
+
+static inline vfspos zip_get64(const unsigned int *v)
+{
+    return (vfspos)(((unsigned long long)v[1] << 32) | v[0]);
+}
+
+static inline void zip_set64(unsigned int *v, vfspos x)
+{
+    v[0] = (unsigned int)x;
+    v[1] = (unsigned int)((unsigned long long)x >> 32);
 }
 
-static bool zip_reader_init_vfsfile(mz_zip_archive *pZip, File *vf, mz_uint32 flags)
+static inline unsigned int zip_indexFlags()
 {
-    mz_uint64 file_size = vf->size();
-    if(!file_size || !vf->open("rb"))
+#ifdef VFS_IGNORE_CASE
+    return ZIP_INDEX_IGNORE_CASE;
+#else
+    return 0;
+#endif
+}
+
+
+// Sequential access to a part of the archive while parsing.
+// Points into the archive if it is in memory, otherwise reads blocks into a buffer.
+class ZipWindow
+{
+public:
+    ZipWindow(File *vf, const void *mem, vfspos size)
+        : _vf(vf), _mem((const unsigned char*)mem), _size(size), _ofs(0), _len(0) {}
+
+    // Returns a pointer to len bytes at ofs, or NULL if they are not there
+    const unsigned char *get(vfspos ofs, size_t len)
     {
-        vf->close();
+        if(ofs > _size || (vfspos)len > _size - ofs)
+            return NULL;
+        if(_mem)
+            return _mem + (size_t)ofs;
+        if(ofs < _ofs || ofs + len > _ofs + _len)
+        {
+            const size_t want = (size_t)std::min<vfspos>(std::max(len, ZIP_READ_BLOCK), _size - ofs);
+            if(_buf.size() < want)
+                _buf.resize(want);
+            _ofs = ofs;
+            _len = _vf->readAt(ofs, &_buf[0], want);
+            if(_len < len)
+                return NULL;
+        }
+        return &_buf[(size_t)(ofs - _ofs)];
+    }
+
+private:
+    File *_vf;
+    const unsigned char *_mem;
+    const vfspos _size;
+    std::vector<unsigned char> _buf;
+    vfspos _ofs;
+    size_t _len;
+};
+
+
+ZipArchiveRef::ZipArchiveRef(File *file, unsigned int flags /* = 0 */)
+: archiveFile(file)
+, _flags(flags)
+, _mem(NULL)
+, _memSize(0)
+, _mapped(false)
+, _parsed(false)
+, _generation(0)
+, _stampSize(0)
+, _stampTime(0)
+, _idx(NULL)
+, _idxCount(0)
+, _idxNames(NULL)
+, _idxHash(NULL)
+, _idxHashSlots(0)
+, _pre(NULL)
+, _verifyPolicy(VERIFY_ALWAYS)
+, _cdOfs(0)
+, _cdSize(0)
+, _eocdOfs(0)
+, _cdRecords(0)
+, _zip64(false)
+, _pending(NULL)
+, _writeLevel(6)
+{
+    if(flags & VFSZipArchiveLoader::VERIFY_NEVER)
+        _verifyPolicy = VERIFY_NEVER;
+    else if(flags & VFSZipArchiveLoader::VERIFY_FIRST_READ)
+        _verifyPolicy = VERIFY_FIRST_READ;
+    memset(&_verifyStats, 0, sizeof(_verifyStats));
+}
+
+ZipArchiveRef::~ZipArchiveRef()
+{
+    close();
+    assert(!_pending && "Entries added to the archive could not be written");
+    delete _pending;
+}
+
+bool ZipArchiveRef::init()
+{
+    if(_acquire() && (_applyPrecomputed() || _parse()))
+        return true;
+    _release();
+    return false;
+}
+
+// Makes the archive readable, either in memory or via the file handle
+bool ZipArchiveRef::_acquire()
+{
+    // Archives that are in memory already are used in place
+    if(const void *p = archiveFile->getMemory())
+    {
+        const vfspos sz = archiveFile->size();
+        if(sz == npos || !sz)
+            return false;
+        _mem = p;
+        _memSize = (size_t)sz;
+        return true;
+    }
+    if(_map())
+        return true;
+    return archiveFile->isopen() || archiveFile->open("rb");
+}
+
+bool ZipArchiveRef::_map()
+{
+    if(!(_flags & VFSZipArchiveLoader::MMAP))
+        return false;
+    DiskFile *df = dynamic_cast<DiskFile*>(archiveFile.content());
+    if(!df)
+        return false;
+    const vfspos sz = df->size();
+    if(sz == npos || !sz || (vfspos)(size_t)sz != sz) // may not fit into the address space
+        return false;
+    if(!df->isopen() && !df->open("rb"))
         return false;
+
+    void *fh = df->pinFP();
+    void *p = fh ? real_mmap(fh, (size_t)sz) : NULL;
+    if(fh)
+        df->unpinFP();
+    df->close(); // the mapping doesn't need the file handle
+    if(!p)
+        return false;
+    _mem = p;
+    _memSize = (size_t)sz;
+    _mapped = true;
+
+    // Most accesses to an archive jump around, so don't read ahead everywhere.
+    // Sequential reads of single entries are requested in prefetch() instead,
+    // because flagging ranges separately would split up the mapping in the kernel.
+    real_madvise(_mem, _memSize, MEM_ADVICE_RANDOM);
+    return true;
+}
+
+void ZipArchiveRef::_release()
+{
+    // Closing a MemFile may free its memory, and it holds no OS resources anyway
+    if(_mem && !_mapped)
+        return;
+    if(_mapped)
+    {
+        real_munmap(const_cast<void*>(_mem), _memSize);
+        _mem = NULL;
+        _memSize = 0;
+        _mapped = false;
     }
-    pZip->m_pRead = zip_read_func;
-    pZip->m_pIO_opaque = vf;
-    if (!mz_zip_reader_init(pZip, file_size, flags))
+    archiveFile->close();
+}
+
+// (Re-)reads the central directory. The archive must have been acquired.
+bool ZipArchiveRef::_parse()
+{
+    _index.clear();
+    _names.clear();
+    _hash.clear();
+    _useOwnIndex();
+    _parsed = false;
     {
-        vf->close();
+        MutexLock lock(_verifyMutex);
+        _verified.clear();
+    }
+    ++_generation;
+
+    _getStamp(_stampSize, _stampTime);
+    const vfspos sz = _mem ? (vfspos)_memSize : _stampSize;
+    if(sz == npos || sz < ZIP_EOCD_SIZE || !_readCentralDir(sz))
+    {
+        _index.clear();
+        _names.clear();
+        _useOwnIndex();
         return false;
     }
+
+    // If a name exists more than once, the first entry wins.
+    if(!_index.empty())
+        std::stable_sort(_index.begin(), _index.end(), IndexLess(&_names[0]));
+    _useOwnIndex();
+    _buildHash();
+    _useOwnIndex();
+    _parsed = true;
+    return true;
+}
+
+// Resolves the zip64 extended information of a central dir entry.
+// Only the fields that are maxed out in the header are present, in this order.
+// Fields that can't be resolved stay maxed out.
+static void zip_read_zip64_extra(const unsigned char *extra, size_t len,
+    unsigned long long& uncomp, unsigned long long& comp, unsigned long long& ofs)
+{
+    while(len >= 4)
+    {
+        const unsigned int id = zipRead16(extra), size = zipRead16(extra + 2);
+        extra += 4;
+        len -= 4;
+        if(size > len)
+            return;
+        if(id == ZIP64_EXTRA_ID)
+        {
+            unsigned long long *fields[3] = { &uncomp, &comp, &ofs };
+            const unsigned char *p = extra;
+            for(unsigned int i = 0; i < 3 && p + 8 <= extra + size; ++i)
+                if(*fields[i] == 0xFFFFFFFF)
+                {
+                    *fields[i] = zipRead64(p);
+                    p += 8;
+                }
+            return;
+        }
+        extra += size;
+        len -= size;
+    }
+}
+
+// Streams the central directory into the index. Does the same sanity checks as miniz,
+// but also supports zip64 archives as long as single entries are < 4 GB.
+bool ZipArchiveRef::_readCentralDir(vfspos archiveSize)
+{
+    ZipWindow w(archiveFile.content(), _mem, archiveSize);
+
+    // The end of central dir record is followed by a comment of up to 64k
+    const size_t tail = (size_t)std::min<vfspos>(archiveSize, ZIP_EOCD_SIZE + 0xffff);
+    const unsigned char *p = w.get(archiveSize - tail, tail);
+    if(!p)
+        return false;
+    size_t eocdpos = tail;
+    for(size_t i = tail - ZIP_EOCD_SIZE + 1; i--; )
+        if(zipRead32(p + i) == ZIP_EOCD_SIG)
+        {
+            eocdpos = i;
+            break;
+        }
+    if(eocdpos == tail)
+        return false;
+    const unsigned char *eocd = p + eocdpos;
+    const vfspos eocdofs = archiveSize - tail + eocdpos;
+
+    unsigned int numDisk = zipRead16(eocd + ZIP_EOCD_NUM_DISK_OFS);
+    unsigned int cdirDisk = zipRead16(eocd + ZIP_EOCD_CDIR_DISK_OFS);
+    unsigned long long total = zipRead16(eocd + ZIP_EOCD_NUM_ENTRIES_OFS);
+    unsigned long long totalOnDisk = zipRead16(eocd + ZIP_EOCD_NUM_ENTRIES_ON_DISK_OFS);
+    unsigned long long cdsize = zipRead32(eocd + ZIP_EOCD_CDIR_SIZE_OFS);
+    unsigned long long cdofs = zipRead32(eocd + ZIP_EOCD_CDIR_OFS_OFS);
+    _zip64 = false;
+
+    // Zip64 archives have the real values in another record, found via a locator in front of this one
+    if(total == 0xFFFF || cdsize == 0xFFFFFFFF || cdofs == 0xFFFFFFFF)
+    {
+        const unsigned char *loc = eocdofs >= ZIP64_EOCDL_SIZE ? w.get(eocdofs - ZIP64_EOCDL_SIZE, ZIP64_EOCDL_SIZE) : NULL;
+        if(loc && zipRead32(loc) == ZIP64_EOCDL_SIG)
+        {
+            const unsigned long long recofs = zipRead64(loc + ZIP64_EOCDL_RECORD_OFS);
+            const unsigned char *rec = recofs < (unsigned long long)archiveSize ? w.get((vfspos)recofs, ZIP64_EOCD_SIZE) : NULL;
+            if(!rec || zipRead32(rec) != ZIP64_EOCD_SIG)
+                return false;
+            numDisk = zipRead32(rec + ZIP64_EOCD_NUM_DISK_OFS);
+            cdirDisk = zipRead32(rec + ZIP64_EOCD_CDIR_DISK_OFS);
+            total = zipRead64(rec + ZIP64_EOCD_NUM_ENTRIES_OFS);
+            totalOnDisk = zipRead64(rec + ZIP64_EOCD_NUM_ENTRIES_ON_DISK_OFS);
+            cdsize = zipRead64(rec + ZIP64_EOCD_CDIR_SIZE_OFS);
+            cdofs = zipRead64(rec + ZIP64_EOCD_CDIR_OFS_OFS);
+            _zip64 = true;
+        }
+    }
+
+    if(total != totalOnDisk || total >= NO_ENTRY)
+        return false;
+    if(((numDisk | cdirDisk) != 0) && (numDisk != 1 || cdirDisk != 1)) // no multi-disk archives
+        return false;
+    // Without additions that could wrap around with values from a zip64 record
+    const unsigned long long asize = (unsigned long long)archiveSize;
+    if(cdsize < total * ZIP_CDH_SIZE || cdofs > asize || cdsize > asize - cdofs)
+        return false;
+    _cdOfs = (vfspos)cdofs;
+    _cdSize = (vfspos)cdsize;
+    _eocdOfs = eocdofs;
+    _cdRecords = (size_t)total;
+
+    // Tell the OS to start reading the central directory of a mapped archive
+    if(_mapped)
+        real_madvise((const char*)_mem + cdofs, (size_t)cdsize, MEM_ADVICE_WILLNEED);
+
+    // Name lengths are the only unknown, this is an upper bound (+2 for '/' and '\0')
+    _index.reserve((size_t)total);
+    _names.reserve((size_t)(cdsize - total * (ZIP_CDH_SIZE - 2)));
+
+    vfspos ofs = (vfspos)cdofs;
+    const vfspos cdend = (vfspos)(cdofs + cdsize);
+    for(unsigned long long i = 0; i < total; ++i)
+    {
+        const unsigned char *h = w.get(ofs, ZIP_CDH_SIZE);
+        if(!h || zipRead32(h) != ZIP_CDH_SIG)
+            return false;
+        const unsigned int nameLen = zipRead16(h + ZIP_CDH_NAME_LEN_OFS);
+        const unsigned int extraLen = zipRead16(h + ZIP_CDH_EXTRA_LEN_OFS);
+        const vfspos hdrSize = ZIP_CDH_SIZE + nameLen + extraLen + zipRead16(h + ZIP_CDH_COMMENT_LEN_OFS);
+        if(ofs + hdrSize > cdend)
+            return false;
+        h = w.get(ofs, ZIP_CDH_SIZE + nameLen + extraLen); // all of it must be in the window at once
+        if(!h)
+            return false;
+        ofs += hdrSize;
+
+        const unsigned int method = zipRead16(h + ZIP_CDH_METHOD_OFS);
+        const unsigned int disk = zipRead16(h + ZIP_CDH_DISK_START_OFS);
+        const unsigned int bitFlags = zipRead16(h + ZIP_CDH_BIT_FLAG_OFS);
+        const bool isDir = (zipRead32(h + ZIP_CDH_EXTERNAL_ATTR_OFS) & ZIP_DOS_DIR_ATTRIB) != 0;
+        unsigned long long uncomp = zipRead32(h + ZIP_CDH_UNCOMP_SIZE_OFS);
+        unsigned long long comp = zipRead32(h + ZIP_CDH_COMP_SIZE_OFS);
+        unsigned long long hdrofs = zipRead32(h + ZIP_CDH_LOCAL_HEADER_OFS);
+        zip_read_zip64_extra(h + ZIP_CDH_SIZE + nameLen, extraLen, uncomp, comp, hdrofs);
+
+        if((method == ZIP_METHOD_STORED && uncomp != comp) || (uncomp && !comp))
+            return false;
+        if(disk != numDisk && disk != 0)
+            return false;
+        if(hdrofs > asize || asize - hdrofs < ZIP_LDH_SIZE || comp > asize - hdrofs - ZIP_LDH_SIZE)
+            return false;
+
+        if(bitFlags & (ZIP_FLAG_ENCRYPTED | ZIP_FLAG_STRONG_ENCRYPTION))
+            continue;
+        // Single entries must fit into memory, and into what the index can store
+        if(uncomp >= 0xFFFFFFFF || comp >= 0xFFFFFFFF || (hdrofs >> 48))
+            continue;
+
+        // Same path rules as everywhere else in the tree, and as zipIndexName()
+        const char *name = (const char*)h + ZIP_CDH_SIZE;
+        size_t n = nameLen;
+        while(n >= 2 && name[0] == '.' && (name[1] == '/' || name[1] == '\\'))
+        {
+            name += 2;
+            n -= 2;
+        }
+        if(!n)
+            continue;
+
+        const size_t nameOfs = _names.size();
+        _names.resize(nameOfs + n + 2);
+        char *dst = &_names[nameOfs];
+        for(size_t k = 0; k < n; ++k)
+            dst[k] = name[k] == '\\' ? '/' : name[k];
+        if(dst[n-1] != '/' && isDir)
+            dst[n++] = '/';
+        dst[n] = 0;
+        _names.resize(nameOfs + n + 1);
+
+        IndexEntry e;
+        e.nameOfs = (unsigned int)nameOfs;
+        e.st.method = (unsigned short)method;
+        e.st.crc32 = zipRead32(h + ZIP_CDH_CRC32_OFS);
+        e.st.compSize = (unsigned int)comp;
+        e.st.uncompSize = (unsigned int)uncomp;
+        e.st.localHeaderOfs = (unsigned int)hdrofs;
+        e.st.localHeaderOfsHi = (unsigned short)(hdrofs >> 32);
+        _index.push_back(e);
+    }
+
+    // Extra fields and comments were part of the estimate, give back the slack if worth it
+    if(_names.capacity() - _names.size() > _names.size() / 8)
+        std::vector<char>(_names).swap(_names);
+    if(_index.capacity() - _index.size() > _index.size() / 8)
+        std::vector<IndexEntry>(_index).swap(_index);
+    return true;
+}
+
+void ZipArchiveRef::_useOwnIndex()
+{
+    _idx = _index.empty() ? NULL : &_index[0];
+    _idxCount = _index.size();
+    _idxNames = _names.empty() ? NULL : &_names[0];
+    _idxHash = _hash.empty() ? NULL : &_hash[0];
+    _idxHashSlots = _hash.size();
+}
+
+bool ZipArchiveRef::usePrecomputedIndex(const void *data, size_t size)
+{
+    _pre = NULL;
+    if(!data || ((size_t)data & 3) || size < sizeof(ZipIndexHeader))
+        return false;
+    const ZipIndexHeader& h = *(const ZipIndexHeader*)data;
+    if(h.magic != ZIP_INDEX_MAGIC || h.version != ZIP_INDEX_VERSION
+        || h.entrySize != sizeof(IndexEntry) || h.flags != zip_indexFlags())
+        return false;
+    // Same rules as _buildHash(): a power of 2, with at least one free slot
+    if((h.hashSlots & (h.hashSlots - 1)) || (h.entries ? h.hashSlots <= h.entries : h.hashSlots != 0))
+        return false;
+    const unsigned long long need = sizeof(ZipIndexHeader) + (unsigned long long)h.entries * sizeof(IndexEntry)
+        + (unsigned long long)h.hashSlots * sizeof(unsigned int) + h.namesSize;
+    if(need != size || (h.entries && (!h.namesSize || ((const char*)data)[size - 1])))
+        return false;
+    _pre = &h;
     return true;
 }
 
-static bool zip_reader_reopen_vfsfile(mz_zip_archive *pZip, mz_uint32 flags)
+// Takes the precomputed index if it matches the archive. That needs no more than a look at the end of central dir record.
+bool ZipArchiveRef::_applyPrecomputed()
 {
-    if(!(pZip && pZip->m_pIO_opaque && pZip->m_pRead))
+    if(!_pre)
+        return false;
+    const ZipIndexHeader& h = *_pre;
+    vfspos size, mtime;
+    _getStamp(size, mtime);
+    const vfspos eocdOfs = zip_get64(h.eocdOfs);
+    const vfspos cdOfs = zip_get64(h.cdOfs);
+    unsigned char eocd[ZIP_EOCD_SIZE];
+    if(size == npos || size != zip_get64(h.archiveSize) || eocdOfs + ZIP_EOCD_SIZE > size
+        || !_readAt(eocdOfs, eocd, ZIP_EOCD_SIZE) || zipRead32(eocd) != ZIP_EOCD_SIG)
         return false;
-    File *vf = (File*)pZip->m_pIO_opaque;
-    mz_uint64 file_size = vf->size();
-    if(!file_size)
+    const unsigned int eocdCdOfs = zipRead32(eocd + ZIP_EOCD_CDIR_OFS_OFS);
+    if(eocdCdOfs != 0xFFFFFFFF && eocdCdOfs != cdOfs)
+        return false;
+
+    _index.clear();
+    _names.clear();
+    _hash.clear();
     {
-        vf->close();
+        MutexLock lock(_verifyMutex);
+        _verified.clear();
+    }
+    ++_generation;
+    _stampSize = size;
+    _stampTime = mtime;
+    _cdOfs = cdOfs;
+    _cdSize = zip_get64(h.cdSize);
+    _eocdOfs = eocdOfs;
+    _cdRecords = h.cdRecords;
+    _zip64 = eocdCdOfs == 0xFFFFFFFF || zipRead16(eocd + ZIP_EOCD_NUM_ENTRIES_OFS) == 0xFFFF;
+
+    _idx = (const IndexEntry*)(_pre + 1);
+    _idxCount = h.entries;
+    _idxHash = (const unsigned int*)(_idx + h.entries);
+    _idxHashSlots = h.hashSlots;
+    _idxNames = (const char*)(_idxHash + h.hashSlots);
+    _parsed = true;
+    return true;
+}
+
+bool ZipArchiveRef::hasPrecomputedIndex() const
+{
+    return _pre && _idx == (const IndexEntry*)(_pre + 1);
+}
+
+bool ZipArchiveRef::exportIndex(std::vector<char>& out) const
+{
+    if(!_parsed)
         return false;
+    ZipIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = ZIP_INDEX_MAGIC;
+    h.version = ZIP_INDEX_VERSION;
+    h.flags = zip_indexFlags();
+    h.entrySize = sizeof(IndexEntry);
+    h.entries = (unsigned int)_idxCount;
+    h.hashSlots = (unsigned int)_idxHashSlots;
+    h.namesSize = hasPrecomputedIndex() ? _pre->namesSize : (unsigned int)_names.size();
+    h.cdRecords = (unsigned int)_cdRecords;
+    zip_set64(h.archiveSize, _mem ? (vfspos)_memSize : _stampSize);
+    zip_set64(h.cdOfs, _cdOfs);
+    zip_set64(h.cdSize, _cdSize);
+    zip_set64(h.eocdOfs, _eocdOfs);
+
+    const char *p = (const char*)&h;
+    out.insert(out.end(), p, p + sizeof(h));
+    p = (const char*)_idx;
+    out.insert(out.end(), p, p + _idxCount * sizeof(IndexEntry));
+    p = (const char*)_idxHash;
+    out.insert(out.end(), p, p + _idxHashSlots * sizeof(unsigned int));
+    out.insert(out.end(), _idxNames, _idxNames + h.namesSize);
+    return true;
+}
+
+// Open addressing with linear probing rather than a perfect hash: it is built in one pass, and the slots
+// of a probe sequence are adjacent in memory. Even at the highest load factor of 0.8, finding a name takes
+// about three probes on average, and a perfect hash would need a name compare as well, to reject
+// names that aren't in the archive. The table is exported as is with a precomputed index.
+void ZipArchiveRef::_buildHash()
+{
+    _hash.clear();
+    if(_index.empty())
+        return;
+    size_t slots = 16;
+    while(slots < _index.size() + _index.size() / 4)
+        slots <<= 1;
+    std::vector<unsigned int>(slots, NO_ENTRY).swap(_hash);
+
+    const size_t mask = slots - 1;
+    for(size_t i = 0; i < _index.size(); ++i)
+    {
+        // Equal names are adjacent after sorting; only the first one is reachable
+        if(i && !zip_namecmp(entryName(i - 1), entryName(i), size_t(-1)))
+            continue;
+        size_t slot = zip_namehash(entryName(i)) & mask;
+        while(_hash[slot] != NO_ENTRY)
+            slot = (slot + 1) & mask;
+        _hash[slot] = (unsigned int)i;
     }
-    if(!vf->isopen())
-        if(!vf->open("rb"))
+}
+
+// Cheap check whether the archive was changed, without reading it
+void ZipArchiveRef::_getStamp(vfspos& size, vfspos& mtime)
+{
+    size = archiveFile->size();
+    mtime = 0;
+    // Other kinds of files can't be modified behind our back
+    if(dynamic_cast<DiskFile*>(archiveFile.content()))
+        GetFileModTime(archiveFile->fullname(), mtime);
+}
+
+bool ZipArchiveRef::_readAt(vfspos ofs, void *dst, size_t bytes) const
+{
+    if(_mem)
+    {
+        if(ofs < 0 || ofs > (vfspos)_memSize || (vfspos)bytes > (vfspos)_memSize - ofs)
             return false;
-    if(pZip->m_zip_mode == MZ_ZIP_MODE_READING)
+        memcpy(dst, (const char*)_mem + ofs, bytes);
         return true;
-    if (!mz_zip_reader_init(pZip, file_size, flags))
+    }
+    MutexLock lock(_ioMutex);
+    File *vf = const_cast<File*>(archiveFile.content());
+    return vf->readAt(ofs, dst, bytes) == bytes;
+}
+
+// Finds the entry's data behind the local header
+bool ZipArchiveRef::_getDataOfs(const ZipEntryStat& st, vfspos& ofs) const
+{
+    unsigned char hdr[ZIP_LDH_SIZE];
+    if(!_readAt(st.headerOfs(), hdr, ZIP_LDH_SIZE) || zipRead32(hdr) != ZIP_LDH_SIG)
+        return false;
+    ofs = st.headerOfs() + ZIP_LDH_SIZE + zipRead16(hdr + ZIP_LDH_NAME_LEN_OFS) + zipRead16(hdr + ZIP_LDH_EXTRA_LEN_OFS);
+    const vfspos size = _mem ? (vfspos)_memSize : _stampSize;
+    return ofs + st.compSize <= size;
+}
+
+struct InflateChunks
+{
+    const ZipArchiveRef *ref;
+    vfspos dataOfs;
+};
+
+static bool readInflateChunk(vfspos ofs, void *dst, size_t bytes, void *user)
+{
+    const InflateChunks& src = *(const InflateChunks*)user;
+    return src.ref->readRaw(src.dataOfs + ofs, dst, bytes);
+}
+
+bool ZipArchiveRef::_inflate(vfspos ofs, const ZipEntryStat& st, void *dst) const
+{
+    if(!st.compSize)
+        return false;
+    const bool parallel = (_flags & VFSZipArchiveLoader::PARALLEL_INFLATE) != 0;
+    if(_mem)
+        return parallel
+            ? zipInflateParallel((const char*)_mem + ofs, st.compSize, dst, st.uncompSize)
+            : zipInflate((const char*)_mem + ofs, st.compSize, dst, st.uncompSize);
+
+    // Whole-buffer inflate is a lot faster than feeding the decompressor in pieces,
+    // but for large entries that would need as much memory again as the compressed size.
+    // Parallel inflate needs all of the input.
+    if(!parallel && st.compSize > ZIP_WHOLE_INFLATE_MAX)
     {
-        vf->close();
+        InflateChunks src = { this, ofs };
+        InflateSeeker seeker(st.compSize, st.uncompSize, readInflateChunk, &src, false, 0, st.uncompSize); // no checkpoints
+        return seeker.read(0, dst, st.uncompSize) == st.uncompSize;
+    }
+    std::vector<char> buf(st.compSize);
+    if(!_readAt(ofs, &buf[0], st.compSize))
+        return false;
+    return parallel
+        ? zipInflateParallel(&buf[0], st.compSize, dst, st.uncompSize)
+        : zipInflate(&buf[0], st.compSize, dst, st.uncompSize);
+}
+
+bool ZipArchiveRef::extract(size_t entry, void *dst)
+{
+    const ZipEntryStat& st = entryStat(entry);
+    vfspos ofs;
+    if(!_getDataOfs(st, ofs))
         return false;
+
+    bool ok;
+    switch(st.method)
+    {
+        case ZIP_METHOD_STORED:
+            ok = _readAt(ofs, dst, st.compSize);
+            break;
+        case ZIP_METHOD_DEFLATED:
+            ok = _inflate(ofs, st, dst);
+            break;
+        default:
+            ok = false;
     }
-    return true;
+    return ok && verify(entry, dst);
 }
 
+bool ZipArchiveRef::verify(size_t entry, const void *data)
+{
+    bool remember;
+    {
+        MutexLock lock(_verifyMutex);
+        remember = _verifyPolicy == VERIFY_FIRST_READ;
+        if(_verifyPolicy == VERIFY_NEVER || (remember && entry < _verified.size() && _verified[entry]))
+        {
+            ++_verifyStats.skipped;
+            return true;
+        }
+    }
 
+    const ZipEntryStat& st = entryStat(entry);
+    const bool ok = zipCrc32(0, data, st.uncompSize) == st.crc32;
 
+    MutexLock lock(_verifyMutex);
+    ++_verifyStats.checked;
+    if(!ok)
+        ++_verifyStats.failed;
+    else if(remember)
+    {
+        if(_verified.size() != entries())
+            _verified.resize(entries(), 0);
+        _verified[entry] = 1;
+    }
+    return ok;
+}
 
-ZipArchiveRef::ZipArchiveRef(File *file)
-: archiveFile(file)
+void ZipArchiveRef::setVerifyPolicy(VerifyPolicy policy)
 {
-    mz = new mz_zip_archive;
-    memset(mz, 0, sizeof(mz_zip_archive));
+    MutexLock lock(_verifyMutex);
+    _verifyPolicy = policy;
 }
 
-#define MZ ((mz_zip_archive*)mz)
+ZipArchiveRef::VerifyPolicy ZipArchiveRef::getVerifyPolicy() const
+{
+    MutexLock lock(_verifyMutex);
+    return _verifyPolicy;
+}
 
-ZipArchiveRef::~ZipArchiveRef()
+ZipVerifyStats ZipArchiveRef::verifyStats() const
 {
-    close();
-    delete MZ;
+    MutexLock lock(_verifyMutex);
+    return _verifyStats;
 }
 
-bool ZipArchiveRef::init()
+void ZipArchiveRef::prefetch(const ZipEntryStat& st)
 {
-    return zip_reader_init_vfsfile(MZ, archiveFile, 0);
+    // Not worth a syscall for small entries
+    if(!_mapped || st.compSize < (64 * 1024))
+        return;
+    const vfspos ofs = st.headerOfs();
+    if(ofs >= (vfspos)_memSize)
+        return;
+    const size_t len = std::min<size_t>(_memSize - (size_t)ofs, (size_t)ZIP_LDH_SIZE + 0x1ffff + st.compSize); // name + extra are up to 64k each
+    real_madvise((const char*)_mem + ofs, len, MEM_ADVICE_WILLNEED);
 }
 
-bool ZipArchiveRef::openRead()
+const void *ZipArchiveRef::getStoredEntryPtr(const ZipEntryStat& st) const
+{
+    // Mappings go away on close(), so only hand out memory that belongs to the archive file
+    if(!_mem || _mapped || st.method != ZIP_METHOD_STORED || st.compSize != st.uncompSize)
+        return NULL;
+    vfspos ofs;
+    if(!_getDataOfs(st, ofs))
+        return NULL;
+    return (const char*)_mem + ofs;
+}
+
+size_t ZipArchiveRef::findEntry(const char *path) const
 {
-    return zip_reader_reopen_vfsfile(MZ, 0);
+    if(!_idxHashSlots)
+        return entries();
+    const size_t mask = _idxHashSlots - 1;
+    for(size_t slot = zip_namehash(path) & mask; _idxHash[slot] != NO_ENTRY; slot = (slot + 1) & mask)
+        if(!zip_namecmp(entryName(_idxHash[slot]), path, size_t(-1)))
+            return _idxHash[slot];
+    return entries();
 }
 
-void ZipArchiveRef::close()
+size_t ZipArchiveRef::lowerBound(const char *prefix, size_t len) const
 {
-    switch(MZ->m_zip_mode)
+    if(!_idxCount)
+        return 0;
+    return std::lower_bound(_idx, _idx + _idxCount, prefix, PrefixLess(_idxNames, len)) - _idx;
+}
+
+size_t ZipArchiveRef::prefixEnd(size_t from, const char *prefix, size_t len) const
+{
+    if(from >= _idxCount)
+        return _idxCount;
+    return std::upper_bound(_idx + from, _idx + _idxCount, prefix, PrefixLess(_idxNames, len)) - _idx;
+}
+
+size_t ZipArchiveRef::indexMemory() const
+{
+    return _index.capacity() * sizeof(IndexEntry)
+        + _names.capacity()
+        + _hash.capacity() * sizeof(unsigned int);
+}
+
+bool ZipArchiveRef::openRead()
+{
+    // Nothing to do while the archive stays open; ZipFiles call this for every unpack
+    const bool reacquire = !_mem && !archiveFile->isopen();
+    if(reacquire && !_acquire())
+        return false;
+
+    if(_parsed)
     {
-        case MZ_ZIP_MODE_READING:
-            mz_zip_reader_end(MZ);
-            break;
+        if(!reacquire)
+            return true;
+        // The index from before close() is still good unless the archive was changed meanwhile
+        vfspos size, mtime;
+        _getStamp(size, mtime);
+        if(size == _stampSize && mtime == _stampTime)
+            return true;
+    }
 
-        case MZ_ZIP_MODE_WRITING:
-            mz_zip_writer_finalize_archive(MZ);
-            mz_zip_writer_end(MZ);
-            break;
+    if(_parse())
+        return true;
+    _release();
+    return false;
+}
 
-        case MZ_ZIP_MODE_WRITING_HAS_BEEN_FINALIZED:
-            mz_zip_writer_end(MZ);
-            break;
+bool ZipArchiveRef::close()
+{
+    const bool ok = commit();
+    _release(); // keep the index, see openRead()
+    return ok;
+}
+
+bool ZipArchiveRef::addEntry(const char *name, const void *data, size_t size)
+{
+    MutexLock lock(_writeMutex);
+    if(!_pending)
+        _pending = new ZipWriter(_writeLevel);
+    _pending->add(name, data, size);
+    return true;
+}
+
+bool ZipArchiveRef::addEntry(const char *name, std::vector<char>& data)
+{
+    MutexLock lock(_writeMutex);
+    if(!_pending)
+        _pending = new ZipWriter(_writeLevel);
+    _pending->take(name, data);
+    return true;
+}
+
+size_t ZipArchiveRef::pendingEntries() const
+{
+    MutexLock lock(_writeMutex);
+    return _pending ? _pending->count() : 0;
+}
 
-        case MZ_ZIP_MODE_INVALID:
-            break; // nothing to do
+void ZipArchiveRef::setCompressionLevel(int level)
+{
+    MutexLock lock(_writeMutex);
+    _writeLevel = level;
+}
+
+// The new entries are appended to the archive, followed by a copy of the old central directory
+// with the records of the new entries added. Nothing of the old archive is overwritten, so it stays
+// valid until the new end of central dir record is written; if writing fails, the file is truncated
+// back to its old size. The old directory is left behind as dead space.
+bool ZipArchiveRef::commit(unsigned int threads /* = 0 */)
+{
+    MutexLock lock(_writeMutex);
+    if(!_pending)
+        return true;
+    DiskFile *df = dynamic_cast<DiskFile*>(archiveFile.content());
+    if(!df || !openRead() || _zip64)
+        return false;
+
+    // Everything of the old archive that is written again
+    std::vector<char> cd((size_t)_cdSize + 1);
+    unsigned char eocd[ZIP_EOCD_SIZE];
+    if(!_readAt(_cdOfs, &cd[0], (size_t)_cdSize) || !_readAt(_eocdOfs, eocd, ZIP_EOCD_SIZE))
+        return false;
+    const vfspos archiveSize = _mem ? (vfspos)_memSize : _stampSize;
+    const size_t commentLen = (size_t)std::min<vfspos>(zipRead16(eocd + ZIP_EOCD_COMMENT_LEN_OFS), archiveSize - _eocdOfs - ZIP_EOCD_SIZE);
+    std::vector<char> comment(commentLen + 1);
+    if(!_readAt(_eocdOfs + ZIP_EOCD_SIZE, &comment[0], commentLen))
+        return false;
+    _pending->keep(archiveSize, &cd[0], (size_t)_cdSize, _cdRecords);
+    _pending->setComment(&comment[0], commentLen);
+    _pending->compress(threads);
+
+    _release();
+    bool ok = df->open("r+b");
+    if(ok)
+    {
+        ok = df->size() == archiveSize && df->seek(archiveSize, SEEK_SET) && _pending->write(df) && df->flush();
+        if(!ok)
+            df->truncate(archiveSize);
+    }
+    df->close();
+    if(ok)
+    {
+        delete _pending;
+        _pending = NULL;
     }
 
-    archiveFile->close();
+    // Whatever happened, the index must match what is on disk now
+    _parsed = false;
+    return openRead() && ok;
 }
 
 const char *ZipArchiveRef::fullname() const
@@ -120,4 +930,3 @@ const char *ZipArchiveRef::fullname() const
 
 
 VFS_NAMESPACE_END
-
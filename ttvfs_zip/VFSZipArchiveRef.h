@@ -2,27 +2,167 @@
 #define VFS_ZIP_ARCHIVE_REF
 
 #include "VFSFile.h"
+#include "VFSThreads.h"
+#include <vector>
 
 
 VFS_NAMESPACE_START
 
+class ZipWriter;
+struct ZipIndexHeader;
+
+// Per-entry data from the central directory, captured once when the index is built
+struct ZipEntryStat
+{
+    unsigned int localHeaderOfs; // low 32 bits
+    unsigned int compSize;
+    unsigned int uncompSize;
+    unsigned int crc32;
+    unsigned short method;
+    unsigned short localHeaderOfsHi; // for zip64 archives > 4 GB
+
+    inline vfspos headerOfs() const { return (vfspos)(((unsigned long long)localHeaderOfsHi << 32) | localHeaderOfs); }
+};
+
+// Counts CRC checks of extracted entries
+struct ZipVerifyStats
+{
+    unsigned int checked;
+    unsigned int skipped; // by the verify policy
+    unsigned int failed;
+};
+
 class ZipArchiveRef : public Refcounted
 {
 public:
-    ZipArchiveRef(File *archive);
+    enum VerifyPolicy
+    {
+        VERIFY_ALWAYS,
+        VERIFY_FIRST_READ, // each entry once, until the index is rebuilt
+        VERIFY_NEVER // for trusted data
+    };
+
+    ZipArchiveRef(File *archive, unsigned int flags = 0); // flags from VFSZipArchiveLoader
     ~ZipArchiveRef();
     bool openRead();
-    void close();
+    bool close(); // commits pending entries and releases the file handle, but keeps the index around. False if committing failed.
     bool init();
-    void *mz;
     const char *fullname() const;
 
+    // Decompresses a whole entry into dst, which must have room for its uncompSize bytes, and verifies it.
+    // Safe to call from multiple threads while the archive is open.
+    bool extract(size_t entry, void *dst);
+
+    // Checks an entry's data against its CRC, as far as the verify policy says so
+    bool verify(size_t entry, const void *data);
+    void setVerifyPolicy(VerifyPolicy policy);
+    VerifyPolicy getVerifyPolicy() const;
+    ZipVerifyStats verifyStats() const;
+
+    // Raw access, for entries that are read piecewise: where an entry's (compressed) data starts,
+    // behind its local header, and reading from the archive. Not verified.
+    inline bool dataOffset(const ZipEntryStat& st, vfspos& ofs) const { return _getDataOfs(st, ofs); }
+    inline bool readRaw(vfspos ofs, void *dst, size_t bytes) const { return _readAt(ofs, dst, bytes); }
+
+    // Hint that an entry is about to be extracted
+    void prefetch(const ZipEntryStat& st);
+
+    // For archives that are in memory anyway (see File::getMemory()):
+    // Pointer to the data of a stored entry, usable as long as this archive is alive.
+    // NULL if the entry is compressed or the archive is not in memory. Not verified.
+    const void *getStoredEntryPtr(const ZipEntryStat& st) const;
+
+    // Sorted name index over all usable entries, built by streaming the central directory once.
+    // ZipDir uses this to create its files and subdirs on demand.
+    // Functions returning an entry index return entries() if not found.
+    inline size_t entries() const { return _idxCount; }
+    inline const char *entryName(size_t i) const { return _idxNames + _idx[i].nameOfs; }
+    inline const ZipEntryStat& entryStat(size_t i) const { return _idx[i].st; }
+    size_t findEntry(const char *path) const; // hashed, exact match only
+    size_t lowerBound(const char *prefix, size_t len) const; // first entry with this prefix
+    size_t prefixEnd(size_t from, const char *prefix, size_t len) const; // first entry after 'from' without this prefix
+    size_t indexMemory() const; // bytes used by the index, names and hash table
+
+    // Precomputed index, as made by exportIndex() at build time (see ttvfs_gen -i).
+    // Call before init(), which then uses it in place instead of reading the central directory,
+    // if it was made for this archive; only a few header fields are checked, the rest is trusted.
+    // The data must stay alive as long as this object and be 4-byte aligned.
+    // Returns false if the index can't be used here (other format, byte order or case sensitivity).
+    bool usePrecomputedIndex(const void *data, size_t size);
+    bool exportIndex(std::vector<char>& out) const; // the current index, appended to 'out'
+    bool hasPrecomputedIndex() const; // whether init() took it
+
+    // Writing: added entries are kept in memory until the archive is committed or closed.
+    // Then they are compressed in parallel and appended to the archive, followed by a new central directory;
+    // an entry with the name of an existing one replaces it. Old data is never moved or overwritten,
+    // so replaced entries and the old directory leave dead space behind.
+    // If committing fails, the entries stay pending; those still pending when the archive is destroyed are lost.
+    // Only for archives on disk, without zip64. Must not be called while other threads read from this archive.
+    bool addEntry(const char *name, const void *data, size_t size);
+    bool addEntry(const char *name, std::vector<char>& data); // takes over the data
+    size_t pendingEntries() const;
+    bool commit(unsigned int threads = 0); // threads for compressing, 0: one per CPU. Rebuilds the index.
+    void setCompressionLevel(int level); // for entries added afterwards; 0-10, default 6
+
+    // Changes whenever the index is rebuilt because the archive was modified while closed.
+    // Entry stats and indices from an older generation are invalid.
+    inline unsigned int generation() const { return _generation; }
+
 protected:
+    bool _acquire();
+    bool _map();
+    void _release();
+    bool _parse();
+    bool _applyPrecomputed();
+    void _useOwnIndex();
+    bool _readCentralDir(vfspos archiveSize);
+    void _buildHash();
+    void _getStamp(vfspos& size, vfspos& mtime);
+    bool _getDataOfs(const ZipEntryStat& st, vfspos& ofs) const;
+    bool _readAt(vfspos ofs, void *dst, size_t bytes) const;
+    bool _inflate(vfspos ofs, const ZipEntryStat& st, void *dst) const;
+
+    struct IndexEntry
+    {
+        unsigned int nameOfs; // into _names
+        ZipEntryStat st;
+    };
+
     CountedPtr<File> archiveFile;
+    const unsigned int _flags;
+    const void *_mem; // whole archive, if in memory or mapped
+    size_t _memSize;
+    bool _mapped; // _mem is our own mapping
+    bool _parsed;
+    unsigned int _generation;
+    vfspos _stampSize, _stampTime; // archive state when the central directory was parsed
+    std::vector<IndexEntry> _index;
+    std::vector<char> _names; // all entry names, \0-separated
+    std::vector<unsigned int> _hash; // open addressing, indices into _index
+
+    // What the accessors use: the vectors above, or a precomputed index
+    const IndexEntry *_idx;
+    size_t _idxCount;
+    const char *_idxNames;
+    const unsigned int *_idxHash;
+    size_t _idxHashSlots;
+    const ZipIndexHeader *_pre;
+    mutable Mutex _ioMutex; // for reading through archiveFile, which is not thread-safe everywhere
+    mutable Mutex _verifyMutex; // for everything below
+    VerifyPolicy _verifyPolicy;
+    ZipVerifyStats _verifyStats;
+    std::vector<unsigned char> _verified; // per entry, with VERIFY_FIRST_READ
+
+    // Where the central directory was found by _parse(), for commit()
+    vfspos _cdOfs, _cdSize, _eocdOfs;
+    size_t _cdRecords; // including entries that are not in the index
+    bool _zip64;
+    mutable Mutex _writeMutex; // for everything below
+    ZipWriter *_pending;
+    int _writeLevel;
 };
 
 
 VFS_NAMESPACE_END
 
 #endif
-
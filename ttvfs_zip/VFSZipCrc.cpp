@@ -0,0 +1,206 @@
+// CRC-32 (reflected, polynomial 0xEDB88320) with hardware support where possible.
+
+#include "VFSInternal.h"
+#include "VFSZipCrc.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  define VFS_CRC_PCLMUL 1
+#  define VFS_CRC_TARGET __attribute__((target("pclmul,sse4.1")))
+#  include <wmmintrin.h>
+#  include <smmintrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#  define VFS_CRC_PCLMUL 1
+#  define VFS_CRC_TARGET
+#  include <intrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#  define VFS_CRC_ARM 1
+#  include <arm_acle.h>
+#endif
+
+VFS_NAMESPACE_START
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+
+struct CrcTables
+{
+    u32 t[8][256];
+
+    CrcTables()
+    {
+        for(u32 i = 0; i < 256; ++i)
+        {
+            u32 c = i;
+            for(int k = 0; k < 8; ++k)
+                c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for(u32 i = 0; i < 256; ++i)
+            for(int k = 1; k < 8; ++k)
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+    }
+};
+static const CrcTables s_tab;
+
+static inline u32 load32(const u8 *p)
+{
+    return u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);
+}
+
+// Works on the inverted CRC
+static u32 crcSlice8(u32 crc, const u8 *p, size_t len)
+{
+    const u32 (*t)[256] = s_tab.t;
+    for( ; len >= 8; p += 8, len -= 8)
+    {
+        const u32 a = crc ^ load32(p);
+        const u32 b = load32(p + 4);
+        crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24]
+            ^ t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+    }
+    while(len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+unsigned int zipCrc32Scalar(unsigned int crc, const void *data, size_t len)
+{
+    return ~crcSlice8(~crc, (const u8*)data, len);
+}
+
+#if VFS_CRC_PCLMUL
+
+// Folds 64 bytes at a time with carry-less multiplication, then reduces to 32 bits
+// (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction").
+// len must be >= 64 and a multiple of 16.
+VFS_CRC_TARGET static u32 crcFold(u32 crc, const u8 *p, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi32(0x00000001, 0xc6e41596, 0x00000001, 0x54442bd4);
+    const __m128i k3k4 = _mm_set_epi32(0x00000000, 0xccaa009e, 0x00000001, 0x751997d0);
+    const __m128i k5 = _mm_set_epi32(0, 0, 0x00000001, 0x63cd6124);
+    const __m128i poly = _mm_set_epi32(0x00000001, 0xf7011641, 0x00000001, 0xdb710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)p);
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    p += 64;
+    len -= 64;
+
+    for( ; len >= 64; p += 64, len -= 64)
+    {
+        const __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        const __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        const __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        const __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)p));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 48)));
+    }
+
+    // Fold the four lanes into one
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x2);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x3);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x4);
+
+    for( ; len >= 16; p += 16, len -= 16)
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)),
+            _mm_loadu_si128((const __m128i*)p));
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (u32)_mm_extract_epi32(x1, 1);
+}
+
+static u32 crcPclmul(u32 crc, const u8 *p, size_t len)
+{
+    if(len >= 64)
+    {
+        const size_t n = len & ~size_t(15);
+        crc = crcFold(crc, p, n);
+        p += n;
+        len -= n;
+    }
+    return crcSlice8(crc, p, len);
+}
+
+static bool hasPclmul()
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 1)) && (info[2] & (1 << 19));
+#endif
+}
+
+#elif VFS_CRC_ARM
+
+static u32 crcArm(u32 crc, const u8 *p, size_t len)
+{
+    for( ; len && ((size_t)p & 7); --len)
+        crc = __crc32b(crc, *p++);
+    for( ; len >= 8; p += 8, len -= 8)
+    {
+        unsigned long long v;
+        memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+    }
+    while(len--)
+        crc = __crc32b(crc, *p++);
+    return crc;
+}
+
+#endif
+
+typedef u32 (*CrcFunc)(u32 crc, const u8 *p, size_t len);
+
+struct CrcImpl
+{
+    CrcFunc func;
+    const char *name;
+
+    CrcImpl() : func(crcSlice8), name("slice-by-8")
+    {
+#if VFS_CRC_PCLMUL
+        if(hasPclmul())
+        {
+            func = crcPclmul;
+            name = "pclmul";
+        }
+#elif VFS_CRC_ARM
+        func = crcArm;
+        name = "armv8-crc";
+#endif
+    }
+};
+static const CrcImpl s_impl;
+
+unsigned int zipCrc32(unsigned int crc, const void *data, size_t len)
+{
+    return ~s_impl.func(~crc, (const u8*)data, len);
+}
+
+const char *zipCrc32Impl()
+{
+    return s_impl.name;
+}
+
+VFS_NAMESPACE_END
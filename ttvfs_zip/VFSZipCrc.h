@@ -0,0 +1,22 @@
+#ifndef VFS_ZIP_CRC_H
+#define VFS_ZIP_CRC_H
+
+#include "VFSDefines.h"
+#include <stddef.h>
+
+VFS_NAMESPACE_START
+
+// CRC-32 as used by zip. Same results as miniz' mz_crc32(); start with crc = 0.
+// Uses carry-less multiplication (x86 PCLMULQDQ, checked at runtime) or the ARMv8 CRC32
+// instructions (if enabled at compile time) where available.
+unsigned int zipCrc32(unsigned int crc, const void *data, size_t len);
+
+// Portable slice-by-8 version. For comparison.
+unsigned int zipCrc32Scalar(unsigned int crc, const void *data, size_t len);
+
+// Which version zipCrc32() uses
+const char *zipCrc32Impl();
+
+VFS_NAMESPACE_END
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef VFS_ZIP_FORMAT_H
+#define VFS_ZIP_FORMAT_H
+
+// Zip file format constants and little-endian helpers.
+// miniz keeps its own copies of these in its implementation part, so they are not visible from outside.
+
+#include "VFSDefines.h"
+#include <string>
+
+VFS_NAMESPACE_START
+
+enum ZipFormat
+{
+    ZIP_EOCD_SIG = 0x06054b50,
+    ZIP_CDH_SIG = 0x02014b50,
+    ZIP_LDH_SIG = 0x04034b50,
+    ZIP_EOCD_SIZE = 22,
+    ZIP_CDH_SIZE = 46,
+    ZIP_LDH_SIZE = 30,
+
+    // End of central directory record
+    ZIP_EOCD_NUM_DISK_OFS = 4,
+    ZIP_EOCD_CDIR_DISK_OFS = 6,
+    ZIP_EOCD_NUM_ENTRIES_ON_DISK_OFS = 8,
+    ZIP_EOCD_NUM_ENTRIES_OFS = 10,
+    ZIP_EOCD_CDIR_SIZE_OFS = 12,
+    ZIP_EOCD_CDIR_OFS_OFS = 16,
+    ZIP_EOCD_COMMENT_LEN_OFS = 20,
+
+    // Central directory header
+    ZIP_CDH_VERSION_MADE_BY_OFS = 4,
+    ZIP_CDH_VERSION_NEEDED_OFS = 6,
+    ZIP_CDH_BIT_FLAG_OFS = 8,
+    ZIP_CDH_METHOD_OFS = 10,
+    ZIP_CDH_FILE_TIME_OFS = 12,
+    ZIP_CDH_FILE_DATE_OFS = 14,
+    ZIP_CDH_CRC32_OFS = 16,
+    ZIP_CDH_COMP_SIZE_OFS = 20,
+    ZIP_CDH_UNCOMP_SIZE_OFS = 24,
+    ZIP_CDH_NAME_LEN_OFS = 28,
+    ZIP_CDH_EXTRA_LEN_OFS = 30,
+    ZIP_CDH_COMMENT_LEN_OFS = 32,
+    ZIP_CDH_DISK_START_OFS = 34,
+    ZIP_CDH_EXTERNAL_ATTR_OFS = 38,
+    ZIP_CDH_LOCAL_HEADER_OFS = 42,
+
+    // Zip64 end of central directory locator, right before the end of central dir record
+    ZIP64_EOCDL_SIG = 0x07064b50,
+    ZIP64_EOCDL_SIZE = 20,
+    ZIP64_EOCDL_RECORD_OFS = 8,
+
+    // Zip64 end of central directory record
+    ZIP64_EOCD_SIG = 0x06064b50,
+    ZIP64_EOCD_SIZE = 56,
+    ZIP64_EOCD_NUM_DISK_OFS = 16,
+    ZIP64_EOCD_CDIR_DISK_OFS = 20,
+    ZIP64_EOCD_NUM_ENTRIES_ON_DISK_OFS = 24,
+    ZIP64_EOCD_NUM_ENTRIES_OFS = 32,
+    ZIP64_EOCD_CDIR_SIZE_OFS = 40,
+    ZIP64_EOCD_CDIR_OFS_OFS = 48,
+
+    // Zip64 extended information extra field
+    ZIP64_EXTRA_ID = 0x0001,
+
+    // Padding in a local header that aligns the data behind it, as written by Android's zipalign:
+    // the alignment as 16 bits, then zeros
+    ZIP_ALIGN_EXTRA_ID = 0xD935,
+    ZIP_ALIGN_EXTRA_MIN_SIZE = 6, // with the extra field header
+
+    // Local file header
+    ZIP_LDH_VERSION_NEEDED_OFS = 4,
+    ZIP_LDH_BIT_FLAG_OFS = 6,
+    ZIP_LDH_METHOD_OFS = 8,
+    ZIP_LDH_FILE_TIME_OFS = 10,
+    ZIP_LDH_FILE_DATE_OFS = 12,
+    ZIP_LDH_CRC32_OFS = 14,
+    ZIP_LDH_COMP_SIZE_OFS = 18,
+    ZIP_LDH_UNCOMP_SIZE_OFS = 22,
+    ZIP_LDH_NAME_LEN_OFS = 26,
+    ZIP_LDH_EXTRA_LEN_OFS = 28,
+
+    ZIP_FLAG_ENCRYPTED = 0x01,
+    ZIP_FLAG_STRONG_ENCRYPTION = 0x40,
+    ZIP_DOS_DIR_ATTRIB = 0x10,
+
+    ZIP_METHOD_STORED = 0,
+    ZIP_METHOD_DEFLATED = 8,
+
+    ZIP_VERSION_NEEDED = 20 // 2.0, for deflate
+};
+
+inline unsigned int zipRead16(const void *p)
+{
+    const unsigned char *b = (const unsigned char*)p;
+    return b[0] | (b[1] << 8);
+}
+
+inline unsigned int zipRead32(const void *p)
+{
+    const unsigned char *b = (const unsigned char*)p;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+}
+
+inline unsigned long long zipRead64(const void *p)
+{
+    const unsigned char *b = (const unsigned char*)p;
+    return zipRead32(b) | ((unsigned long long)zipRead32(b + 4) << 32);
+}
+
+inline void zipWrite16(void *p, unsigned int v)
+{
+    unsigned char *b = (unsigned char*)p;
+    b[0] = (unsigned char)v;
+    b[1] = (unsigned char)(v >> 8);
+}
+
+inline void zipWrite32(void *p, unsigned int v)
+{
+    unsigned char *b = (unsigned char*)p;
+    b[0] = (unsigned char)v;
+    b[1] = (unsigned char)(v >> 8);
+    b[2] = (unsigned char)(v >> 16);
+    b[3] = (unsigned char)(v >> 24);
+}
+
+inline int zipLowerChar(int c)
+{
+#ifdef VFS_IGNORE_CASE
+    if(c >= 'A' && c <= 'Z')
+        c += 'a' - 'A';
+#endif
+    return c;
+}
+
+// An entry name the way the archive index compares it: without leading "./", '/' as separator,
+// a trailing '/' for directories, and lowercase if the tree ignores case. Empty if the index skips it.
+inline std::string zipIndexName(const char *name, size_t len, bool isDir)
+{
+    while(len >= 2 && name[0] == '.' && (name[1] == '/' || name[1] == '\\'))
+    {
+        name += 2;
+        len -= 2;
+    }
+    std::string s(name, len);
+    for(size_t i = 0; i < len; ++i)
+        s[i] = s[i] == '\\' ? '/' : (char)zipLowerChar((unsigned char)s[i]);
+    if(len && isDir && s[len - 1] != '/')
+        s += '/';
+    return s;
+}
+
+VFS_NAMESPACE_END
+
+#endif
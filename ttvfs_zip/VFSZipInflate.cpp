@@ -0,0 +1,1188 @@
+// Whole-buffer inflate with a 64-bit bit buffer, two-level decode tables and wide match copies.
+// Anything it does not like is handed to tinfl, so that results (including errors) are always the same.
+// Large streams can also be split across threads, see zipInflateParallel().
+
+#include "VFSInternal.h"
+#include "VFSZipInflate.h"
+#include "VFSThreads.h"
+#include "VFSZipCrc.h"
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "miniz.h"
+
+VFS_NAMESPACE_START
+
+bool zipInflateTinfl(const void *src, size_t srcLen, void *dst, size_t dstLen)
+{
+    tinfl_decompressor inflator;
+    tinfl_init(&inflator);
+    size_t inLen = srcLen, outLen = dstLen;
+    const tinfl_status status = tinfl_decompress(&inflator, (const mz_uint8*)src, &inLen,
+        (mz_uint8*)dst, (mz_uint8*)dst, &outLen, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    return status == TINFL_STATUS_DONE && outLen == dstLen;
+}
+
+#if MINIZ_LITTLE_ENDIAN && MINIZ_HAS_64BIT_REGISTERS
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+// Table entries: bits to consume (0-4), extra bits (5-9), type (10-12), value (16-31).
+// Subtable links store the subtable's index bits as extra bits and its offset as value.
+enum EntryType
+{
+    E_LIT,
+    E_LEN, // or distance
+    E_EOB,
+    E_SUB,
+    E_BAD
+};
+
+enum
+{
+    LITLEN_BITS = 10,
+    DIST_BITS = 8,
+    CODELEN_BITS = 7,
+    MAX_CODE_LEN = 15,
+    // Worst case for the subtables is every other long code starting a new one
+    LITLEN_TABLE_SIZE = (1 << LITLEN_BITS) + (288 / 2) * (1 << (MAX_CODE_LEN - LITLEN_BITS)),
+    DIST_TABLE_SIZE = (1 << DIST_BITS) + (32 / 2) * (1 << (MAX_CODE_LEN - DIST_BITS)),
+    CODELEN_TABLE_SIZE = 1 << CODELEN_BITS,
+    // Fast loop needs: two refills, and room for two literals, the longest match and copy overshoot
+    FAST_IN_MARGIN = 16,
+    FAST_OUT_MARGIN = 2 + 258 + 8
+};
+
+static inline u32 mkentry(u32 type, u32 value, u32 extra) { return (value << 16) | (type << 10) | (extra << 5); }
+static inline u32 e_len(u32 e) { return e & 31; }
+static inline u32 e_extra(u32 e) { return (e >> 5) & 31; }
+static inline u32 e_type(u32 e) { return (e >> 10) & 7; }
+static inline u32 e_value(u32 e) { return e >> 16; }
+
+static const unsigned short s_lengthBase[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const u8 s_lengthExtra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const unsigned short s_distBase[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const u8 s_distExtra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+static const u8 s_codeLenOrder[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+enum TableKind { T_LITLEN, T_DIST, T_CODELEN };
+
+static inline u32 symEntry(TableKind kind, unsigned sym)
+{
+    switch(kind)
+    {
+        case T_LITLEN:
+            if(sym < 256)
+                return mkentry(E_LIT, sym, 0);
+            if(sym == 256)
+                return mkentry(E_EOB, 0, 0);
+            sym -= 257;
+            return sym < 29 ? mkentry(E_LEN, s_lengthBase[sym], s_lengthExtra[sym]) : mkentry(E_BAD, 0, 0);
+        case T_DIST:
+            return sym < 30 ? mkentry(E_LEN, s_distBase[sym], s_distExtra[sym]) : mkentry(E_BAD, 0, 0);
+        default:
+            return mkentry(E_LIT, sym, 0);
+    }
+}
+
+// Builds a two-level lookup table for canonical Huffman codes.
+// Rejects the same code length sets as tinfl: over-subscribed, or incomplete with more than one code.
+static bool buildTable(u32 *table, unsigned bits, size_t tableSize, const u8 *lens, unsigned n, TableKind kind)
+{
+    unsigned count[MAX_CODE_LEN + 1] = { 0 };
+    for(unsigned i = 0; i < n; ++i)
+        ++count[lens[i]];
+    count[0] = 0;
+
+    unsigned used = 0;
+    int left = 1;
+    unsigned next[MAX_CODE_LEN + 2];
+    next[1] = 0;
+    for(unsigned len = 1; len <= MAX_CODE_LEN; ++len)
+    {
+        used += count[len];
+        left = (left << 1) - (int)count[len];
+        if(left < 0)
+            return false;
+        next[len + 1] = (next[len] + count[len]) << 1;
+    }
+    if(left && used > 1)
+        return false;
+
+    const u32 primary = 1u << bits, mask = primary - 1;
+    const u32 bad = mkentry(E_BAD, 0, 0);
+    for(u32 i = 0; i < primary; ++i)
+        table[i] = bad;
+
+    // Codes longer than the primary table go to subtables, one per prefix, sized for the longest code
+    u8 subLen[1 << LITLEN_BITS];
+    memset(subLen, 0, primary);
+    u32 codes[288];
+    for(unsigned sym = 0; sym < n; ++sym)
+    {
+        const unsigned len = lens[sym];
+        if(!len)
+            continue;
+        u32 code = next[len]++, rev = 0;
+        for(unsigned k = 0; k < len; ++k, code >>= 1)
+            rev = (rev << 1) | (code & 1);
+        codes[sym] = rev;
+        if(len > bits && subLen[rev & mask] < len - bits)
+            subLen[rev & mask] = (u8)(len - bits);
+    }
+
+    size_t pos = primary;
+    for(u32 i = 0; i < primary; ++i)
+        if(subLen[i])
+        {
+            if(pos + (1u << subLen[i]) > tableSize)
+                return false;
+            table[i] = mkentry(E_SUB, (u32)pos, subLen[i]) | bits;
+            for(u32 k = 0; k < (1u << subLen[i]); ++k)
+                table[pos + k] = bad;
+            pos += 1u << subLen[i];
+        }
+
+    for(unsigned sym = 0; sym < n; ++sym)
+    {
+        const unsigned len = lens[sym];
+        if(!len)
+            continue;
+        const u32 e = symEntry(kind, sym);
+        const u32 rev = codes[sym];
+        if(len <= bits)
+        {
+            for(u32 i = rev; i < primary; i += 1u << len)
+                table[i] = e | len;
+        }
+        else
+        {
+            const u32 link = table[rev & mask];
+            const u32 sub = e_value(link), subBits = e_extra(link), remLen = len - bits;
+            for(u32 i = rev >> bits; i < (1u << subBits); i += 1u << remLen)
+                table[sub + i] = e | remLen;
+        }
+    }
+    return true;
+}
+
+// Copies a match of len bytes from dist bytes back. May write up to 8 bytes past the end.
+static inline void copyMatch(u8 *out, size_t dist, u32 len)
+{
+    const u8 *src = out - dist;
+    u8 *dst = out;
+    u8 * const end = out + len;
+    if(dist >= 8)
+    {
+        // Overlapping is fine, every 8 byte chunk is read after the data it needs was written
+        do
+        {
+            u64 v;
+            memcpy(&v, src, 8);
+            memcpy(dst, &v, 8);
+            src += 8;
+            dst += 8;
+        }
+        while(dst < end);
+    }
+    else if(dist == 1)
+        memset(dst, *src, len);
+    else
+        do
+            *dst++ = *src++;
+        while(dst < end);
+}
+
+// Bit input and decode tables, shared by the decoders below
+class HuffmanInput
+{
+protected:
+    HuffmanInput(const u8 *src, size_t srcLen)
+        : _inStart(src), _in(src), _inEnd(src + srcLen), _bb(0), _bc(0), _overrun(0), _eobLen(0)
+    {}
+
+    // Makes sure there are at least 56 bits in the bit buffer.
+    // Past the end of the input, zeros are shifted in and counted; it's an error if they get used.
+    inline void refill()
+    {
+        if(_inEnd - _in >= 8)
+        {
+            u64 v;
+            memcpy(&v, _in, 8);
+            _bb |= v << _bc;
+            _in += (63 - _bc) >> 3;
+            _bc |= 56;
+        }
+        else
+            while(_bc < 56)
+            {
+                if(_in < _inEnd)
+                    _bb |= (u64)*_in++ << _bc;
+                else
+                    ++_overrun;
+                _bc += 8;
+            }
+    }
+    inline u32 bits(unsigned n) const { return (u32)_bb & ((1u << n) - 1); }
+    inline void consume(unsigned n) { _bb >>= n; _bc -= n; }
+    inline bool overrun() const { return _overrun > (_bc >> 3); }
+
+    // Position of the next unused bit in the input
+    inline size_t bitPos() const { return (size_t)(_in - _inStart + _overrun) * 8 - _bc; }
+    void seek(size_t bit);
+
+    // Needs up to 15 bits in the bit buffer
+    inline u32 decode(const u32 *table, unsigned tableBits)
+    {
+        u32 e = table[bits(tableBits)];
+        if(e_type(e) == E_SUB)
+        {
+            consume(tableBits);
+            e = table[e_value(e) + bits(e_extra(e))];
+        }
+        consume(e_len(e));
+        return e;
+    }
+
+    bool fixedTables();
+    bool readDynamicTables();
+    const u8 *storedHeader(size_t& len); // returns the block's data, already skipped in the input
+
+    const u8 * const _inStart;
+    const u8 *_in;
+    const u8 * const _inEnd;
+    u64 _bb;
+    unsigned _bc;
+    size_t _overrun;
+    unsigned _eobLen; // code length of the end-of-block symbol in the last dynamic tables
+
+    u32 _litlen[LITLEN_TABLE_SIZE];
+    u32 _dist[DIST_TABLE_SIZE];
+};
+
+void HuffmanInput::seek(size_t bit)
+{
+    _in = _inStart + std::min<size_t>(bit >> 3, _inEnd - _inStart);
+    _overrun = 0;
+    _bb = 0;
+    _bc = 0;
+    refill();
+    consume(bit & 7);
+}
+
+bool HuffmanInput::fixedTables()
+{
+    u8 lens[288 + 32];
+    memset(lens, 8, 144);
+    memset(lens + 144, 9, 112);
+    memset(lens + 256, 7, 24);
+    memset(lens + 280, 8, 8);
+    memset(lens + 288, 5, 32);
+    return buildTable(_litlen, LITLEN_BITS, LITLEN_TABLE_SIZE, lens, 288, T_LITLEN)
+        && buildTable(_dist, DIST_BITS, DIST_TABLE_SIZE, lens + 288, 32, T_DIST);
+}
+
+bool HuffmanInput::readDynamicTables()
+{
+    refill();
+    const unsigned hlit = bits(5) + 257;
+    const unsigned hdist = ((u32)(_bb >> 5) & 31) + 1;
+    const unsigned hclen = ((u32)(_bb >> 10) & 15) + 4;
+    consume(14);
+
+    u8 cl[19] = { 0 };
+    for(unsigned i = 0; i < hclen; ++i)
+    {
+        if(_bc < 3)
+            refill();
+        cl[s_codeLenOrder[i]] = (u8)bits(3);
+        consume(3);
+    }
+    u32 cltable[CODELEN_TABLE_SIZE];
+    if(!buildTable(cltable, CODELEN_BITS, CODELEN_TABLE_SIZE, cl, 19, T_CODELEN))
+        return false;
+
+    u8 lens[288 + 32];
+    const unsigned total = hlit + hdist;
+    for(unsigned i = 0; i < total; )
+    {
+        refill(); // at most 7 + 7 bits per round
+        const u32 e = decode(cltable, CODELEN_BITS);
+        if(e_type(e) == E_BAD)
+            return false;
+        const unsigned sym = e_value(e);
+        if(sym < 16)
+        {
+            lens[i++] = (u8)sym;
+            continue;
+        }
+        unsigned rep;
+        u8 val = 0;
+        if(sym == 16)
+        {
+            if(!i)
+                return false;
+            val = lens[i - 1];
+            rep = 3 + bits(2);
+            consume(2);
+        }
+        else if(sym == 17)
+        {
+            rep = 3 + bits(3);
+            consume(3);
+        }
+        else
+        {
+            rep = 11 + bits(7);
+            consume(7);
+        }
+        if(rep > total - i)
+            return false;
+        memset(lens + i, val, rep);
+        i += rep;
+    }
+    if(overrun())
+        return false;
+
+    _eobLen = lens[256];
+    return buildTable(_litlen, LITLEN_BITS, LITLEN_TABLE_SIZE, lens, hlit, T_LITLEN)
+        && buildTable(_dist, DIST_BITS, DIST_TABLE_SIZE, lens + hlit, hdist, T_DIST);
+}
+
+const u8 *HuffmanInput::storedHeader(size_t& len)
+{
+    // Back to byte boundary, and return unused whole bytes to the input
+    consume(_bc & 7);
+    size_t back = _bc >> 3;
+    if(_overrun > back)
+        return NULL;
+    back -= _overrun;
+    _in -= back;
+    _overrun = 0;
+    _bb = 0;
+    _bc = 0;
+
+    if(_inEnd - _in < 4)
+        return NULL;
+    len = _in[0] | (_in[1] << 8);
+    const size_t nlen = _in[2] | (_in[3] << 8);
+    _in += 4;
+    if(len != (~nlen & 0xffff) || (size_t)(_inEnd - _in) < len)
+        return NULL;
+    const u8 *data = _in;
+    _in += len;
+    return data;
+}
+
+class Inflater : public HuffmanInput
+{
+public:
+    Inflater(const u8 *src, size_t srcLen, u8 *dst, size_t dstLen)
+        : HuffmanInput(src, srcLen), _outStart(dst), _out(dst), _outEnd(dst + dstLen), _ownBuffer(false), _final(false)
+    {}
+    ~Inflater() { if(_ownBuffer) delete [] _outStart; }
+
+    // Decodes blocks until the end of the final block, or until the input position reaches 'stop'
+    bool run(size_t stop = (size_t)-1);
+
+    inline size_t produced() const { return _out - _outStart; }
+    inline bool ended() const { return _final; }
+
+protected:
+    unsigned blockHeader(); // returns the block type
+    bool storedBlock();
+    bool huffmanBlock();
+    bool grow(size_t bytes); // makes room for more output, if the buffer is our own
+
+    u8 *_outStart;
+    u8 *_out;
+    u8 *_outEnd;
+    bool _ownBuffer;
+    bool _final;
+};
+
+unsigned Inflater::blockHeader()
+{
+    refill();
+    _final = bits(1) != 0;
+    const unsigned type = (u32)(_bb >> 1) & 3;
+    consume(3);
+    return type;
+}
+
+bool Inflater::run(size_t stop)
+{
+    do
+    {
+        bool ok;
+        switch(blockHeader())
+        {
+            case 0:
+                ok = storedBlock();
+                break;
+            case 1:
+                ok = fixedTables() && huffmanBlock();
+                break;
+            case 2:
+                ok = readDynamicTables() && huffmanBlock();
+                break;
+            default:
+                ok = false;
+        }
+        if(!ok || overrun())
+            return false;
+    }
+    while(!_final && bitPos() < stop);
+
+    return _final || bitPos() == stop;
+}
+
+bool Inflater::grow(size_t bytes)
+{
+    if(!_ownBuffer)
+        return false;
+    const size_t used = _out - _outStart;
+    const size_t cap = std::max<size_t>((_outEnd - _outStart) * 2, used + bytes + FAST_OUT_MARGIN);
+    u8 *buf = new u8[cap];
+    if(used)
+        memcpy(buf, _outStart, used);
+    delete [] _outStart;
+    _outStart = buf;
+    _out = buf + used;
+    _outEnd = buf + cap;
+    return true;
+}
+
+bool Inflater::storedBlock()
+{
+    size_t len;
+    const u8 *data = storedHeader(len);
+    if(!data || ((size_t)(_outEnd - _out) < len && !grow(len)))
+        return false;
+    memcpy(_out, data, len);
+    _out += len;
+    return true;
+}
+
+bool Inflater::huffmanBlock()
+{
+    for(;;)
+    {
+        // Fast loop: no bounds checks except for distances, since there is plenty of room on both sides
+        while(_inEnd - _in >= FAST_IN_MARGIN && _outEnd - _out >= FAST_OUT_MARGIN)
+        {
+            refill();
+            u32 e = decode(_litlen, LITLEN_BITS);
+            if(e_type(e) == E_LIT)
+            {
+                *_out++ = (u8)e_value(e);
+                // 56 bits were enough for three literals
+                e = decode(_litlen, LITLEN_BITS);
+                if(e_type(e) == E_LIT)
+                {
+                    *_out++ = (u8)e_value(e);
+                    e = decode(_litlen, LITLEN_BITS);
+                    if(e_type(e) == E_LIT)
+                    {
+                        *_out++ = (u8)e_value(e);
+                        continue;
+                    }
+                }
+                if(e_type(e) != E_LEN)
+                    goto other; // needs no further bits
+                refill();
+            }
+            else if(e_type(e) != E_LEN)
+                goto other;
+
+            {
+                // Length (up to 15 + 5 bits) and distance (up to 15 + 13 bits) fit into 56
+                const u32 len = e_value(e) + bits(e_extra(e));
+                consume(e_extra(e));
+                const u32 d = decode(_dist, DIST_BITS);
+                if(e_type(d) != E_LEN)
+                    return false;
+                const size_t dist = e_value(d) + bits(e_extra(d));
+                consume(e_extra(d));
+                if(dist > (size_t)(_out - _outStart))
+                    return false;
+                copyMatch(_out, dist, len);
+                _out += len;
+            }
+            continue;
+
+        other:
+            if(e_type(e) == E_EOB)
+                return true;
+            return false;
+        }
+
+        // Slow path near the ends of the buffers
+        refill();
+        const u32 e = decode(_litlen, LITLEN_BITS);
+        if(overrun())
+            return false;
+        switch(e_type(e))
+        {
+            case E_LIT:
+                if(_out == _outEnd && !grow(1))
+                    return false;
+                *_out++ = (u8)e_value(e);
+                break;
+
+            case E_EOB:
+                return true;
+
+            case E_LEN:
+            {
+                refill();
+                const u32 len = e_value(e) + bits(e_extra(e));
+                consume(e_extra(e));
+                refill();
+                const u32 d = decode(_dist, DIST_BITS);
+                if(e_type(d) != E_LEN)
+                    return false;
+                refill();
+                const size_t dist = e_value(d) + bits(e_extra(d));
+                consume(e_extra(d));
+                if(overrun() || dist > (size_t)(_out - _outStart))
+                    return false;
+                if(len > (size_t)(_outEnd - _out) && !grow(len))
+                    return false;
+                const u8 *src = _out - dist;
+                for(u32 i = 0; i < len; ++i)
+                    _out[i] = src[i];
+                _out += len;
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+}
+
+bool zipInflate(const void *src, size_t srcLen, void *dst, size_t dstLen)
+{
+    Inflater *inf = new Inflater((const u8*)src, srcLen, (u8*)dst, dstLen);
+    const bool ok = inf->run() && inf->produced() == dstLen;
+    delete inf;
+    return ok || zipInflateTinfl(src, srcLen, dst, dstLen);
+}
+
+// ---- Parallel decoding ----
+// The input is split into chunks. Each chunk but the first searches its part of the input for
+// something that looks like the start of a dynamic Huffman block, and decodes from there without
+// knowing the preceding 32K of output: back-references into it are stored as markers.
+// A chunk's result is only used if the previous chunk ended exactly where it started,
+// so every block is decoded exactly as a serial decoder would. The markers are resolved
+// once all chunks are done and their position in the output is known.
+
+enum
+{
+    WINDOW = 32768, // largest distance
+    MIN_CHUNK = 1024 * 1024, // compressed bytes per thread, below that it's not worth it
+    SEARCH_LIMIT = 1024 * 1024 // bytes to search for the start of a chunk; blocks are much smaller
+};
+
+static inline u64 load64(const u8 *p, const u8 *end)
+{
+    u64 v = 0;
+    if(end - p >= 8)
+        memcpy(&v, p, 8);
+    else
+        memcpy(&v, p, end - p);
+    return v;
+}
+
+// Decodes a part of a deflate stream that starts at a block boundary, but not at the start of the stream
+class ChunkInflater : public Inflater
+{
+public:
+    ChunkInflater(const u8 *src, size_t srcLen)
+        : Inflater(src, srcLen, NULL, 0), _wbuf(NULL), _wout(NULL), _wend(NULL), _wcheck(NULL), _sizeHint(0), _minMarker(WINDOW), _narrow(false)
+    {
+        _ownBuffer = true;
+    }
+    ~ChunkInflater() { delete [] _wbuf; }
+
+    // First bit position in [from, to) where a dynamic block starts that can be decoded completely
+    bool findStart(size_t from, size_t to, size_t& start);
+
+    // Decodes blocks from 'start' until reaching 'stop' or the end of the final block
+    bool run(size_t start, size_t stop);
+
+    inline size_t size() const { return (_wout - _wbuf) + produced(); }
+    // Whether the chunk can be placed at this output position
+    inline bool fits(size_t base) const { return _minMarker == WINDOW || base + _minMarker >= WINDOW; }
+    // Copies output [from, to) of this chunk to dst + base + from.
+    // Markers are taken from the WINDOW bytes before dst + base, which must be final.
+    void write(u8 *dst, size_t base, size_t from, size_t to) const;
+
+private:
+    void reset();
+    bool wideBlock();
+    bool wideStored();
+    bool wideHuffman();
+    void ensureWide(size_t n);
+    bool checkNarrow();
+
+    // Output is kept as 16-bit symbols (bytes, or 256 + window position for markers)
+    // as long as markers may be referenced, then continues as bytes in the Inflater's buffer.
+    u16 *_wbuf, *_wout, *_wend;
+    u16 *_wcheck; // where to look for markers again
+    size_t _sizeHint; // expected output size
+    size_t _minMarker; // lowest window position referenced
+    bool _narrow;
+};
+
+void ChunkInflater::reset()
+{
+    _wout = _wbuf;
+    _wcheck = _wbuf + WINDOW;
+    _out = _outStart;
+    _minMarker = WINDOW;
+    _narrow = false;
+    _final = false;
+}
+
+void ChunkInflater::ensureWide(size_t n)
+{
+    if((size_t)(_wend - _wout) >= n)
+        return;
+    const size_t used = _wout - _wbuf, check = _wcheck - _wbuf;
+    const size_t cap = std::max<size_t>((_wend - _wbuf) * 2, std::max<size_t>(used + n, 4 * WINDOW));
+    u16 *buf = new u16[cap];
+    if(used)
+        memcpy(buf, _wbuf, used * sizeof(u16));
+    delete [] _wbuf;
+    _wbuf = buf;
+    _wout = buf + used;
+    _wend = buf + cap;
+    _wcheck = buf + check;
+}
+
+// Once the last WINDOW symbols are free of markers, nothing can refer to markers anymore
+bool ChunkInflater::checkNarrow()
+{
+    if(_wout < _wcheck)
+        return false;
+    u32 any = 0;
+    for(const u16 *p = _wout - WINDOW; p < _wout; ++p)
+        any |= *p;
+    if(any >= 256)
+    {
+        _wcheck = _wout + WINDOW / 4;
+        return false;
+    }
+
+    // Move the last WINDOW symbols over, to have them at hand for the Inflater
+    if((size_t)(_outEnd - _outStart) < std::max<size_t>(_sizeHint, WINDOW + FAST_OUT_MARGIN))
+        grow(std::max<size_t>(_sizeHint, WINDOW + FAST_OUT_MARGIN));
+    _wout -= WINDOW;
+    for(size_t i = 0; i < WINDOW; ++i)
+        _out[i] = (u8)_wout[i];
+    _out += WINDOW;
+    _narrow = true;
+    return true;
+}
+
+bool ChunkInflater::findStart(size_t from, size_t to, size_t& start)
+{
+    // Streams without dynamic blocks (e.g. incompressible data) would be searched in vain
+    to = std::min<size_t>(std::min<size_t>(to, from + SEARCH_LIMIT * 8), (size_t)(_inEnd - _inStart) * 8);
+    _sizeHint = 0;
+    for(size_t byte = from >> 3; byte * 8 < to; ++byte)
+    {
+        const u64 v = load64(_inStart + byte, _inEnd);
+        for(unsigned b = 0; b < 8; ++b)
+        {
+            // Quick checks on the header: not final, dynamic, no more than 286 + 30 codes
+            const u32 h = (u32)(v >> b);
+            if((h & 7) != 4 || ((h >> 3) & 31) > 29 || ((h >> 8) & 31) > 29)
+                continue;
+            const size_t p = byte * 8 + b;
+            if(p < from || p >= to)
+                continue;
+
+            // The code length code must be complete, or have at most one code (like in buildTable())
+            const size_t q = p + 17;
+            const u64 cl = load64(_inStart + std::min<size_t>(q >> 3, _inEnd - _inStart), _inEnd) >> (q & 7);
+            const unsigned hclen = ((h >> 13) & 15) + 4;
+            static const u8 s_kraft[8] = { 0, 64, 32, 16, 8, 4, 2, 1 };
+            unsigned kraft = 0, used = 0;
+            for(unsigned i = 0; i < hclen; ++i)
+            {
+                const unsigned len = (unsigned)(cl >> (3 * i)) & 7;
+                kraft += s_kraft[len];
+                used += len != 0;
+            }
+            if(kraft > 128 || (kraft < 128 && used > 1))
+                continue;
+
+            seek(p + 3);
+            if(!readDynamicTables() || !_eobLen)
+                continue;
+            reset();
+            if(wideHuffman() && !overrun())
+            {
+                start = p;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool ChunkInflater::run(size_t start, size_t stop)
+{
+    reset();
+    seek(start);
+    // Deflate rarely gets below 1:4, and the buffer grows if needed
+    const size_t avail = (size_t)(_inEnd - _in);
+    _sizeHint = std::min<size_t>(stop == (size_t)-1 ? avail : (stop - start) >> 3, avail) * 4;
+    while(bitPos() < stop)
+    {
+        if(!wideBlock())
+            return false;
+        if(_final)
+            return true;
+    }
+    return bitPos() == stop;
+}
+
+bool ChunkInflater::wideBlock()
+{
+    bool ok;
+    switch(blockHeader())
+    {
+        case 0:
+            ok = _narrow ? storedBlock() : wideStored();
+            break;
+        case 1:
+            ok = fixedTables() && (_narrow ? huffmanBlock() : wideHuffman());
+            break;
+        case 2:
+            ok = readDynamicTables() && (_narrow ? huffmanBlock() : wideHuffman());
+            break;
+        default:
+            ok = false;
+    }
+    return ok && !overrun();
+}
+
+bool ChunkInflater::wideStored()
+{
+    size_t len;
+    const u8 *data = storedHeader(len);
+    if(!data)
+        return false;
+    ensureWide(len);
+    for(size_t i = 0; i < len; ++i)
+        _wout[i] = data[i];
+    _wout += len;
+    checkNarrow();
+    return true;
+}
+
+bool ChunkInflater::wideHuffman()
+{
+    for(;;)
+    {
+        if(_wout >= _wcheck && checkNarrow())
+            return huffmanBlock();
+        ensureWide(3 + 258);
+
+        refill();
+        if(_overrun && overrun())
+            return false;
+        u32 e = decode(_litlen, LITLEN_BITS);
+        if(e_type(e) == E_LIT)
+        {
+            // Same as in Inflater::huffmanBlock()
+            *_wout++ = (u16)e_value(e);
+            e = decode(_litlen, LITLEN_BITS);
+            if(e_type(e) == E_LIT)
+            {
+                *_wout++ = (u16)e_value(e);
+                e = decode(_litlen, LITLEN_BITS);
+                if(e_type(e) == E_LIT)
+                {
+                    *_wout++ = (u16)e_value(e);
+                    continue;
+                }
+            }
+            if(e_type(e) != E_LEN)
+                return e_type(e) == E_EOB;
+            refill();
+        }
+        else if(e_type(e) != E_LEN)
+            return e_type(e) == E_EOB;
+
+        const u32 len = e_value(e) + bits(e_extra(e));
+        consume(e_extra(e));
+        const u32 d = decode(_dist, DIST_BITS);
+        if(e_type(d) != E_LEN)
+            return false;
+        const size_t dist = e_value(d) + bits(e_extra(d));
+        consume(e_extra(d));
+
+        const size_t n = _wout - _wbuf;
+        u32 i = 0;
+        if(dist > n)
+        {
+            // Reaches back before the chunk
+            if(dist - n > WINDOW)
+                return false;
+            const size_t w = WINDOW - (dist - n);
+            _minMarker = std::min(_minMarker, w);
+            const u32 pre = (u32)std::min<size_t>(len, dist - n);
+            for( ; i < pre; ++i)
+                _wout[i] = (u16)(256 + w + i);
+        }
+        const u16 *src = _wbuf + (n + i - dist);
+        if(dist >= len)
+            memcpy(_wout + i, src, (len - i) * sizeof(u16));
+        else
+            for( ; i < len; ++i)
+                _wout[i] = *src++;
+        _wout += len;
+    }
+}
+
+void ChunkInflater::write(u8 *dst, size_t base, size_t from, size_t to) const
+{
+    const size_t nw = _wout - _wbuf;
+    for(size_t i = from; i < to && i < nw; ++i)
+    {
+        const u16 c = _wbuf[i];
+        dst[base + i] = c < 256 ? (u8)c : dst[base + c - 256 - WINDOW];
+    }
+    if(to > nw)
+    {
+        from = std::max(from, nw);
+        memcpy(dst + base + from, _outStart + (from - nw), to - from);
+    }
+}
+
+struct ChunkJob
+{
+    enum Phase { FIND, DECODE, WRITE };
+    Phase phase;
+    Inflater *first; // for DECODE of the first chunk, which writes to the destination directly
+    ChunkInflater *inf;
+    size_t from, to; // bits for FIND; start and stop bits for DECODE; output range for WRITE
+    bool ok;
+    u8 *dst;
+    size_t base;
+};
+
+static void runChunkJob(void *p)
+{
+    ChunkJob& j = *(ChunkJob*)p;
+    switch(j.phase)
+    {
+        case ChunkJob::FIND:
+            j.ok = j.inf->findStart(j.from, j.to, j.from);
+            break;
+        case ChunkJob::DECODE:
+            j.ok = j.first ? j.first->run(j.to) : j.inf->run(j.from, j.to);
+            break;
+        case ChunkJob::WRITE:
+            j.inf->write(j.dst, j.base, j.from, j.to);
+            break;
+    }
+}
+
+// Runs all jobs, the first one on the calling thread
+static void runChunkJobs(std::vector<ChunkJob>& jobs)
+{
+    if(jobs.empty())
+        return;
+    Thread *threads = new Thread[jobs.size()];
+    for(size_t i = 1; i < jobs.size(); ++i)
+        if(!threads[i].start(runChunkJob, &jobs[i]))
+            runChunkJob(&jobs[i]);
+    runChunkJob(&jobs[0]);
+    delete [] threads; // joins
+}
+
+static bool inflateChunks(const u8 *src, size_t srcLen, u8 *dst, size_t dstLen, std::vector<ChunkInflater*>& infs)
+{
+    const size_t n = infs.size() + 1;
+    const size_t chunkBits = (srcLen / n) * 8;
+
+    // Find where to start each chunk but the first
+    std::vector<ChunkJob> jobs(n - 1);
+    for(size_t i = 0; i < n - 1; ++i)
+    {
+        jobs[i].phase = ChunkJob::FIND;
+        jobs[i].first = NULL;
+        jobs[i].inf = infs[i];
+        jobs[i].from = (i + 1) * chunkBits;
+        jobs[i].to = (i + 2) * chunkBits;
+        jobs[i].ok = false;
+    }
+    runChunkJobs(jobs);
+    std::vector<size_t> starts;
+    std::vector<ChunkInflater*> used;
+    for(size_t i = 0; i < n - 1; ++i)
+        if(jobs[i].ok)
+        {
+            starts.push_back(jobs[i].from);
+            used.push_back(infs[i]);
+        }
+    const size_t m = used.size();
+    if(!m)
+        return false;
+
+    // Decode each chunk up to the start of the next one
+    Inflater first(src, srcLen, dst, dstLen);
+    jobs.resize(m + 1);
+    for(size_t i = 0; i <= m; ++i)
+    {
+        jobs[i].phase = ChunkJob::DECODE;
+        jobs[i].first = i ? NULL : &first;
+        jobs[i].inf = i ? used[i - 1] : NULL;
+        jobs[i].from = i ? starts[i - 1] : 0;
+        jobs[i].to = i < m ? starts[i] : (size_t)-1;
+        jobs[i].ok = false;
+    }
+    runChunkJobs(jobs);
+
+    // Chunks must line up exactly, only the last one may end the stream, and the sizes must add up
+    if(!jobs[0].ok || first.ended())
+        return false;
+    size_t base = first.produced();
+    std::vector<size_t> bases(m);
+    for(size_t i = 0; i < m; ++i)
+    {
+        const ChunkInflater *inf = used[i];
+        if(!jobs[i + 1].ok || inf->ended() != (i + 1 == m) || !inf->fits(base) || inf->size() > dstLen - base)
+            return false;
+        bases[i] = base;
+        base += inf->size();
+    }
+    if(base != dstLen)
+        return false;
+
+    // The last WINDOW bytes of each chunk first, in order, so that all markers can be resolved
+    for(size_t i = 0; i < m; ++i)
+    {
+        const size_t sz = used[i]->size();
+        used[i]->write(dst, bases[i], sz > WINDOW ? sz - WINDOW : 0, sz);
+    }
+    // Then the rest in parallel
+    jobs.resize(m);
+    for(size_t i = 0; i < m; ++i)
+    {
+        const size_t sz = used[i]->size();
+        jobs[i].phase = ChunkJob::WRITE;
+        jobs[i].inf = used[i];
+        jobs[i].dst = dst;
+        jobs[i].base = bases[i];
+        jobs[i].from = 0;
+        jobs[i].to = sz > WINDOW ? sz - WINDOW : 0;
+    }
+    runChunkJobs(jobs);
+    return true;
+}
+
+bool zipInflateParallel(const void *src, size_t srcLen, void *dst, size_t dstLen, unsigned int threads)
+{
+    if(!threads)
+        threads = Thread::HardwareConcurrency();
+    threads = (unsigned int)std::min<size_t>(threads, srcLen / MIN_CHUNK);
+    if(threads < 2)
+        return zipInflate(src, srcLen, dst, dstLen);
+
+    std::vector<ChunkInflater*> infs(threads - 1);
+    for(unsigned int i = 0; i < threads - 1; ++i)
+        infs[i] = new ChunkInflater((const u8*)src, srcLen);
+    const bool ok = inflateChunks((const u8*)src, srcLen, (u8*)dst, dstLen, infs);
+    for(unsigned int i = 0; i < threads - 1; ++i)
+        delete infs[i];
+
+    // Anything unexpected goes the serial way, including errors
+    return ok || zipInflate(src, srcLen, dst, dstLen);
+}
+
+#else // MINIZ_LITTLE_ENDIAN && MINIZ_HAS_64BIT_REGISTERS
+
+bool zipInflate(const void *src, size_t srcLen, void *dst, size_t dstLen)
+{
+    return zipInflateTinfl(src, srcLen, dst, dstLen);
+}
+
+bool zipInflateParallel(const void *src, size_t srcLen, void *dst, size_t dstLen, unsigned int /*threads*/)
+{
+    return zipInflate(src, srcLen, dst, dstLen);
+}
+
+#endif
+
+// ---- InflateSeeker ----
+
+enum
+{
+    SEEK_DICT = TINFL_LZ_DICT_SIZE,
+    SEEK_IN_BUF = 64 * 1024
+};
+
+// Everything needed to continue decompressing from some point
+struct InflateSeeker::State
+{
+    tinfl_decompressor d;
+    vfspos inOfs, outOfs;
+    unsigned char dict[SEEK_DICT]; // the last 32K of output, wrapping around
+};
+
+InflateSeeker::InflateSeeker(vfspos srcLen, vfspos dstLen, ReadFunc readSrc, void *user,
+                             bool checkCrc /* = false */, unsigned int crc /* = 0 */, size_t spacing /* = 1024 * 1024 */)
+: _srcLen(srcLen)
+, _dstLen(dstLen)
+, _readSrc(readSrc)
+, _user(user)
+, _spacing(std::max<size_t>(spacing, SEEK_DICT))
+, _checkCrc(checkCrc)
+, _crc(crc)
+, _crcSoFar(0)
+, _crcOfs(0)
+, _failed(false)
+, _cur(NULL)
+, _inPos(0)
+, _inLen(0)
+{
+}
+
+InflateSeeker::~InflateSeeker()
+{
+    delete _cur;
+    for(size_t i = 0; i < _checkpoints.size(); ++i)
+        delete _checkpoints[i];
+}
+
+size_t InflateSeeker::memoryUsed() const
+{
+    MutexLock lock(_mtx);
+    return (_checkpoints.size() + (_cur ? 1 : 0)) * sizeof(State) + _in.capacity();
+}
+
+void InflateSeeker::_restart(const State *from)
+{
+    if(!_cur)
+        _cur = new State;
+    if(from)
+        *_cur = *from;
+    else
+    {
+        tinfl_init(&_cur->d);
+        _cur->inOfs = 0;
+        _cur->outOfs = 0;
+    }
+    _inPos = _inLen = 0;
+}
+
+// Decompresses up to the end of the dictionary buffer. Returns the number of new bytes, 0 on error.
+size_t InflateSeeker::_step()
+{
+    State& s = *_cur;
+    for(;;)
+    {
+        if(_inPos == _inLen && s.inOfs < _srcLen)
+        {
+            const size_t n = (size_t)std::min<vfspos>(_srcLen - s.inOfs, SEEK_IN_BUF);
+            _in.resize(SEEK_IN_BUF);
+            if(!_readSrc(s.inOfs, &_in[0], n, _user))
+                return 0;
+            _inPos = 0;
+            _inLen = n;
+        }
+        const size_t dictOfs = (size_t)(s.outOfs & (SEEK_DICT - 1));
+        size_t inBytes = _inLen - _inPos, outBytes = SEEK_DICT - dictOfs;
+        const mz_uint32 flags = s.inOfs + (vfspos)inBytes < _srcLen ? TINFL_FLAG_HAS_MORE_INPUT : 0;
+        const tinfl_status status = tinfl_decompress(&s.d, inBytes ? &_in[_inPos] : NULL, &inBytes,
+            s.dict, s.dict + dictOfs, &outBytes, flags);
+        _inPos += inBytes;
+        s.inOfs += inBytes;
+        s.outOfs += outBytes;
+        if(status < TINFL_STATUS_DONE || s.outOfs > _dstLen)
+            return 0;
+        if(outBytes)
+            return outBytes;
+        if(status != TINFL_STATUS_NEEDS_MORE_INPUT || s.inOfs >= _srcLen)
+            return 0; // ended early or stuck
+    }
+}
+
+size_t InflateSeeker::read(vfspos ofs, void *dst, size_t bytes)
+{
+    MutexLock lock(_mtx);
+    if(_failed || ofs >= _dstLen)
+        return 0;
+    bytes = (size_t)std::min<vfspos>(bytes, _dstLen - ofs);
+    const vfspos end = ofs + bytes;
+
+    // Continue from the current state if it is close enough, otherwise from the closest checkpoint before ofs
+    size_t cp = _checkpoints.size();
+    while(cp && _checkpoints[cp - 1]->outOfs > ofs)
+        --cp;
+    const vfspos cpOfs = cp ? _checkpoints[cp - 1]->outOfs : 0;
+    if(!_cur || ofs + SEEK_DICT < _cur->outOfs || _cur->outOfs < cpOfs)
+        _restart(cp ? _checkpoints[cp - 1] : NULL);
+
+    // Whatever is still in the dictionary can be copied from there
+    unsigned char *out = (unsigned char*)dst;
+    vfspos pos = ofs;
+    while(pos < end && pos < _cur->outOfs)
+    {
+        const size_t at = (size_t)(pos & (SEEK_DICT - 1));
+        const size_t n = (size_t)std::min<vfspos>(std::min<vfspos>(SEEK_DICT - at, end - pos), _cur->outOfs - pos);
+        memcpy(out + (size_t)(pos - ofs), _cur->dict + at, n);
+        pos += n;
+    }
+
+    while(pos < end)
+    {
+        const size_t n = _step();
+        if(!n)
+        {
+            // Broken stream or read error; start over next time
+            delete _cur;
+            _cur = NULL;
+            break;
+        }
+        const State& s = *_cur;
+        const vfspos from = s.outOfs - n;
+        const unsigned char *produced = s.dict + (size_t)(from & (SEEK_DICT - 1));
+
+        if(_checkCrc && s.outOfs > _crcOfs)
+        {
+            const size_t skip = (size_t)(_crcOfs - from); // output can't skip ahead of _crcOfs
+            _crcSoFar = zipCrc32(_crcSoFar, produced + skip, n - skip);
+            _crcOfs = s.outOfs;
+            if(_crcOfs == _dstLen && _crcSoFar != _crc)
+            {
+                _failed = true;
+                break;
+            }
+        }
+
+        if(s.outOfs > pos)
+        {
+            const size_t k = (size_t)(std::min(end, s.outOfs) - pos);
+            memcpy(out + (size_t)(pos - ofs), produced + (size_t)(pos - from), k);
+            pos += k;
+        }
+
+        const vfspos last = _checkpoints.empty() ? 0 : _checkpoints.back()->outOfs;
+        if(s.outOfs >= last + (vfspos)_spacing && s.outOfs < _dstLen)
+            _checkpoints.push_back(new State(s));
+    }
+    return _failed ? 0 : (size_t)(pos - ofs);
+}
+
+VFS_NAMESPACE_END
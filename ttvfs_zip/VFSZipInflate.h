@@ -0,0 +1,67 @@
+#ifndef VFS_ZIP_INFLATE_H
+#define VFS_ZIP_INFLATE_H
+
+#include "VFSDefines.h"
+#include "VFSThreads.h"
+#include <stddef.h>
+#include <vector>
+
+VFS_NAMESPACE_START
+
+// Decompresses a complete raw deflate stream into a buffer that must be filled exactly.
+// Same results as miniz' tinfl, but faster on 64-bit little-endian CPUs.
+bool zipInflate(const void *src, size_t srcLen, void *dst, size_t dstLen);
+
+// Like zipInflate(), but splits large streams across up to 'threads' threads (0: one per CPU).
+// Chunks are decoded speculatively from guessed block boundaries and only used if they line up,
+// so the result is always the same as zipInflate()'s.
+bool zipInflateParallel(const void *src, size_t srcLen, void *dst, size_t dstLen, unsigned int threads = 0);
+
+// Always uses tinfl. For comparison.
+bool zipInflateTinfl(const void *src, size_t srcLen, void *dst, size_t dstLen);
+
+// Random access into a raw deflate stream that is too large to unpack at once.
+// The decompressor state is saved every 'spacing' bytes of output on the way,
+// so that a read only has to decompress from the closest of these checkpoints.
+// Reads are thread-safe, but serialized.
+class InflateSeeker
+{
+public:
+    typedef bool (*ReadFunc)(vfspos ofs, void *dst, size_t bytes, void *user); // compressed data
+
+    // If checkCrc is set, the data is checked against crc once the end of the stream is reached.
+    // After a mismatch, all reads fail. Read errors only fail the current read.
+    InflateSeeker(vfspos srcLen, vfspos dstLen, ReadFunc readSrc, void *user,
+        bool checkCrc = false, unsigned int crc = 0, size_t spacing = 1024 * 1024);
+    ~InflateSeeker();
+
+    size_t read(vfspos ofs, void *dst, size_t bytes);
+    size_t memoryUsed() const;
+
+private:
+    InflateSeeker(const InflateSeeker&);
+    InflateSeeker& operator=(const InflateSeeker&);
+
+    struct State;
+    void _restart(const State *from);
+    size_t _step();
+
+    const vfspos _srcLen, _dstLen;
+    const ReadFunc _readSrc;
+    void * const _user;
+    const size_t _spacing;
+    const bool _checkCrc;
+    const unsigned int _crc;
+    unsigned int _crcSoFar; // of all output before _crcOfs
+    vfspos _crcOfs;
+    bool _failed;
+    State *_cur; // NULL if not started yet
+    std::vector<State*> _checkpoints; // ascending; the start of the stream is not stored
+    std::vector<unsigned char> _in; // compressed data read ahead
+    size_t _inPos, _inLen;
+    mutable Mutex _mtx;
+};
+
+VFS_NAMESPACE_END
+
+#endif
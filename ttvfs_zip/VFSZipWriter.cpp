@@ -0,0 +1,542 @@
+#include "VFSInternal.h"
+#include "VFSZipWriter.h"
+#include "VFSZipFormat.h"
+#include "VFSZipCrc.h"
+#include "VFSThreads.h"
+#include "VFSFile.h"
+#include <string.h>
+#include <set>
+#include <map>
+#include <algorithm>
+#include "miniz.h"
+
+VFS_NAMESPACE_START
+
+static const vfspos ZIP_MAX_OFS = 0xFFFFFFFF;
+static const size_t ZIP_MAX_ENTRIES = 0xFFFF;
+static const unsigned int ZIP_MAX_ALIGN = 0x8000; // so that the padding fits into an extra field
+
+static void zip_dostime(time_t t, unsigned short& dosTime, unsigned short& dosDate)
+{
+    const struct tm *tm = t ? localtime(&t) : NULL;
+    if(!tm || tm->tm_year < 80)
+    {
+        dosTime = 0;
+        dosDate = (1 << 5) | 1; // 1980-01-01
+        return;
+    }
+    dosTime = (unsigned short)((tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec >> 1));
+    dosDate = (unsigned short)(((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday);
+}
+
+
+ZipWriter::ZipWriter(int level /* = 6 */)
+: _level(level < 0 ? MZ_DEFAULT_LEVEL : std::min(level, (int)MZ_UBER_COMPRESSION))
+, _minSavings(0)
+, _dedup(false)
+, _readBack(NULL)
+, _readBackUser(NULL)
+, _onWritten(NULL)
+, _onWrittenUser(NULL)
+, _align(0)
+, _padding(0)
+, _base(0)
+, _streamed(false)
+, _ofs(0)
+, _cdRecords(0)
+{
+    setTime(time(NULL));
+}
+
+ZipWriter::~ZipWriter()
+{
+    for(size_t i = 0; i < _entries.size(); ++i)
+        delete _entries[i];
+}
+
+void ZipWriter::setTime(time_t t)
+{
+    zip_dostime(t, _dosTime, _dosDate);
+}
+
+bool ZipWriter::setAlignment(unsigned int align)
+{
+    if(align > ZIP_MAX_ALIGN || (align & (align - 1)))
+        return false;
+    _align = align > 1 ? align : 0;
+    return true;
+}
+
+void ZipWriter::setMinSavings(unsigned int percent)
+{
+    _minSavings = std::min(percent, 100u);
+}
+
+void ZipWriter::setDedup(bool on, ZipReadBackFunc readBack /* = NULL */, void *user /* = NULL */)
+{
+    _dedup = on;
+    _readBack = readBack;
+    _readBackUser = user;
+}
+
+ZipWriter::Entry& ZipWriter::_newEntry(const char *name, bool store)
+{
+    std::map<std::string, size_t>::iterator it = _byName.find(name);
+    Entry *e;
+    if(it != _byName.end())
+    {
+        e = _entries[it->second];
+
+        // Duplicates of the old data get a copy of it, or keep pointing to where it was written
+        for(size_t i = it->second + 1; i < _entries.size(); ++i)
+        {
+            Entry& d = *_entries[i];
+            if(d.dupOf != it->second || d.written)
+                continue;
+            d.method = e->method;
+            if(e->written)
+            {
+                d.packedSize = e->packedSize;
+                d.headerOfs = e->headerOfs;
+                d.written = true;
+            }
+            else
+            {
+                d.data = e->data;
+                d.dupOf = NO_DUP;
+            }
+        }
+    }
+    else
+    {
+        e = new Entry;
+        e->name = name;
+        _byName[e->name] = _entries.size();
+        _entries.push_back(e);
+    }
+    e->size = 0;
+    e->crc = 0;
+    e->packedSize = 0;
+    e->headerOfs = 0;
+    e->method = ZIP_METHOD_STORED;
+    e->dosTime = _dosTime;
+    e->dosDate = _dosDate;
+    e->store = store;
+    e->hashed = false;
+    e->packed = false;
+    e->checked = false;
+    e->written = false;
+    e->dupOf = NO_DUP;
+    return *e;
+}
+
+void ZipWriter::add(const char *name, const void *data, size_t size, bool store /* = false */)
+{
+    Entry& e = _newEntry(name, store);
+    e.data.assign((const char*)data, (const char*)data + size);
+}
+
+void ZipWriter::take(const char *name, std::vector<char>& data, bool store /* = false */)
+{
+    Entry& e = _newEntry(name, store);
+    e.data.clear();
+    e.data.swap(data);
+}
+
+void ZipWriter::addPacked(const char *name, std::vector<char>& data, unsigned int size, unsigned int crc, unsigned short method)
+{
+    Entry& e = _newEntry(name, false);
+    e.data.clear();
+    e.data.swap(data);
+    e.size = size;
+    e.crc = crc;
+    e.method = method;
+    e.hashed = true;
+    e.packed = true;
+}
+
+void ZipWriter::setWrittenCallback(ZipEntryFunc f, void *user)
+{
+    _onWritten = f;
+    _onWrittenUser = user;
+}
+
+void ZipWriter::keep(vfspos base, const void *cd, size_t size, size_t records)
+{
+    _base = base;
+    _cd.assign((const char*)cd, (const char*)cd + size);
+    _cdRecords = records;
+}
+
+void ZipWriter::setComment(const void *comment, size_t len)
+{
+    _comment.assign((const char*)comment, (const char*)comment + std::min<size_t>(len, 0xFFFF));
+}
+
+void ZipWriter::_hashEntry(size_t i, unsigned int, void *arg)
+{
+    Entry& e = *((ZipWriter*)arg)->_entries[i];
+    if(e.packed || e.hashed || e.data.size() >= ZIP_MAX_OFS)
+        return;
+    e.size = (unsigned int)e.data.size();
+    e.crc = zipCrc32(0, e.data.empty() ? NULL : &e.data[0], e.data.size());
+    e.hashed = true;
+}
+
+// Marks entries whose data is the same as that of an earlier entry, before anything is compressed twice
+void ZipWriter::_findDups()
+{
+    typedef std::map<std::pair<unsigned int, unsigned int>, std::vector<size_t> > Buckets;
+    Buckets buckets; // by crc and size
+    std::vector<char> buf, oldBuf;
+    for(size_t i = 0; i < _entries.size(); ++i)
+    {
+        Entry& e = *_entries[i];
+        if(!e.hashed || !e.size || e.dupOf != NO_DUP)
+            continue;
+        std::vector<size_t>& same = buckets[std::make_pair(e.crc, e.size)];
+        if(e.checked)
+        {
+            same.push_back(i); // from an earlier round, can only be the original
+            continue;
+        }
+        e.checked = true;
+        const char *data = same.empty() ? NULL : _rawData(e, buf);
+        size_t k = 0;
+        if(data)
+            for( ; k < same.size(); ++k)
+            {
+                const char *old = _rawData(*_entries[same[k]], oldBuf);
+                if(old && !memcmp(old, data, e.size))
+                    break;
+            }
+        if(!data || k == same.size())
+        {
+            same.push_back(i);
+            continue;
+        }
+        e.dupOf = same[k];
+        e.packed = true;
+        std::vector<char>().swap(e.data);
+    }
+}
+
+// Uncompressed data of an entry, read back into 'buf' if it is compressed or written already
+const char *ZipWriter::_rawData(const Entry& e, std::vector<char>& buf) const
+{
+    if(!e.packed)
+        return &e.data[0];
+    buf.resize(e.size);
+    if(!_readBack || !_readBack(e.name.c_str(), &buf[0], e.size, _readBackUser))
+        return NULL;
+    return &buf[0];
+}
+
+// Each entry is a complete deflate stream of its own, so entries don't depend on each other
+void ZipWriter::_compressEntry(size_t i, unsigned int, void *arg)
+{
+    ZipWriter *self = (ZipWriter*)arg;
+    Entry& e = *self->_entries[i];
+    if(e.packed)
+        return;
+    e.packed = true;
+    if(e.data.size() >= ZIP_MAX_OFS)
+        return; // write() will fail
+    if(!e.hashed)
+    {
+        e.size = (unsigned int)e.data.size();
+        e.crc = zipCrc32(0, e.data.empty() ? NULL : &e.data[0], e.data.size());
+    }
+    e.method = ZIP_METHOD_STORED;
+    if(!self->_level || e.store || e.data.empty())
+        return;
+
+    // Only worth it if the result is small enough; if it doesn't fit, the entry is stored
+    const size_t cap = (size_t)((vfspos)e.data.size() * (100 - self->_minSavings) / 100);
+    if(!cap)
+        return;
+    std::vector<char> out(cap);
+    const mz_uint flags = tdefl_create_comp_flags_from_zip_params(self->_level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    const size_t len = tdefl_compress_mem_to_mem(&out[0], out.size(), &e.data[0], e.data.size(), flags);
+    if(!len || len >= e.data.size())
+        return;
+    out.resize(len);
+    std::vector<char>(out).swap(e.data); // don't keep the slack around
+    e.method = ZIP_METHOD_DEFLATED;
+}
+
+void ZipWriter::compress(unsigned int threads /* = 0 */)
+{
+    if(_dedup)
+    {
+        ParallelFor(_entries.size(), _hashEntry, this, threads);
+        _findDups();
+    }
+    ParallelFor(_entries.size(), _compressEntry, this, threads);
+}
+
+// Local header and data of one entry; a duplicate only takes over where its data was written
+void ZipWriter::_reportWritten(const Entry& e, const char *dupOf) const
+{
+    if(!_onWritten)
+        return;
+    ZipPackedEntry pe;
+    pe.name = e.name.c_str();
+    pe.data = dupOf || e.data.empty() ? NULL : &e.data[0];
+    pe.packedSize = e.packedSize;
+    pe.size = e.size;
+    pe.crc = e.crc;
+    pe.method = e.method;
+    pe.dupOf = dupOf;
+    _onWritten(pe, _onWrittenUser);
+}
+
+bool ZipWriter::_writeEntry(size_t i, vfspos& ofs, ZipWriteFunc out, void *user)
+{
+    Entry& e = *_entries[i];
+    if(e.dupOf != NO_DUP)
+    {
+        const Entry& d = *_entries[e.dupOf];
+        e.method = d.method;
+        e.packedSize = d.packedSize;
+        e.headerOfs = d.headerOfs;
+        _reportWritten(e, d.name.c_str());
+        return true;
+    }
+    const size_t nameLen = std::min<size_t>(e.name.length(), 0xFFFF);
+    if(e.size != e.data.size() && e.method == ZIP_METHOD_STORED)
+        return false; // too large
+
+    // Compressed data can't be used in place, so only stored entries are aligned
+    size_t extraLen = 0;
+    unsigned char extra[ZIP_ALIGN_EXTRA_MIN_SIZE];
+    if(_align && e.method == ZIP_METHOD_STORED && !e.data.empty())
+    {
+        const vfspos dataOfs = ofs + ZIP_LDH_SIZE + nameLen;
+        extraLen = (size_t)((_align - dataOfs % _align) % _align);
+        while(extraLen && extraLen < ZIP_ALIGN_EXTRA_MIN_SIZE) // several steps for alignments below 8
+            extraLen += _align;
+        zipWrite16(&extra[0], ZIP_ALIGN_EXTRA_ID);
+        zipWrite16(&extra[2], (unsigned int)(extraLen - 4));
+        zipWrite16(&extra[4], _align);
+    }
+    if(ofs + ZIP_LDH_SIZE + nameLen + extraLen + e.data.size() > ZIP_MAX_OFS)
+        return false;
+
+    unsigned char hdr[ZIP_LDH_SIZE];
+    memset(hdr, 0, ZIP_LDH_SIZE);
+    zipWrite32(hdr, ZIP_LDH_SIG);
+    zipWrite16(hdr + ZIP_LDH_VERSION_NEEDED_OFS, ZIP_VERSION_NEEDED);
+    zipWrite16(hdr + ZIP_LDH_METHOD_OFS, e.method);
+    zipWrite16(hdr + ZIP_LDH_FILE_TIME_OFS, e.dosTime);
+    zipWrite16(hdr + ZIP_LDH_FILE_DATE_OFS, e.dosDate);
+    zipWrite32(hdr + ZIP_LDH_CRC32_OFS, e.crc);
+    zipWrite32(hdr + ZIP_LDH_COMP_SIZE_OFS, (unsigned int)e.data.size());
+    zipWrite32(hdr + ZIP_LDH_UNCOMP_SIZE_OFS, e.size);
+    zipWrite16(hdr + ZIP_LDH_NAME_LEN_OFS, (unsigned int)nameLen);
+    zipWrite16(hdr + ZIP_LDH_EXTRA_LEN_OFS, (unsigned int)extraLen);
+    if(!out(hdr, ZIP_LDH_SIZE, user) || !out(e.name.c_str(), nameLen, user))
+        return false;
+    if(extraLen)
+    {
+        if(!out(extra, ZIP_ALIGN_EXTRA_MIN_SIZE, user))
+            return false;
+        static const char zeros[256] = { 0 };
+        for(size_t left = extraLen - ZIP_ALIGN_EXTRA_MIN_SIZE; left; )
+        {
+            const size_t n = std::min(left, sizeof(zeros));
+            if(!out(zeros, n, user))
+                return false;
+            left -= n;
+        }
+    }
+    if(!e.data.empty() && !out(&e.data[0], e.data.size(), user))
+        return false;
+
+    e.packedSize = (unsigned int)e.data.size();
+    e.headerOfs = ofs;
+    _reportWritten(e, NULL);
+    ofs += ZIP_LDH_SIZE + nameLen + extraLen + e.data.size();
+    _padding += extraLen;
+    return true;
+}
+
+// Central directory, starting at 'ofs': kept old records first, so that their order stays the same,
+// then those of the new entries, then the end record
+bool ZipWriter::_writeDirectory(vfspos ofs, ZipWriteFunc out, void *user)
+{
+    const vfspos cdofs = ofs;
+    std::set<std::string> replaced;
+    size_t newSize = 0;
+    for(size_t i = 0; i < _entries.size(); ++i)
+    {
+        const std::string& name = _entries[i]->name;
+        replaced.insert(zipIndexName(name.c_str(), name.length(), false));
+        newSize += ZIP_CDH_SIZE + std::min<size_t>(name.length(), 0xFFFF);
+    }
+
+    size_t pos = 0;
+    size_t kept = 0;
+    for(size_t i = 0; i < _cdRecords; ++i)
+    {
+        if(pos + ZIP_CDH_SIZE > _cd.size())
+            return false;
+        const char *h = &_cd[pos];
+        if(zipRead32(h) != ZIP_CDH_SIG)
+            return false;
+        const size_t nameLen = zipRead16(h + ZIP_CDH_NAME_LEN_OFS);
+        const size_t len = ZIP_CDH_SIZE + nameLen + zipRead16(h + ZIP_CDH_EXTRA_LEN_OFS) + zipRead16(h + ZIP_CDH_COMMENT_LEN_OFS);
+        if(pos + len > _cd.size())
+            return false;
+        pos += len;
+        // Replaced if the archive index would find the new entry under the old name
+        const bool isDir = (zipRead32(h + ZIP_CDH_EXTERNAL_ATTR_OFS) & ZIP_DOS_DIR_ATTRIB) != 0;
+        if(replaced.count(zipIndexName(h + ZIP_CDH_SIZE, nameLen, isDir)))
+            continue;
+        if(!out(h, len, user))
+            return false;
+        ofs += len;
+        ++kept;
+    }
+    const size_t records = _entries.size() + kept;
+    if(ofs + newSize > ZIP_MAX_OFS || records > ZIP_MAX_ENTRIES)
+        return false;
+
+    unsigned char hdr[ZIP_CDH_SIZE];
+    for(size_t i = 0; i < _entries.size(); ++i)
+    {
+        const Entry& e = *_entries[i];
+        const size_t nameLen = std::min<size_t>(e.name.length(), 0xFFFF);
+        memset(hdr, 0, ZIP_CDH_SIZE);
+        zipWrite32(hdr, ZIP_CDH_SIG);
+        zipWrite16(hdr + ZIP_CDH_VERSION_MADE_BY_OFS, ZIP_VERSION_NEEDED);
+        zipWrite16(hdr + ZIP_CDH_VERSION_NEEDED_OFS, ZIP_VERSION_NEEDED);
+        zipWrite16(hdr + ZIP_CDH_METHOD_OFS, e.method);
+        zipWrite16(hdr + ZIP_CDH_FILE_TIME_OFS, e.dosTime);
+        zipWrite16(hdr + ZIP_CDH_FILE_DATE_OFS, e.dosDate);
+        zipWrite32(hdr + ZIP_CDH_CRC32_OFS, e.crc);
+        zipWrite32(hdr + ZIP_CDH_COMP_SIZE_OFS, e.packedSize);
+        zipWrite32(hdr + ZIP_CDH_UNCOMP_SIZE_OFS, e.size);
+        zipWrite16(hdr + ZIP_CDH_NAME_LEN_OFS, (unsigned int)nameLen);
+        zipWrite32(hdr + ZIP_CDH_LOCAL_HEADER_OFS, (unsigned int)e.headerOfs);
+        if(!out(hdr, ZIP_CDH_SIZE, user) || !out(e.name.c_str(), nameLen, user))
+            return false;
+    }
+    ofs += newSize;
+
+    unsigned char eocd[ZIP_EOCD_SIZE];
+    memset(eocd, 0, ZIP_EOCD_SIZE);
+    zipWrite32(eocd, ZIP_EOCD_SIG);
+    zipWrite16(eocd + ZIP_EOCD_NUM_ENTRIES_ON_DISK_OFS, (unsigned int)records);
+    zipWrite16(eocd + ZIP_EOCD_NUM_ENTRIES_OFS, (unsigned int)records);
+    zipWrite32(eocd + ZIP_EOCD_CDIR_SIZE_OFS, (unsigned int)(ofs - cdofs));
+    zipWrite32(eocd + ZIP_EOCD_CDIR_OFS_OFS, (unsigned int)cdofs);
+    zipWrite16(eocd + ZIP_EOCD_COMMENT_LEN_OFS, (unsigned int)_comment.size());
+    return out(eocd, ZIP_EOCD_SIZE, user)
+        && (_comment.empty() || out(&_comment[0], _comment.size(), user));
+}
+
+bool ZipWriter::write(ZipWriteFunc out, void *user)
+{
+    if(_streamed)
+        return false; // the data is gone
+    compress();
+
+    vfspos ofs = _base;
+    _padding = 0;
+    for(size_t i = 0; i < _entries.size(); ++i)
+        if(!_writeEntry(i, ofs, out, user))
+            return false;
+    return _writeDirectory(ofs, out, user);
+}
+
+bool ZipWriter::writeEntries(ZipWriteFunc out, void *user, unsigned int threads /* = 0 */)
+{
+    compress(threads);
+    if(!_streamed)
+    {
+        _streamed = true;
+        _ofs = _base;
+        _padding = 0;
+    }
+    for(size_t i = 0; i < _entries.size(); ++i)
+    {
+        Entry& e = *_entries[i];
+        if(e.written)
+            continue;
+        if(!_writeEntry(i, _ofs, out, user))
+            return false;
+        e.written = true;
+        std::vector<char>().swap(e.data);
+    }
+    return true;
+}
+
+bool ZipWriter::finish(ZipWriteFunc out, void *user, unsigned int threads /* = 0 */)
+{
+    return writeEntries(out, user, threads) && _writeDirectory(_ofs, out, user);
+}
+
+static bool zip_writeFile(const void *data, size_t bytes, void *user)
+{
+    return ((File*)user)->write(data, bytes) == bytes;
+}
+
+static bool zip_writeVector(const void *data, size_t bytes, void *user)
+{
+    std::vector<char>& v = *(std::vector<char>*)user;
+    v.insert(v.end(), (const char*)data, (const char*)data + bytes);
+    return true;
+}
+
+bool ZipWriter::write(File *out)
+{
+    return write(zip_writeFile, out);
+}
+
+bool ZipWriter::write(std::vector<char>& out)
+{
+    return write(zip_writeVector, &out);
+}
+
+vfspos ZipWriter::uncompressedSize() const
+{
+    vfspos sz = 0;
+    for(size_t i = 0; i < _entries.size(); ++i)
+        sz += _entries[i]->packed || _entries[i]->hashed ? _entries[i]->size : _entries[i]->data.size();
+    return sz;
+}
+
+vfspos ZipWriter::compressedSize() const
+{
+    vfspos sz = 0;
+    for(size_t i = 0; i < _entries.size(); ++i)
+    {
+        const Entry& e = *_entries[i];
+        if(e.packed && e.dupOf == NO_DUP)
+            sz += e.written ? e.packedSize : e.data.size();
+    }
+    return sz;
+}
+
+size_t ZipWriter::storedCount() const
+{
+    size_t n = 0;
+    for(size_t i = 0; i < _entries.size(); ++i)
+    {
+        const Entry& e = *_entries[i];
+        n += e.packed && e.dupOf == NO_DUP && e.method == ZIP_METHOD_STORED && e.size;
+    }
+    return n;
+}
+
+size_t ZipWriter::dupCount() const
+{
+    size_t n = 0;
+    for(size_t i = 0; i < _entries.size(); ++i)
+        n += _entries[i]->dupOf != NO_DUP;
+    return n;
+}
+
+
+VFS_NAMESPACE_END
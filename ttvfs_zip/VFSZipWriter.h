@@ -0,0 +1,158 @@
+#ifndef VFS_ZIP_WRITER_H
+#define VFS_ZIP_WRITER_H
+
+// Builds zip archives, or the part of an archive that is appended to an existing one.
+// Entries are collected in memory and deflated independently of each other, so that they can be
+// compressed on all CPUs at once. They are written in the order they were added.
+// No zip64, so archives must stay below 4 GB and 65535 entries.
+
+#include "VFSDefines.h"
+#include <stddef.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+
+VFS_NAMESPACE_START
+
+class File;
+
+// Receives the archive data in order. Return false to stop writing.
+typedef bool (*ZipWriteFunc)(const void *data, size_t bytes, void *user);
+
+// Provides the uncompressed data of the entry 'name' again, exactly 'bytes' of it. Return false if that fails.
+typedef bool (*ZipReadBackFunc)(const char *name, void *dst, size_t bytes, void *user);
+
+// An entry's data as it goes into the archive
+struct ZipPackedEntry
+{
+    const char *name;
+    const void *data; // compressed with 'method', NULL for a duplicate
+    unsigned int packedSize;
+    unsigned int size; // uncompressed
+    unsigned int crc; // of the uncompressed data
+    unsigned short method;
+    const char *dupOf; // name of the earlier entry whose data is used, or NULL
+};
+typedef void (*ZipEntryFunc)(const ZipPackedEntry& e, void *user);
+
+class ZipWriter
+{
+public:
+    ZipWriter(int level = 6); // deflate level, 0 stores everything, < 0 for the default
+    ~ZipWriter();
+
+    // Adding an entry with the same name again replaces the data added before.
+    // With 'store', the entry is not compressed, e.g. because its format is compressed already.
+    void add(const char *name, const void *data, size_t size, bool store = false);
+    void take(const char *name, std::vector<char>& data, bool store = false); // takes over the data, leaves 'data' empty
+    inline size_t count() const { return _entries.size(); }
+
+    // Adds an entry that is compressed already, e.g. as it was written by an earlier run, see setWrittenCallback().
+    // Takes over 'data'. The caller vouches that it is what compressing the entry here would make,
+    // otherwise the archive is not the same as one built from scratch.
+    void addPacked(const char *name, std::vector<char>& data, unsigned int size, unsigned int crc, unsigned short method);
+
+    // Called whenever an entry is written, including duplicates, which refer to the written entry
+    void setWrittenCallback(ZipEntryFunc f, void *user);
+
+    // Entries are stored instead if deflating them doesn't save at least this many percent. The default is 0.
+    void setMinSavings(unsigned int percent);
+
+    // Entries with the same content as an earlier one are written only once:
+    // their central directory records point to the earlier entry's local header.
+    // ttvfs reads such archives fine, but Info-ZIP's unzip rejects overlapping entries, and Python's zipfile
+    // checks that the names in both headers are the same. So only for archives read by ttvfs. Off by default.
+    // Entries whose data is gone already (compressed by an earlier compress() or written by writeEntries())
+    // are compared through 'readBack'; without it, later entries are not checked against them.
+    void setDedup(bool on, ZipReadBackFunc readBack = NULL, void *user = NULL);
+
+    // Modification time stored for entries added afterwards. The default is the time the writer was created.
+    void setTime(time_t t);
+
+    // The data of stored entries starts at a multiple of 'align' bytes from the start of the file,
+    // padded with an extra field in the local header. So it can be used in place from an archive that is
+    // mapped or embedded with that alignment, see ZipArchiveRef::getStoredEntryPtr().
+    // A power of 2 up to 32768; 0 or 1 is off (the default). Returns false if 'align' is not supported.
+    bool setAlignment(unsigned int align);
+
+    // For appending: the new entries are written from 'base' on, usually the old central directory's offset,
+    // followed by the central directory records in 'cd' (copied) and those of the new entries.
+    // Old records with the name of a new entry are dropped, so the new entry replaces them.
+    void keep(vfspos base, const void *cd, size_t size, size_t records);
+    void setComment(const void *comment, size_t len); // of the whole archive
+
+    // Compresses all entries that are not compressed yet, on up to 'threads' threads (0: one per CPU).
+    // The uncompressed data is freed afterwards. Called by write() if necessary.
+    void compress(unsigned int threads = 0);
+
+    // Writes everything. Entries and kept records stay, so the same archive can be written again.
+    bool write(ZipWriteFunc out, void *user);
+    bool write(File *out); // at the file's current position
+    bool write(std::vector<char>& out); // appends to 'out'
+
+    // Streaming, for archives that don't fit into memory: writes the entries added since the last call,
+    // compressing them first, and frees their data. finish() then writes the central directory.
+    // The result is the same as that of write() with all entries, which can't be used afterwards.
+    bool writeEntries(ZipWriteFunc out, void *user, unsigned int threads = 0);
+    bool finish(ZipWriteFunc out, void *user, unsigned int threads = 0);
+
+    // Total sizes of the entries added so far
+    vfspos uncompressedSize() const;
+    vfspos compressedSize() const; // of those that are compressed already, without duplicates
+    size_t storedCount() const; // entries that are compressed already but stored
+    size_t dupCount() const; // entries found to be duplicates by compress()
+    inline vfspos paddingSize() const { return _padding; } // added for the alignment by the last write(), or so far
+
+protected:
+    struct Entry
+    {
+        std::string name;
+        std::vector<char> data; // uncompressed until compress(), then what is written
+        unsigned int size; // uncompressed
+        unsigned int crc;
+        unsigned int packedSize; // these two are known once written
+        vfspos headerOfs;
+        unsigned short method;
+        unsigned short dosTime, dosDate;
+        bool store;
+        bool hashed; // size and crc are set
+        bool packed;
+        bool checked; // for duplicates
+        bool written; // by writeEntries(), the data is gone
+        size_t dupOf; // earlier entry with the same data, or NO_DUP
+    };
+    static const size_t NO_DUP = size_t(-1);
+
+    Entry& _newEntry(const char *name, bool store);
+    void _findDups();
+    const char *_rawData(const Entry& e, std::vector<char>& buf) const;
+    void _reportWritten(const Entry& e, const char *dupOf) const;
+    bool _writeEntry(size_t i, vfspos& ofs, ZipWriteFunc out, void *user);
+    bool _writeDirectory(vfspos ofs, ZipWriteFunc out, void *user);
+    static void _hashEntry(size_t i, unsigned int worker, void *arg);
+    static void _compressEntry(size_t i, unsigned int worker, void *arg);
+
+    const int _level;
+    unsigned int _minSavings;
+    bool _dedup;
+    ZipReadBackFunc _readBack;
+    void *_readBackUser;
+    ZipEntryFunc _onWritten;
+    void *_onWrittenUser;
+    std::vector<Entry*> _entries;
+    std::map<std::string, size_t> _byName; // index into _entries
+    unsigned short _dosTime, _dosDate;
+    unsigned int _align;
+    vfspos _padding;
+    vfspos _base;
+    bool _streamed; // writeEntries() was called
+    vfspos _ofs; // where writeEntries() continues
+    std::vector<char> _cd; // kept central directory records
+    size_t _cdRecords;
+    std::vector<char> _comment;
+};
+
+VFS_NAMESPACE_END
+
+#endif
@@ -1608,6 +1608,7 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
           }
         }
         if ((counter &= 511) == 256) break;
+        if (counter > 285) { TINFL_CR_RETURN_FOREVER(54, TINFL_STATUS_FAILED); } // invalid length codes 286/287 would have base 0
 
         num_extra = s_length_extra[counter - 257]; counter = s_length_base[counter - 257];
         if (num_extra) { mz_uint extra_bits; TINFL_GET_BITS(25, extra_bits, num_extra); counter += extra_bits; }
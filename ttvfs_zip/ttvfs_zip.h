@@ -2,5 +2,6 @@
 #define TTVFS_ZIP_INC_H
 
 #include "VFSZipArchiveLoader.h"
+#include "VFSDirZip.h"
 
 #endif